@@ -0,0 +1,919 @@
+#pragma once
+
+#include "JovialTileMap.h"
+#include "TileMapFile.h"
+#include "TileMapGenerator.h"
+#include "TileMapLoader.h"
+#include "TileMapPathfinder.h"
+#include "TileMapRenderer.h"
+#include "TileMapSaver.h"
+#include "TileRegion.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+using namespace jovial;
+
+// Headless benchmarks, run with: jovial_tiles -bench
+namespace benchmarks {
+
+    struct BenchTimer {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        [[nodiscard]] inline double elapsed_ms() const {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+    };
+
+    // xorshift64*, so every run generates the same maps and queries.
+    struct BenchRandom {
+        uint64_t state;
+
+        explicit BenchRandom(uint64_t seed) : state(seed ? seed : 0x9E3779B97F4A7C15ull) {}
+
+        inline uint64_t next() {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            return state * 0x2545F4914F6CDD1Dull;
+        }
+
+        inline int range(int lo, int hi) {
+            return lo + (int) (next() % (uint64_t) (hi - lo + 1));
+        }
+
+        inline float unit() {
+            return (float) (next() >> 40) / (float) (1ull << 24);
+        }
+    };
+
+    inline void report(const char *name, double ms, long count, const char *unit = "op") {
+        print("  ", name, ": ", ms, " ms total, ", ms * 1000.0 / (double) math::MAX(count, (long) 1), " us/", unit);
+    }
+
+    inline void fill_random(TileMap &map, int size, float density, BenchRandom &random) {
+        for (int y = 0; y < size; ++y) {
+            for (int x = 0; x < size; ++x) {
+                if (random.unit() < density) map.place({x, y}, {0, 0});
+            }
+        }
+    }
+
+    // Cellular automata caves, closer to real levels than plain noise.
+    inline void fill_caves(TileMap &map, int size, BenchRandom &random) {
+        Vec<uint8_t> cells, next;
+        cells.resize((long) size * size);
+        next.resize((long) size * size);
+        for (long i = 0; i < cells.size(); ++i) cells[i] = random.unit() < 0.45f;
+
+        auto wall = [&](int x, int y) {
+            if (x < 0 || y < 0 || x >= size || y >= size) return 1;
+            return (int) cells[(long) y * size + x];
+        };
+        for (int step = 0; step < 4; ++step) {
+            for (int y = 0; y < size; ++y) {
+                for (int x = 0; x < size; ++x) {
+                    int walls = 0;
+                    for (int dy = -1; dy <= 1; ++dy) {
+                        for (int dx = -1; dx <= 1; ++dx) walls += wall(x + dx, y + dy);
+                    }
+                    next[(long) y * size + x] = walls >= 5;
+                }
+            }
+            Vec<uint8_t> tmp = cells;
+            cells = next;
+            next = tmp;
+        }
+
+        for (int y = 0; y < size; ++y) {
+            for (int x = 0; x < size; ++x) {
+                if (cells[(long) y * size + x]) map.place({x, y}, {0, 0});
+            }
+        }
+    }
+
+    // The kind of A* NPC code used before the pathfinder existed: open cells found with has().
+    inline bool generic_astar(const TileMap &map, Vector2i from, Vector2i to, int size) {
+        auto open_cell = [&](Vector2i c) {
+            return c.x >= 0 && c.y >= 0 && c.x < size && c.y < size && !map.has(c);
+        };
+        auto h = [&](Vector2i c) {
+            int dx = c.x > to.x ? c.x - to.x : to.x - c.x;
+            int dy = c.y > to.y ? c.y - to.y : to.y - c.y;
+            return (float) math::MAX(dx, dy) + 0.41421356f * (float) math::MIN(dx, dy);
+        };
+
+        HashMap<Vector2i, float> g;
+        HashMap<Vector2i, bool> closed;
+        Vec<Pair<float, Vector2i>> open;
+        g.insert(from, 0.0f);
+        open.push_back({h(from), from});
+
+        while (!open.is_empty()) {
+            long best = 0;
+            for (long i = 1; i < open.size(); ++i) {
+                if (open[i].first < open[best].first) best = i;
+            }
+            Vector2i cur = open[best].second;
+            open.remove_at(best);
+            if (cur == to) return true;
+            if (closed.has(cur)) continue;
+            closed.insert(cur, true);
+
+            for (auto dir: TileMap::coords_around(cur)) {
+                Vector2i next = cur + dir;
+                if (!open_cell(next)) continue;
+                if (dir.x != 0 && dir.y != 0 && (!open_cell({cur.x + dir.x, cur.y}) || !open_cell({cur.x, cur.y + dir.y}))) continue;
+                float ng = g.get(cur) + (dir.x != 0 && dir.y != 0 ? 1.41421356f : 1.0f);
+                float *old = g.getptr(next);
+                if (old && *old <= ng) continue;
+                g.insert(next, ng);
+                open.push_back({ng + h(next), next});
+            }
+        }
+        return false;
+    }
+
+    inline void bench_pathfinding(int size, bool caves, int query_count) {
+        print("Pathfinding ", size, "x", size, caves ? " caves, " : " 25% noise, ", query_count, " queries");
+
+        BenchRandom random(1234 + size);
+        TileMap map;
+        if (caves) fill_caves(map, size, random);
+        else fill_random(map, size, 0.25f, random);
+
+        BenchTimer build_timer;
+        TileMapPathfinder pathfinder(&map, {0, 0}, {size - 1, size - 1});
+        report("build grid", build_timer.elapsed_ms(), 1, "build");
+
+        Vec<TileMapPathfinder::PathQuery> queries;
+        while (queries.size() < query_count) {
+            Vector2i a(random.range(0, size - 1), random.range(0, size - 1));
+            Vector2i b(random.range(0, size - 1), random.range(0, size - 1));
+            if (pathfinder.is_walkable(a) && pathfinder.is_walkable(b)) queries.push_back({a, b});
+        }
+
+        int generic_count = math::MIN(query_count, size >= 512 ? 20 : 100);
+        BenchTimer generic_timer;
+        for (int i = 0; i < generic_count; ++i) {
+            generic_astar(map, queries[i].from, queries[i].to, size);
+        }
+        report("generic A* over has()", generic_timer.elapsed_ms(), generic_count, "query");
+
+        TileMapPathfinder::PathResult result;
+        long found = 0;
+        BenchTimer jps_timer;
+        for (auto &query: queries) found += pathfinder.find_path(query.from, query.to, result);
+        report("JPS", jps_timer.elapsed_ms(), query_count, "query");
+        print("    found ", found, "/", query_count);
+
+        BenchTimer abstract_timer;
+        pathfinder.set_hierarchical(true);
+        pathfinder.flush();
+        report("HPA* graph build", abstract_timer.elapsed_ms(), 1, "build");
+
+        pathfinder.refine_paths = false;
+        BenchTimer hpa_timer;
+        for (auto &query: queries) pathfinder.find_path(query.from, query.to, result);
+        report("HPA* waypoints", hpa_timer.elapsed_ms(), query_count, "query");
+
+        pathfinder.refine_paths = true;
+        BenchTimer refined_timer;
+        for (auto &query: queries) pathfinder.find_path(query.from, query.to, result);
+        report("HPA* refined", refined_timer.elapsed_ms(), query_count, "query");
+
+        int threads = (int) math::MAX(std::thread::hardware_concurrency(), 1u);
+        Vec<TileMapPathfinder::PathResult> results;
+        BenchTimer batch_timer;
+        pathfinder.find_paths(queries, results, threads);
+        report("HPA* refined batch", batch_timer.elapsed_ms(), query_count, "query");
+
+        int edits = 100;
+        BenchTimer edit_timer;
+        for (int i = 0; i < edits; ++i) {
+            Vector2i c(random.range(0, size - 1), random.range(0, size - 1));
+            if (map.has(c)) map.erase(c);
+            else map.place(c, {0, 0});
+            pathfinder.flush();
+        }
+        report("incremental update", edit_timer.elapsed_ms(), edits, "edit");
+    }
+
+    // The blob map as it was before the auto tile policies: a virtual place_auto and a
+    // direction switch per neighbour
+    class VirtualBlobTileMap : public TileMap {
+    public:
+        Array<Vector2i, 256> blob_tiles;
+
+        int calc_blob(Vector2i coord) {
+            int bits = 0;
+            for (int direction = 1; direction <= BlobTileMap::NW; direction *= 2) {
+                if (has(coord + BlobTileMap::get_direction_vector(direction))) {
+                    bits |= direction;
+                }
+            }
+            return bits;
+        }
+
+        void retile(Vector2i coord) override {
+            if (!has(coord)) return;
+            place(coord, blob_tiles[calc_blob(coord)]);
+        }
+
+        void place_auto(Vector2i coord) override {
+            place(coord, blob_tiles[calc_blob(coord)]);
+            for (auto dir: coords_around(coord)) retile(coord + dir);
+        }
+    };
+
+    // Keeps the compiler from devirtualizing the TileMap * calls
+    [[gnu::noinline]] inline TileMap *opaque(TileMap *map) {
+        return map;
+    }
+
+    inline void bench_autotile_dispatch(int size) {
+        print("Auto tile dispatch ", size, "x", size);
+
+        Array<Vector2i, BlobPolicy::TABLE_SIZE> blob_tiles;
+        for (int i = 0; i < blob_tiles.length; ++i) blob_tiles[i] = {i % 16, i / 16};
+
+        Vec<Vector2i> coords;
+        BenchRandom random(99);
+        for (long i = 0; i < (long) size * size / 2; ++i) {
+            coords.push_back({random.range(0, size - 1), random.range(0, size - 1)});
+        }
+
+        VirtualBlobTileMap legacy;
+        for (int mask = 0; mask < legacy.blob_tiles.length; ++mask) legacy.blob_tiles[mask] = blob_tiles[BLOB_TABLE.index_of[mask]];
+        TileMap *legacy_ptr = opaque(&legacy);
+        BenchTimer legacy_timer;
+        for (auto coord: coords) legacy_ptr->place_auto(coord);
+        report("place_auto, old virtual blob", legacy_timer.elapsed_ms(), coords.size(), "tile");
+
+        BlobTileMap erased(blob_tiles, {}, {16, 16});
+        TileMap *erased_ptr = opaque(&erased);
+        BenchTimer erased_timer;
+        for (auto coord: coords) erased_ptr->place_auto(coord);
+        report("place_auto, AutoTileMap through TileMap *", erased_timer.elapsed_ms(), coords.size(), "tile");
+
+        BlobTileMap concrete(blob_tiles, {}, {16, 16});
+        BenchTimer concrete_timer;
+        for (auto coord: coords) concrete.place_auto(coord);
+        report("place_auto, AutoTileMap<BlobPolicy>", concrete_timer.elapsed_ms(), coords.size(), "tile");
+
+        BenchTimer legacy_retile_timer;
+        for (auto &tile: legacy.tiles) legacy_ptr->retile(tile.key);
+        report("retile all, old virtual blob", legacy_retile_timer.elapsed_ms(), legacy.tiles.size(), "tile");
+
+        BenchTimer concrete_retile_timer;
+        concrete.retile_all();
+        report("retile all, AutoTileMap<BlobPolicy>", concrete_retile_timer.elapsed_ms(), concrete.tiles.size(), "tile");
+    }
+
+    inline void bench_bulk_fill(int size) {
+        print("Bulk fill ", size, "x", size);
+
+        Array<Vector2i, BlobPolicy::TABLE_SIZE> blob_tiles;
+        for (int i = 0; i < blob_tiles.length; ++i) blob_tiles[i] = {i % 16, i / 16};
+
+        int sequential_size = math::MIN(size, 200);
+        BlobTileMap sequential(blob_tiles, {}, {16, 16});
+        BenchTimer sequential_timer;
+        for (int y = 0; y < sequential_size; ++y) {
+            for (int x = 0; x < sequential_size; ++x) sequential.place_auto({x, y});
+        }
+        report("place_auto per coord", sequential_timer.elapsed_ms(), (long) sequential_size * sequential_size, "tile");
+
+        BlobTileMap rect(blob_tiles, {}, {16, 16});
+        BenchTimer rect_timer;
+        rect.fill_rect_auto({0, 0}, {size - 1, size - 1});
+        report("fill_rect_auto", rect_timer.elapsed_ms(), (long) size * size, "tile");
+
+        BlobTileMap flood(blob_tiles, {}, {16, 16});
+        BenchTimer flood_timer;
+        long filled = flood.flood_fill_auto({size / 2, size / 2}, {0, 0}, {size - 1, size - 1});
+        report("flood_fill_auto", flood_timer.elapsed_ms(), filled, "tile");
+
+        BenchTimer erase_timer;
+        rect.erase_rect_auto({0, 0}, {size - 1, size / 2});
+        report("erase_rect_auto", erase_timer.elapsed_ms(), (long) size * (size / 2 + 1), "tile");
+    }
+
+    template<typename Map>
+    inline void bench_map(const char *name, const Vec<Vector2i> &coords, const Vec<Vector2i> &misses) {
+        print("  ", name);
+        Map map;
+
+        BenchTimer insert_timer;
+        for (auto coord: coords) map.insert(coord, coord);
+        report("insert", insert_timer.elapsed_ms(), coords.size(), "op");
+
+        long found = 0;
+        BenchTimer hit_timer;
+        for (auto coord: coords) found += map.has(coord);
+        report("lookup hit", hit_timer.elapsed_ms(), coords.size(), "op");
+
+        BenchTimer miss_timer;
+        for (auto coord: misses) found += map.has(coord);
+        report("lookup miss", miss_timer.elapsed_ms(), misses.size(), "op");
+
+        BenchTimer neighbour_timer;
+        for (auto coord: coords) {
+            for (auto dir: TileMap::coords_around(coord)) found += map.has(coord + dir);
+        }
+        report("neighbour probes", neighbour_timer.elapsed_ms(), coords.size() * 8, "op");
+
+        long sum = 0;
+        BenchTimer iterate_timer;
+        for (auto &entry: map) sum += entry.value.x;
+        report("iterate", iterate_timer.elapsed_ms(), map.size(), "entry");
+
+        print("    (", found, ", ", sum, ")");
+    }
+
+    inline void bench_tile_storage(long count, int spread) {
+        print("Tile storage, ", count, " coords in ", spread, "x", spread);
+
+        BenchRandom random(7);
+        Vec<Vector2i> coords, misses;
+        for (long i = 0; i < count; ++i) {
+            coords.push_back({random.range(0, spread - 1), random.range(0, spread - 1)});
+            misses.push_back({random.range(spread, spread * 2), random.range(0, spread - 1)});
+        }
+
+        bench_map<HashMap<Vector2i, Vector2i>>("HashMap<Vector2i, Vector2i>", coords, misses);
+        bench_map<Vector2iMap<Vector2i>>("Vector2iMap<Vector2i>", coords, misses);
+    }
+
+    // Procedural world spanning +-2^20 tiles: scattered noisy islands plus a few solid plateaus
+    inline void bench_sparse_world(int islands) {
+        print("Sparse world, ", islands, " islands in +-2^20");
+
+        BenchRandom random(2024);
+        Vec<Vector2i> coords;
+        for (int i = 0; i < islands; ++i) {
+            Vector2i center(random.range(-(1 << 20), 1 << 20), random.range(-(1 << 20), 1 << 20));
+            for (int y = -48; y <= 48; ++y) {
+                for (int x = -48; x <= 48; ++x) {
+                    if (x * x + y * y < 48 * 48 && random.unit() < 0.7f) coords.push_back(center + Vector2i(x, y));
+                }
+            }
+        }
+        Vec<Vector2i> plateaus;
+        for (int i = 0; i < islands / 10 + 1; ++i) {
+            plateaus.push_back({random.range(-(1 << 20), 1 << 20), random.range(-(1 << 20), 1 << 20)});
+        }
+        Vec<Vector2i> views;
+        for (int i = 0; i < 10000; ++i) {
+            views.push_back(i % 2 ? coords[random.range(0, (int) coords.size() - 1)]
+                                  : Vector2i(random.range(-(1 << 20), 1 << 20), random.range(-(1 << 20), 1 << 20)));
+        }
+
+        Vector2iMap<Vector2i> flat;
+        BenchTimer flat_insert_timer;
+        for (auto coord: coords) flat.insert(coord, {1, 0});
+        for (auto plateau: plateaus) {
+            for (int y = 0; y < 256; ++y) {
+                for (int x = 0; x < 256; ++x) flat.insert(plateau + Vector2i(x, y), {2, 0});
+            }
+        }
+        report("Vector2iMap insert", flat_insert_timer.elapsed_ms(), flat.size(), "tile");
+
+        TileStorage storage;
+        BenchTimer storage_insert_timer;
+        for (auto coord: coords) storage.insert(coord, {1, 0});
+        for (auto plateau: plateaus) storage.fill_rect(plateau, plateau + Vector2i(255, 255), {2, 0});
+        storage.compact();
+        report("TileStorage insert", storage_insert_timer.elapsed_ms(), storage.size(), "tile");
+        print("    ", storage.chunk_count(), " chunks, ", flat.size(), " tiles");
+
+        long found = 0;
+        BenchTimer flat_view_timer;
+        for (auto view: views) {
+            for (int y = 0; y < 45; ++y) {
+                for (int x = 0; x < 80; ++x) found += flat.has(view + Vector2i(x, y));
+            }
+        }
+        report("Vector2iMap 80x45 view by has()", flat_view_timer.elapsed_ms(), views.size(), "view");
+
+        BenchTimer storage_view_timer;
+        for (auto view: views) {
+            storage.for_each_in_rect(view, view + Vector2i(79, 44), [&](Vector2i, Vector2i) { ++found; });
+        }
+        report("TileStorage 80x45 view", storage_view_timer.elapsed_ms(), views.size(), "view");
+
+        long sum = 0;
+        BenchTimer flat_iterate_timer;
+        for (auto &tile: flat) sum += tile.value.x;
+        report("Vector2iMap iterate", flat_iterate_timer.elapsed_ms(), flat.size(), "tile");
+
+        BenchTimer storage_iterate_timer;
+        for (auto &tile: storage) sum += tile.value.x;
+        report("TileStorage iterate", storage_iterate_timer.elapsed_ms(), storage.size(), "tile");
+
+        BenchTimer storage_region_timer;
+        storage.for_each_in_rect({-(1 << 20), -(1 << 20)}, {1 << 20, 1 << 20}, [&](Vector2i, Vector2i tile) { sum += tile.x; });
+        report("TileStorage whole world rect", storage_region_timer.elapsed_ms(), storage.size(), "tile");
+
+        print("    (", found, ", ", sum, ")");
+    }
+
+    inline void bench_snapshots(int size) {
+        print("Snapshots of a ", size, "x", size, " auto tiled map");
+
+        Array<Vector2i, BlobPolicy::TABLE_SIZE> blob_tiles;
+        for (int i = 0; i < blob_tiles.length; ++i) blob_tiles[i] = {i % 16, i / 16};
+
+        BlobTileMap map(blob_tiles, {}, {16, 16});
+        map.fill_rect_auto({0, 0}, {size - 1, size - 1});
+        BenchRandom random(5);
+        for (int i = 0; i < size / 8; ++i) {
+            Vector2i from(random.range(0, size - 1), random.range(0, size - 1));
+            map.erase_rect_auto(from, from + Vector2i(random.range(0, 40), random.range(0, 40)));
+        }
+        map.tiles.compact();
+        TileStorage::pool().collect();
+        print("    ", map.tiles.chunk_count(), " chunks, ", TileStorage::pool().size(), " distinct in the pool");
+
+        BenchTimer deep_timer;
+        TileStorage deep;
+        for (auto &tile: map.tiles) deep.insert(tile.key, tile.value);
+        report("copy tile by tile", deep_timer.elapsed_ms(), map.tiles.size(), "tile");
+
+        BenchTimer snapshot_timer;
+        Vec<TileStorage> snapshots;
+        for (int i = 0; i < 100; ++i) snapshots.push_back(map.tiles.snapshot());
+        report("snapshot", snapshot_timer.elapsed_ms(), 100, "snapshot");
+
+        BenchTimer edit_timer;
+        for (int i = 0; i < 1000; ++i) map.place_auto({random.range(0, size - 1), random.range(0, size - 1)});
+        map.tiles.compact();
+        report("place_auto after snapshot", edit_timer.elapsed_ms(), 1000, "tile");
+
+        print("    (", deep.size(), ", ", snapshots[99].size(), ")");
+    }
+
+    inline long file_size(const fs::Path &path) {
+        FILE *file = std::fopen(path.c_str(), "rb");
+        if (!file) return 0;
+        std::fseek(file, 0, SEEK_END);
+        long size = std::ftell(file);
+        std::fclose(file);
+        return size;
+    }
+
+    inline void bench_map_file(int size) {
+        print("Saving and loading a ", size, "x", size, " wang map");
+
+        Array<Vector2i, 16> wang_tiles;
+        for (int i = 0; i < wang_tiles.length; ++i) wang_tiles[i] = {i % 4, i / 4};
+        WangTileMap map(wang_tiles, {}, {16, 16});
+        map.fill_rect_auto({0, 0}, {size - 1, size - 1});
+        BenchRandom random(9);
+        for (int i = 0; i < size / 4; ++i) {
+            Vector2i from(random.range(0, size - 1), random.range(0, size - 1));
+            map.erase_rect_auto(from, from + Vector2i(random.range(0, 24), random.range(0, 24)));
+        }
+        map.tiles.compact();
+        long raw_size = map.tiles.size() * (long) sizeof(Vector2i) * 2;
+
+        TileMapFile::Header header;
+        header.tile_size = map.tile_size;
+        for (int i = 0; i < wang_tiles.length; ++i) header.table.push_back(wang_tiles[i]);
+        fs::Path chunked_path = fs::Path::res() + "bench_map.jtm";
+        fs::Path jon_path = fs::Path::res() + "bench_map.jon";
+        int cores = (int) math::MAX(std::thread::hardware_concurrency(), 1u);
+
+        for (int threads: {1, cores}) {
+            BenchTimer write_timer;
+            TileMapFile::write(chunked_path, header, map.tiles, threads);
+            double ms = write_timer.elapsed_ms();
+            print("  write chunked, ", threads, " threads: ", ms, " ms, ", (double) raw_size / 1048576.0 / (ms / 1000.0), " MB/s");
+        }
+
+        TileMapSaver saver;
+        BenchTimer jon_timer;
+        saver.save(AnyAutoTileMap(&map), jon_path);
+        saver.wait();
+        report("write jon", jon_timer.elapsed_ms(), map.tiles.size(), "tile");
+        long chunked_bytes = file_size(chunked_path), jon_bytes = file_size(jon_path);
+        print("    ", raw_size, " bytes raw, ", jon_bytes, " as jon, ", chunked_bytes, " chunked (",
+              (double) raw_size / (double) math::MAX(chunked_bytes, 1l), "x raw, ",
+              (double) jon_bytes / (double) math::MAX(chunked_bytes, 1l), "x jon)");
+
+        WangTileMap loaded(wang_tiles, {}, {16, 16});
+        for (int threads: {1, cores}) {
+            TileMapLoader loader;
+            BenchTimer read_timer;
+            loader.load(&loaded, chunked_path, {size / 2, size / 2}, threads);
+            while (loader.update(INT32_MAX)) std::this_thread::yield();
+            double ms = read_timer.elapsed_ms();
+            print("  load chunked, ", threads, " threads: ", ms, " ms, ", (double) raw_size / 1048576.0 / (ms / 1000.0), " MB/s");
+        }
+
+        TileMapLoader jon_loader;
+        BenchTimer jon_read_timer;
+        jon_loader.load(&loaded, jon_path, {size / 2, size / 2});
+        while (jon_loader.update(INT32_MAX)) std::this_thread::yield();
+        report("load jon", jon_read_timer.elapsed_ms(), loaded.tiles.size(), "tile");
+
+        TileStorage region;
+        BenchTimer region_timer;
+        TileMapFile::read_region(chunked_path, {size / 2, size / 2}, {size / 2 + 63, size / 2 + 63}, header, region);
+        report("read_region 64x64", region_timer.elapsed_ms(), 1, "region");
+
+        std::remove(chunked_path.c_str());
+        std::remove(jon_path.c_str());
+        print("    (", loaded.tiles.size() == map.tiles.size(), ", ", region.size(), ")");
+    }
+
+    inline void bench_retile_job(int size) {
+        print("Retiling a ", size, "x", size, " blob map after a table edit");
+
+        Array<Vector2i, BlobPolicy::TABLE_SIZE> blob_tiles;
+        for (int i = 0; i < blob_tiles.length; ++i) blob_tiles[i] = {i % 16, i / 16};
+        BlobTileMap map(blob_tiles, {}, {16, 16});
+        map.fill_rect_auto({0, 0}, {size - 1, size - 1});
+        BenchRandom random(11);
+        for (int i = 0; i < size / 4; ++i) {
+            Vector2i from(random.range(0, size - 1), random.range(0, size - 1));
+            map.erase_rect_auto(from, from + Vector2i(random.range(0, 24), random.range(0, 24)));
+        }
+        map.tiles.compact();
+
+        map.blob_tiles[BlobPolicy::table_index(255)] = {1, 1};
+        BenchTimer all_timer;
+        map.retile_all();
+        report("retile_all in one frame", all_timer.elapsed_ms(), map.tiles.size(), "tile");
+
+        map.blob_tiles[BlobPolicy::table_index(255)] = {2, 2};
+        TileRetileJob job;
+        job.start(&map, {size / 2, size / 2});
+        int frames = 0;
+        double worst_ms = 0.0, first_ms = 0.0;
+        BenchTimer job_timer;
+        while (true) {
+            BenchTimer frame_timer;
+            bool running = job.update();
+            double ms = frame_timer.elapsed_ms();
+            if (!frames) first_ms = ms;
+            worst_ms = math::MAX(worst_ms, ms);
+            ++frames;
+            if (!running) break;
+        }
+        report("TileRetileJob, 2 ms budget", job_timer.elapsed_ms(), map.tiles.size(), "tile");
+        print("    ", frames, " frames, worst frame ", worst_ms, " ms, first frame ", first_ms, " ms, center done ",
+              map.tiles.get({size / 2, size / 2}) == Vector2i(2, 2));
+    }
+
+    inline void bench_terrain(int size) {
+        print("Terrain auto tiling of a ", size, "x", size, " map");
+
+        for (int terrains: {1, 3, 7}) {
+            TerrainTileMap map;
+            for (int a = 1; a <= terrains; ++a) {
+                for (int b = 0; b <= terrains; ++b) {
+                    Array<Vector2i, 16> wang_tiles;
+                    for (int i = 0; i < wang_tiles.length; ++i) wang_tiles[i] = {a * 8 + b, i};
+                    map.set_transition(a, b, wang_tiles);
+                }
+            }
+
+            // Patches of every terrain over the whole map, with some holes
+            BenchRandom random(13);
+            for (int i = 0; i < size / 2; ++i) {
+                map.paint_terrain = (int) random.range(1, terrains);
+                Vector2i from(random.range(0, size - 1), random.range(0, size - 1));
+                if (random.unit() < 0.15f) map.erase_rect_auto(from, from + Vector2i(random.range(0, 16), random.range(0, 16)));
+                else map.fill_rect_auto(from, from + Vector2i(random.range(0, 96), random.range(0, 96)));
+            }
+
+            char name[64];
+            snprintf(name, sizeof(name), "retile_all, %d terrains, chunk bitplanes", terrains);
+            BenchTimer chunk_timer;
+            map.retile_all();
+            report(name, chunk_timer.elapsed_ms(), map.tiles.size(), "tile");
+
+            snprintf(name, sizeof(name), "retile_all, %d terrains, per coord", terrains);
+            BenchTimer coord_timer;
+            for (auto &tile: map.tiles) map.tiles.insert(tile.key, map.resolve_tile(tile.key));
+            report(name, coord_timer.elapsed_ms(), map.tiles.size(), "tile");
+        }
+    }
+
+    inline void bench_generation(int size) {
+        print("Generating a ", size, "x", size, " cave map");
+
+        BenchTimer caves_timer;
+        Vec<uint8_t> caves = TileMapGenerator::cellular_caves(size, size, 21);
+        report("cellular_caves", caves_timer.elapsed_ms(), (long) size * size, "cell");
+
+        Array<Vector2i, BlobPolicy::TABLE_SIZE> blob_tiles;
+        for (int i = 0; i < blob_tiles.length; ++i) blob_tiles[i] = {i % 16, i / 16};
+
+        // place_auto per cell only on a corner of the map, it's too slow for the whole thing
+        int corner = size / 4;
+        BlobTileMap per_cell(blob_tiles, {}, {16, 16});
+        BenchTimer per_cell_timer;
+        for (int y = 0; y < corner; ++y) {
+            for (int x = 0; x < corner; ++x) {
+                if (caves[(long) y * size + x]) per_cell.place_auto({x, y});
+            }
+        }
+        report("place_auto per cell", per_cell_timer.elapsed_ms(), per_cell.tiles.size(), "tile");
+
+        BlobTileMap generated(blob_tiles, {}, {16, 16});
+        BenchTimer generated_timer;
+        TileMapGenerator::fill_from_buffer(&generated, {0, 0}, size, size, caves.ptr());
+        report("fill_from_buffer", generated_timer.elapsed_ms(), generated.tiles.size(), "tile");
+
+        TerrainTileMap terrain;
+        for (int a = 1; a <= 4; ++a) {
+            for (int b = 0; b <= 4; ++b) {
+                Array<Vector2i, 16> wang_tiles;
+                for (int i = 0; i < wang_tiles.length; ++i) wang_tiles[i] = {a * 8 + b, i};
+                terrain.set_transition(a, b, wang_tiles);
+            }
+        }
+        int chunks = size / TileStorage::CHUNK_SIZE;
+        BenchTimer noise_timer;
+        TileMapGenerator::generate(&terrain, {0, 0}, {chunks - 1, chunks - 1}, [](Vector2i chunk_coord, uint8_t *cells) {
+            TileMapGenerator::noise_chunk(chunk_coord, cells, 7, 48.0f, 0.4f, 4);
+        });
+        report("generate noise terrain, 4 terrains", noise_timer.elapsed_ms(), terrain.tiles.size(), "tile");
+
+        print("    (", generated.tiles.size(), " cave tiles in ", generated.tiles.chunk_count(), " chunks, ",
+              terrain.tiles.size(), " terrain tiles)");
+    }
+
+    inline void bench_region(int size) {
+        print("Copying and pasting a ", size, "x", size, " region");
+
+        Array<Vector2i, BlobPolicy::TABLE_SIZE> blob_tiles;
+        for (int i = 0; i < blob_tiles.length; ++i) blob_tiles[i] = {i % 16, i / 16};
+        Vec<uint8_t> caves = TileMapGenerator::cellular_caves(size * 2, size * 2, 5);
+        BlobTileMap map(blob_tiles, {}, {16, 16});
+        TileMapGenerator::fill_from_buffer(&map, {0, 0}, size * 2, size * 2, caves.ptr());
+
+        long cells = (long) size * size;
+        double megabytes = (double) cells * sizeof(Vector2i) / (1024.0 * 1024.0);
+        auto report_bandwidth = [&](const char *name, double ms) {
+            print("  ", name, ": ", ms, " ms, ", megabytes / (ms / 1000.0), " MB/s of tiles");
+        };
+
+        // What moving the tiles costs with nothing else going on
+        Vec<Vector2i> from_buffer, to_buffer;
+        from_buffer.resize(cells);
+        to_buffer.resize(cells);
+        from_buffer.fill({1, 1});
+        BenchTimer memcpy_timer;
+        memcpy(to_buffer.ptrw(), from_buffer.ptr(), sizeof(Vector2i) * cells);
+        report_bandwidth("memcpy", memcpy_timer.elapsed_ms());
+
+        BenchTimer copy_timer;
+        TileRegion region = TileRegion::copy(&map, {size / 3, size / 3}, {size / 3 + size - 1, size / 3 + size - 1});
+        report_bandwidth("copy", copy_timer.elapsed_ms());
+
+        // Unaligned to the chunks on purpose, over the tiles that are already there
+        BenchTimer paste_timer;
+        region.paste(&map, {size + 7, size + 13});
+        report_bandwidth("paste", paste_timer.elapsed_ms());
+
+        BenchTimer stamp_timer;
+        region.stamp(&map, {5, size + 3});
+        report_bandwidth("stamp", stamp_timer.elapsed_ms());
+
+        BlobTileMap per_cell(blob_tiles, {}, {16, 16});
+        BenchTimer per_cell_timer;
+        for (int y = 0; y < size; ++y) {
+            for (int x = 0; x < size; ++x) {
+                if (region.has(x, y)) per_cell.place_auto({x + 7, y + 13});
+            }
+        }
+        report_bandwidth("place_auto per cell", per_cell_timer.elapsed_ms());
+
+        TileRegion rotated = region.rotated();
+        BenchTimer rotated_timer;
+        rotated.paste(&map, {size + 7, size + 13});
+        report_bandwidth("paste rotated, whole rect retiled", rotated_timer.elapsed_ms());
+    }
+
+    inline void bench_rule_reload(int size) {
+        print("Reloading the rules of a ", size, "x", size, " rule map");
+
+        // Most neighbours first, then corners, then edges, then a catch all for lone cells
+        auto make_rules = [](Vector2i corner_output) {
+            Vec<RulePolicy::Rule> rules;
+            RulePolicy::Rule interior;
+            for (int i = 0; i < 4; ++i) interior.needed.push_back({Vector2i(Cardinal4::X[i], Cardinal4::Y[i]), true});
+            interior.output = {0, 2};
+            rules.push_back(interior);
+            int corners[4][2] = {{1, 1}, {-1, 1}, {1, -1}, {-1, -1}};
+            for (int i = 0; i < 4; ++i) {
+                RulePolicy::Rule rule;
+                rule.needed.push_back({Vector2i(corners[i][0], 0), true});
+                rule.needed.push_back({Vector2i(0, corners[i][1]), true});
+                rule.output = i == 0 ? corner_output : Vector2i(i, 0);
+                rules.push_back(rule);
+            }
+            for (int i = 0; i < 4; ++i) {
+                RulePolicy::Rule rule;
+                rule.needed.push_back({Vector2i(Cardinal4::X[i], Cardinal4::Y[i]), true});
+                rule.output = {i, 1};
+                rules.push_back(rule);
+            }
+            rules.push_back({{}, {1, 2}});
+            return rules;
+        };
+
+        RuleTileMap map;
+        map.replace_rules(make_rules({0, 0}));
+        map.fill_rect_auto({0, 0}, {size - 1, size - 1});
+        BenchRandom random(17);
+        for (int i = 0; i < size / 4; ++i) {
+            Vector2i from(random.range(0, size - 1), random.range(0, size - 1));
+            map.erase_rect_auto(from, from + Vector2i(random.range(0, 24), random.range(0, 24)));
+        }
+        map.tiles.compact();
+
+        BenchTimer all_timer;
+        map.retile_all();
+        report("retile_all in one frame", all_timer.elapsed_ms(), map.tiles.size(), "tile");
+
+        // One corner rule gets a new tile, only the chunks showing the old one are retiled
+        BenchTimer swap_timer;
+        Vec<Vector2i> stale = map.replace_rules(make_rules({5, 5}));
+        double swap_ms = swap_timer.elapsed_ms();
+
+        TileRetileJob job;
+        job.start(&map, {size / 2, size / 2}, stale);
+        int frames = 0;
+        double worst_ms = 0.0;
+        BenchTimer job_timer;
+        while (true) {
+            BenchTimer frame_timer;
+            bool running = job.update();
+            worst_ms = math::MAX(worst_ms, frame_timer.elapsed_ms());
+            ++frames;
+            if (!running) break;
+        }
+        report("targeted TileRetileJob, 2 ms budget", job_timer.elapsed_ms(), map.tiles.size(), "tile");
+        print("    swap ", swap_ms, " ms, ", stale.size(), " stale outputs, ", frames, " frames, worst frame ", worst_ms, " ms");
+    }
+
+    inline void bench_rule_table(int size) {
+        print("Resolving a ", size, "x", size, " rule map by rule count");
+
+        BenchRandom random(23);
+        Vec<RulePolicy::Rule> rules;
+        for (int variants: {4, 16, 64}) {
+            // Random edge and corner patterns with every rotation and mirror, like a symmetric rule file
+            while (rules.size() < variants) {
+                RulePolicy::Rule rule;
+                for (int i = 0; i < Moore8::COUNT; ++i) {
+                    int roll = random.range(0, 3);
+                    if (roll == 0) rule.needed.push_back({Vector2i(Moore8::X[i], Moore8::Y[i]), true});
+                }
+                rule.output = {random.range(0, 15), random.range(0, 15)};
+                for (int turns = 0; turns < 4; ++turns) {
+                    for (int mirror = 0; mirror < 2; ++mirror) {
+                        RuleTileMap::Variant variant;
+                        variant.turns = turns;
+                        variant.mirror_x = mirror;
+                        RulePolicy::Rule turned;
+                        turned.output = rule.output;
+                        for (auto &need: rule.needed) turned.needed.push_back({RuleTileMap::transform(need.first, variant), need.second});
+                        if (rules.size() < variants) rules.push_back(turned);
+                    }
+                }
+            }
+
+            RuleTileMap map;
+            for (auto &rule: rules) map.add_rule(rule);
+            for (int y = 0; y < size; ++y) {
+                for (int x = 0; x < size; ++x) {
+                    if (random.unit() < 0.6f) map.tiles.insert({x, y}, {0, 0});
+                }
+            }
+
+            char name[64];
+            snprintf(name, sizeof(name), "%d rules, in order", variants);
+            BenchTimer linear_timer;
+            map.retile_all();
+            report(name, linear_timer.elapsed_ms(), map.tiles.size(), "tile");
+
+            snprintf(name, sizeof(name), "%d rules, match table", variants);
+            map.compile_rules();
+            BenchTimer table_timer;
+            map.retile_all();
+            report(name, table_timer.elapsed_ms(), map.tiles.size(), "tile");
+        }
+    }
+
+    inline void bench_tileset(int map_count) {
+        print("Creating ", map_count, " blob maps on a 1024x1024 atlas of 16x16 tiles");
+
+        Texture atlas;// Only the size is read
+        atlas.width = 1024;
+        atlas.height = 1024;
+        Vec<BlobTileMap *> maps;
+
+        // What every map used to do, cut the atlas into its own uv table
+        BenchTimer own_timer;
+        for (int i = 0; i < map_count; ++i) {
+            Tileset *tileset = Tileset::create(atlas, {16, 16});
+            maps.push_back(new BlobTileMap(tileset));
+            Tileset::release(tileset);
+        }
+        report("tileset per map", own_timer.elapsed_ms(), map_count, "map");
+        for (auto map: maps) delete map;
+        maps.clear();
+
+        BenchTimer shared_timer;
+        Tileset *tileset = Tileset::create(atlas, {16, 16});
+        for (int i = 0; i < map_count; ++i) maps.push_back(new BlobTileMap(tileset));
+        Tileset::release(tileset);
+        report("shared tileset", shared_timer.elapsed_ms(), map_count, "map");
+        for (auto map: maps) delete map;
+    }
+
+    inline void bench_export(int size) {
+        print("Exporting a ", size, "x", size, " noise terrain map of 16x16 tiles to images");
+
+        // An atlas of flat colored tiles with a darker border, no image file needed
+        Texture atlas;
+        atlas.width = 640;
+        atlas.height = 256;
+        Vec<uint8_t> atlas_pixels;
+        atlas_pixels.resize((long) atlas.width * atlas.height * 4);
+        for (int y = 0; y < atlas.height; ++y) {
+            for (int x = 0; x < atlas.width; ++x) {
+                uint8_t *p = atlas_pixels.ptrw() + ((long) y * atlas.width + x) * 4;
+                bool border = (x & 15) == 0 || (y & 15) == 0;
+                p[0] = (uint8_t) ((x / 16) * 6 >> (int) border);
+                p[1] = (uint8_t) ((y / 16) * 16 >> (int) border);
+                p[2] = (uint8_t) (128 >> (int) border);
+                p[3] = 255;
+            }
+        }
+        Tileset *tileset = Tileset::create(atlas, {16, 16});
+        tileset->set_pixels(atlas_pixels.ptr(), atlas.width, atlas.height, 4);
+
+        TerrainTileMap terrain;
+        terrain.set_tileset(tileset);
+        Tileset::release(tileset);
+        for (int a = 1; a <= 4; ++a) {
+            for (int b = 0; b <= 4; ++b) {
+                Array<Vector2i, 16> wang_tiles;
+                for (int i = 0; i < wang_tiles.length; ++i) wang_tiles[i] = {a * 8 + b, i};
+                terrain.set_transition(a, b, wang_tiles);
+            }
+        }
+        int chunks = (size + TileStorage::CHUNK_MASK) / TileStorage::CHUNK_SIZE;
+        BenchTimer generate_timer;
+        TileMapGenerator::generate(&terrain, {0, 0}, {chunks - 1, chunks - 1}, [](Vector2i chunk_coord, uint8_t *cells) {
+            TileMapGenerator::noise_chunk(chunk_coord, cells, 7, 256.0f, 0.4f, 4);
+        });
+        terrain.tiles.compact();
+        report("generate", generate_timer.elapsed_ms(), terrain.tiles.size(), "tile");
+
+        Vector2i last(size - 1, size - 1);
+        TileImage image;
+        BenchTimer thumbnail_timer;
+        TileMapRenderer::thumbnail(&terrain, {0, 0}, last, 2048, image);
+        report("thumbnail", thumbnail_timer.elapsed_ms(), (long) size * size, "cell");
+        print("    (", image.width, "x", image.height, " thumbnail)");
+
+        BenchTimer png_timer;
+        TileMapRenderer::write_png(fs::Path("bench_thumbnail.png"), image);
+        report("write_png", png_timer.elapsed_ms(), (long) image.width * image.height, "pixel");
+
+        // Full size, the atlas tiles copied as they are
+        BenchTimer region_timer;
+        TileMapRenderer::render(&terrain, {0, 0}, {255, 255}, 0, image);
+        report("render 256x256 tiles at 16x16", region_timer.elapsed_ms(), (long) image.width * image.height, "pixel");
+    }
+
+    inline void run_all() {
+        bench_sparse_world(200);
+        bench_tile_storage(1000000, 4096);
+        bench_autotile_dispatch(512);
+        bench_bulk_fill(1000);
+        bench_snapshots(2048);
+        bench_map_file(2048);
+        bench_retile_job(2048);
+        bench_rule_reload(2048);
+        bench_rule_table(1024);
+        bench_terrain(1024);
+        bench_generation(2048);
+        bench_region(512);
+        bench_tileset(1000);
+        bench_export(10000);
+        bench_pathfinding(256, false, 1000);
+        bench_pathfinding(256, true, 1000);
+        bench_pathfinding(1024, true, 1000);
+    }
+
+}// namespace benchmarks
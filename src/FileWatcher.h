@@ -0,0 +1,123 @@
+#pragma once
+
+#include "Jovial/Core/Logger.h"
+#include "Jovial/JovialEngine.h"
+
+#include <chrono>
+#include <cstring>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace jovial {
+
+    // Tells when a file was written, without blocking. On Linux this is an inotify watch on the
+    // file's directory, so editors that save by writing a temp file and renaming it over the old
+    // one are caught too. Elsewhere the modification time is polled a few times a second.
+    class FileWatcher {
+    public:
+        // Seconds between modification time checks where there is no inotify
+        float poll_interval = 0.25f;
+
+        FileWatcher() = default;
+        FileWatcher(const FileWatcher &other) = delete;
+        FileWatcher &operator=(const FileWatcher &other) = delete;
+
+        ~FileWatcher() {
+            stop();
+        }
+
+        bool watch(const fs::Path &path);
+        void stop();
+
+        // True once for every batch of writes since the last call
+        bool poll();
+
+    private:
+        static long modified_time(const char *path);
+
+        fs::Path path;
+        long last_modified = 0;
+        std::chrono::steady_clock::time_point last_poll = std::chrono::steady_clock::now();
+#ifdef __linux__
+        int fd = -1;
+        char name[256]{};
+#endif
+    };
+
+    inline long FileWatcher::modified_time(const char *path) {
+        struct stat info {};
+        if (stat(path, &info) != 0) return 0;
+        return (long) info.st_mtime;
+    }
+
+    inline bool FileWatcher::watch(const fs::Path &path) {
+        stop();
+        this->path = path;
+        last_modified = modified_time(path.c_str());
+
+#ifdef __linux__
+        const char *file = path.c_str();
+        const char *slash = strrchr(file, '/');
+        const char *base = slash ? slash + 1 : file;
+        if (strlen(base) >= sizeof(name)) return false;
+        strcpy(name, base);
+
+        char directory[4096] = ".";
+        if (slash) {
+            long length = slash - file;
+            if (length >= (long) sizeof(directory)) return false;
+            memcpy(directory, file, length);
+            directory[length] = '\0';
+            if (length == 0) strcpy(directory, "/");
+        }
+
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0 || inotify_add_watch(fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            JV_CORE_ERROR("Could not watch ", path.c_str(), ", falling back to polling it");
+            stop();
+        }
+#endif
+        return true;
+    }
+
+    inline void FileWatcher::stop() {
+#ifdef __linux__
+        if (fd >= 0) close(fd);
+        fd = -1;
+#endif
+    }
+
+    inline bool FileWatcher::poll() {
+#ifdef __linux__
+        if (fd >= 0) {
+            // Drain everything queued, a single save can be several events
+            bool changed = false;
+            alignas(inotify_event) char buffer[4096];
+            while (true) {
+                long length = read(fd, buffer, sizeof(buffer));
+                if (length <= 0) break;
+                for (long at = 0; at < length;) {
+                    auto *event = (const inotify_event *) (buffer + at);
+                    if (event->len && strcmp(event->name, name) == 0) changed = true;
+                    at += (long) sizeof(inotify_event) + event->len;
+                }
+            }
+            return changed;
+        }
+#endif
+        auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<float>(now - last_poll).count() < poll_interval) return false;
+        last_poll = now;
+
+        long modified = modified_time(path.c_str());
+        if (modified == last_modified) return false;
+        last_modified = modified;
+        return true;
+    }
+
+}// namespace jovial
@@ -0,0 +1,301 @@
+#pragma once
+
+#include "Jovial/Core/Logger.h"
+#include "Jovial/JovialEngine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+namespace jovial {
+
+    // Stands between the editor (or any update loop) and Input, so a session can be recorded to a
+    // file and fed back through the same update code later. Live it just forwards to Input. Recording
+    // samples the tracked actions, the mouse and the scroll once per frame, replaying hands back one
+    // recorded frame per update no matter how long frames take, so the same scenario runs the same
+    // code every time. Frame times are kept either way for print_frame_times().
+    class InputTape {
+    public:
+        enum class Mode {
+            Live,
+            Recording,
+            Replaying,
+        };
+
+        struct Frame {
+            double time;// Seconds since the recording started
+            uint64_t pressed;
+            uint64_t just_pressed;
+            Vector2 mouse_position;
+            Vector2 mouse_delta;
+            float scroll;
+        };
+
+        InputTape() = default;
+        InputTape(const InputTape &other) = delete;
+        InputTape &operator=(const InputTape &other) = delete;
+
+        ~InputTape() {
+            stop();
+        }
+
+        // Records from the next begin_frame() on, stop() writes the file
+        inline void record(const fs::Path &path) {
+            stop();
+            this->path = path;
+            frames.clear();
+            frame_ms.clear();
+            mode = Mode::Recording;
+            start = std::chrono::steady_clock::now();
+        }
+
+        bool replay(const fs::Path &path);
+
+        // Writes the recording, if there is one, and goes back to live input
+        bool stop();
+
+        // Call at the start of every update. False once a replay has run out of frames, the tape is
+        // live again from then on.
+        bool begin_frame();
+
+        // Call at the end of every update to time it
+        inline void end_frame() {
+            auto now = std::chrono::steady_clock::now();
+            frame_ms.push_back(std::chrono::duration<float, std::milli>(now - frame_start).count());
+        }
+
+        // p50/p90/p99/max of the update times since record() or replay()
+        void print_frame_times(const char *name) const;
+
+        [[nodiscard]] inline Mode get_mode() const {
+            return mode;
+        }
+
+        [[nodiscard]] inline bool is_replaying() const {
+            return mode == Mode::Replaying;
+        }
+
+        [[nodiscard]] inline bool is_pressed(Actions action) const {
+            if (mode == Mode::Live) return Input::is_pressed(action);
+            return current.pressed >> action_bit(action) & 1;
+        }
+
+        [[nodiscard]] inline bool is_just_pressed(Actions action) const {
+            if (mode == Mode::Live) return Input::is_just_pressed(action);
+            return current.just_pressed >> action_bit(action) & 1;
+        }
+
+        [[nodiscard]] inline Vector2 get_mouse_position() const {
+            return mode == Mode::Live ? Input::get_mouse_position() : current.mouse_position;
+        }
+
+        [[nodiscard]] inline Vector2 get_mouse_delta() const {
+            return mode == Mode::Live ? Input::get_mouse_delta() : current.mouse_delta;
+        }
+
+        [[nodiscard]] inline float get_scroll() const {
+            return mode == Mode::Live ? Input::get_scroll() : current.scroll;
+        }
+
+    private:
+        // u32 magic, u32 version, u32 tracked count, u64 frame count, then per frame f64 time, u64 pressed,
+        // u64 just pressed, f32 mouse x, y, delta x, y and scroll. All little endian, field by field.
+        static constexpr uint32_t MAGIC = 0x4E49564A;// "JVIN"
+        static constexpr uint32_t VERSION = 2;
+        static constexpr long HEADER_BYTES = 4 + 4 + 4 + 8;
+        static constexpr long FRAME_BYTES = 8 + 8 + 8 + 5 * 4;
+
+        // Everything the editor and the camera read, in bit order. Appending keeps old tapes valid.
+        static constexpr Actions TRACKED[] = {
+                Actions::LeftMouseButton, Actions::RightMouseButton, Actions::MiddleMouseButton,
+                Actions::LeftControl, Actions::LeftShift, Actions::LeftAlt, Actions::Escape, Actions::Tab,
+                Actions::Left_bracket, Actions::Right_bracket,
+                Actions::B, Actions::C, Actions::E, Actions::F, Actions::H, Actions::L, Actions::R,
+                Actions::S, Actions::T, Actions::V, Actions::X, Actions::Y, Actions::Z,
+        };
+        static constexpr int TRACKED_COUNT = (int) (sizeof(TRACKED) / sizeof(TRACKED[0]));
+        static_assert(TRACKED_COUNT <= 64, "The pressed actions are one bit each in a uint64_t");
+
+        // Turns native bytes into little endian ones and back, nothing to do on little endian hosts
+        static inline void swap_little(uint8_t *bytes, long size) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            std::reverse(bytes, bytes + size);
+#else
+            (void) bytes;
+            (void) size;
+#endif
+        }
+
+        template<typename T>
+        static inline void put(Vec<uint8_t> &out, T value) {
+            long at = out.size();
+            out.resize(at + (long) sizeof(T));
+            memcpy(out.ptrw() + at, &value, sizeof(T));
+            swap_little(out.ptrw() + at, sizeof(T));
+        }
+
+        // The caller checks the size up front
+        template<typename T>
+        static inline T take(const uint8_t *&in) {
+            uint8_t bytes[sizeof(T)];
+            memcpy(bytes, in, sizeof(T));
+            swap_little(bytes, sizeof(T));
+            T value;
+            memcpy(&value, bytes, sizeof(T));
+            in += sizeof(T);
+            return value;
+        }
+
+        static inline int action_bit(Actions action) {
+            for (int i = 0; i < TRACKED_COUNT; ++i) {
+                if (TRACKED[i] == action) return i;
+            }
+            JV_CORE_FATAL("Recorded input doesn't track action ", (int) action, ", add it to InputTape::TRACKED")
+            return 0;
+        }
+
+        Mode mode = Mode::Live;
+        fs::Path path;
+        Vec<Frame> frames;
+        long cursor = 0;
+        Frame current{};
+        Vec<float> frame_ms;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::time_point frame_start;
+    };
+
+    inline bool InputTape::replay(const fs::Path &path) {
+        stop();
+        FILE *file = std::fopen(path.c_str(), "rb");
+        if (!file) {
+            JV_CORE_ERROR("Could not open the input recording ", path.c_str());
+            return false;
+        }
+
+        Vec<uint8_t> data;
+        bool ok = std::fseek(file, 0, SEEK_END) == 0;
+        long size = ok ? std::ftell(file) : -1;
+        ok = ok && size >= HEADER_BYTES && std::fseek(file, 0, SEEK_SET) == 0;
+        if (ok) {
+            data.resize(size);
+            ok = std::fread(data.ptrw(), 1, size, file) == (size_t) size;
+        }
+        std::fclose(file);
+
+        frames.clear();
+        if (ok) {
+            const uint8_t *in = data.ptr();
+            uint32_t magic = take<uint32_t>(in);
+            uint32_t version = take<uint32_t>(in);
+            uint32_t tracked = take<uint32_t>(in);
+            uint64_t count = take<uint64_t>(in);
+            // The count comes from the file, so a truncated or garbled one must not size the allocation
+            uint64_t remaining = (uint64_t) (size - HEADER_BYTES);
+            ok = magic == MAGIC && version == VERSION && tracked <= (uint32_t) TRACKED_COUNT &&
+                 count <= remaining / FRAME_BYTES && count * FRAME_BYTES == remaining;
+            if (ok) frames.resize((long) count);
+            for (auto &frame: frames) {
+                frame.time = take<double>(in);
+                frame.pressed = take<uint64_t>(in);
+                frame.just_pressed = take<uint64_t>(in);
+                frame.mouse_position.x = take<float>(in);
+                frame.mouse_position.y = take<float>(in);
+                frame.mouse_delta.x = take<float>(in);
+                frame.mouse_delta.y = take<float>(in);
+                frame.scroll = take<float>(in);
+            }
+        }
+        if (!ok) {
+            JV_CORE_ERROR("Not an input recording, or one from another version: ", path.c_str());
+            frames.clear();
+            return false;
+        }
+
+        cursor = 0;
+        frame_ms.clear();
+        mode = Mode::Replaying;
+        return true;
+    }
+
+    inline bool InputTape::stop() {
+        Mode was = mode;
+        mode = Mode::Live;
+        if (was != Mode::Recording) return true;
+
+        Vec<uint8_t> data;
+        put(data, MAGIC);
+        put(data, VERSION);
+        put(data, (uint32_t) TRACKED_COUNT);
+        put(data, (uint64_t) frames.size());
+        for (auto &frame: frames) {
+            put(data, frame.time);
+            put(data, frame.pressed);
+            put(data, frame.just_pressed);
+            put(data, frame.mouse_position.x);
+            put(data, frame.mouse_position.y);
+            put(data, frame.mouse_delta.x);
+            put(data, frame.mouse_delta.y);
+            put(data, frame.scroll);
+        }
+
+        FILE *file = std::fopen(path.c_str(), "wb");
+        if (!file) {
+            JV_CORE_ERROR("Could not write the input recording ", path.c_str());
+            return false;
+        }
+        long count = frames.size();
+        bool ok = std::fwrite(data.ptr(), 1, data.size(), file) == (size_t) data.size();
+        ok = std::fclose(file) == 0 && ok;
+        if (ok) print("Recorded ", count, " frames of input to ", path.c_str());
+        else JV_CORE_ERROR("Could not write the input recording ", path.c_str());
+        return ok;
+    }
+
+    inline bool InputTape::begin_frame() {
+        frame_start = std::chrono::steady_clock::now();
+        switch (mode) {
+            case Mode::Live:
+                return true;
+            case Mode::Recording: {
+                current = {};
+                current.time = std::chrono::duration<double>(frame_start - start).count();
+                for (int i = 0; i < TRACKED_COUNT; ++i) {
+                    if (Input::is_pressed(TRACKED[i])) current.pressed |= 1ull << i;
+                    if (Input::is_just_pressed(TRACKED[i])) current.just_pressed |= 1ull << i;
+                }
+                current.mouse_position = Input::get_mouse_position();
+                current.mouse_delta = Input::get_mouse_delta();
+                current.scroll = Input::get_scroll();
+                frames.push_back(current);
+                return true;
+            }
+            case Mode::Replaying:
+                if (cursor == frames.size()) {
+                    mode = Mode::Live;
+                    return false;
+                }
+                current = frames[cursor++];
+                return true;
+        }
+        return true;
+    }
+
+    inline void InputTape::print_frame_times(const char *name) const {
+        if (frame_ms.is_empty()) return;
+        Vec<float> sorted;
+        for (auto ms: frame_ms) sorted.push_back(ms);
+        std::sort(sorted.ptrw(), sorted.ptrw() + sorted.size());
+        auto percentile = [&](float p) {
+            return sorted[math::MIN((long) (p * (float) sorted.size()), sorted.size() - 1)];
+        };
+        double sum = 0.0;
+        for (auto ms: sorted) sum += ms;
+        char line[192];
+        snprintf(line, sizeof(line), "%s: %ld frames, mean %.3f ms, p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms",
+                 name, sorted.size(), sum / (double) sorted.size(), percentile(0.5f), percentile(0.9f), percentile(0.99f),
+                 sorted[sorted.size() - 1]);
+        print(line);
+    }
+
+}// namespace jovial
@@ -8,34 +8,72 @@
 #include "Jovial/SavingLoading/JonStd.h"
 #include "Jovial/Std/Array.h"
 #include "Jovial/Std/HashMap.h"
+#include "TileJournal.h"
+#include "TileStorage.h"
+#include "TileTrace.h"
+#include "Tileset.h"
+#include "Vector2iMap.h"
+
+#include <algorithm>
+#include <chrono>
 
 namespace jovial {
 
+    class TileMap;
+
+    enum class BrushShape {
+        Square,
+        Circle,
+    };
+
+    // Gets told about every region of a tile map that was written to, so caches built on
+    // top of the map (pathfinding grids, etc.) can update incrementally. The region is inclusive.
+    class TileMapListener {
+    public:
+        virtual ~TileMapListener() = default;
+        virtual void on_tiles_changed(TileMap *map, Vector2i from, Vector2i to) = 0;
+    };
+
     class TileMap {
     public:
         Vector2 position;
-        Texture texture;
-        HashMap<Vector2i, Vector2i> tiles{};
-        HashMap<Vector2i, Rect2> tile_uvs;
-        Vector2 tile_size;
+        TileStorage tiles{};
+        const Tileset *tileset = nullptr;// Shared with every other map drawing from the same atlas
+        Vector2 tile_size;// World size of a cell, the tileset's tile size unless scaled
         bool visable = true;
         bool using_vsize = true;
+        Vec<TileMapListener *> listeners;
+        TileJournal journal;
+        std::atomic<long> *save_progress = nullptr;// Counts the tiles written while this map is being serialized
 
     public:
         TileMap() = default;
 
-        TileMap(const Texture &texture, Vector2 tile_size)
-            : texture(texture), tile_size(tile_size) {}
+        TileMap(const Tileset *tileset, Vector2 tile_size)
+            : tile_size(tile_size) {
+            set_tileset(tileset);
+        }
+
+        TileMap(const TileMap &other) = delete;
+        TileMap &operator=(const TileMap &other) = delete;
+
+        virtual ~TileMap() {
+            Tileset::release(tileset);
+        }
 
         bool load_from_jon(jon::JonNode &object);
 
     public:
         inline void place(Vector2i coord, Vector2i tile) {
             tiles.insert(coord, tile);
+            if (!listeners.is_empty()) notify_changed(coord, coord);
         }
 
-        inline void add_tile(Vector2i tile, Rect2 uv) {
-            tile_uvs.insert(tile, uv);
+        // Takes a reference to the new tileset, nothing is copied out of it
+        inline void set_tileset(const Tileset *new_tileset) {
+            Tileset::retain(new_tileset);
+            Tileset::release(tileset);
+            tileset = new_tileset;
         }
 
         inline virtual void place_auto(Vector2i coord) {
@@ -45,8 +83,53 @@ namespace jovial {
             JV_CORE_ERROR("method: 'erase_auto' not available on base TileMap class");
         }
 
+        // Recomputes the auto tile of an already placed coord
+        inline virtual void retile(Vector2i) {
+            JV_CORE_ERROR("method: 'retile' not available on base TileMap class");
+        }
+
+        // Writes the auto tile of every tile in one chunk to coords and resolved (CHUNK_AREA each)
+        // without changing the map, so several threads can resolve chunks at once. Returns the count.
+        inline virtual long resolve_chunk(Vector2i, Vector2i *, Vector2i *) const {
+            JV_CORE_ERROR("method: 'resolve_chunk' not available on base TileMap class");
+            return 0;
+        }
+
+        // Recomputes the auto tiles of every tile in one chunk, returns how many there were
+        inline long retile_chunk(Vector2i chunk_coord) {
+            JV_TILE_ZONE("TileMap::retile_chunk");
+            Vector2i coords[TileStorage::CHUNK_AREA], resolved[TileStorage::CHUNK_AREA];
+            long count = resolve_chunk(chunk_coord, coords, resolved);
+            for (long i = 0; i < count; ++i) tiles.insert(coords[i], resolved[i]);
+            return count;
+        }
+
+        // Places every coord first and then retiles each affected coord once, instead of
+        // retiling the neighbourhood again for every single placement.
+        inline virtual void place_auto_batch(const Vec<Vector2i> &coords) {
+            for (auto coord: coords) place_auto(coord);
+        }
+        inline virtual void erase_auto_batch(const Vec<Vector2i> &coords) {
+            for (auto coord: coords) erase_auto(coord);
+        }
+
+        // How far away (in tiles) a placement can change the auto tile of another coord
+        [[nodiscard]] inline virtual int retile_range() const {
+            return 1;
+        }
+
+        // Bulk operations, these write all the occupancy first and then auto tile the region once.
+        // The rects are inclusive.
+        void fill_rect_auto(Vector2i from, Vector2i to);
+        void erase_rect_auto(Vector2i from, Vector2i to);
+        void paint_brush_auto(Vector2i center, int radius, BrushShape shape, bool erasing = false);
+
+        // Scanline flood fill of the empty area around start, limited to the inclusive bounds
+        // because empty space is infinite. Returns the amount of filled coords.
+        long flood_fill_auto(Vector2i start, Vector2i from, Vector2i to);
+
         [[nodiscard]] inline bool has_uv(Vector2i coord) const {
-            return tile_uvs.has(coord);
+            return tileset && tileset->has_uv(coord);
         }
 
         [[nodiscard]] inline bool has(Vector2i coord) const {
@@ -55,10 +138,48 @@ namespace jovial {
 
         inline void erase(Vector2i coord) {
             tiles.erase(coord);
+            if (!listeners.is_empty()) notify_changed(coord, coord);
         }
 
         inline void clear() {
             tiles.clear();
+            if (auto layer = journaled_layer()) layer->clear();
+            if (!listeners.is_empty()) notify_changed(Vector2i(INT32_MIN, INT32_MIN), Vector2i(INT32_MAX, INT32_MAX));
+        }
+
+        // A second storage that undo/redo and clear() treat as part of the map, like terrain ids
+        inline virtual TileStorage *journaled_layer() {
+            return nullptr;
+        }
+
+        // Everything written between these becomes one undo step, including the auto tiling it caused.
+        // Calls nest, so a fill inside a stroke still undoes with the stroke.
+        inline void begin_action() {
+            journal.begin(tiles, journaled_layer());
+        }
+
+        inline void end_action() {
+            journal.end(tiles, journaled_layer());
+        }
+
+        inline bool undo() {
+            Vector2i from, to;
+            if (!journal.undo(tiles, from, to, journaled_layer())) return false;
+            if (!listeners.is_empty()) notify_changed(from, to);
+            return true;
+        }
+
+        inline bool redo() {
+            Vector2i from, to;
+            if (!journal.redo(tiles, from, to, journaled_layer())) return false;
+            if (!listeners.is_empty()) notify_changed(from, to);
+            return true;
+        }
+
+        inline void notify_changed(Vector2i from, Vector2i to) {
+            for (auto listener: listeners) {
+                listener->on_tiles_changed(this, from, to);
+            }
         }
 
         [[nodiscard]] inline Vector2i world_to_coord(Vector2 world) const {
@@ -75,10 +196,51 @@ namespace jovial {
             return tile.overlaps(Camera2D::get_visable_rect(using_vsize));
         }
 
-        void load_tiles();
-
         void draw(TextureDrawProps props = {});
 
+        // What the map holds, including its undo history and its share of the tileset
+        [[nodiscard]] virtual MemoryStats memory_stats() const;
+
+        void retile_batch(const Vec<Vector2i> &coords, int range, bool diagonals);
+
+    protected:
+        // Scratch flags for the bulk operations, padded by retile_range() around the touched coords
+        struct FillGrid {
+            static const uint8_t FILLED = 0b01;
+            static const uint8_t RETILED = 0b10;
+
+            Vector2i origin;
+            int width = 0;
+            int height = 0;
+            Vec<uint8_t> cells;
+
+            inline void reset(Vector2i from, Vector2i to) {
+                origin = from;
+                width = to.x - from.x + 1;
+                height = to.y - from.y + 1;
+                cells.clear();
+                cells.resize((long) width * height);
+                cells.fill(0);
+            }
+
+            [[nodiscard]] inline bool contains(Vector2i coord) const {
+                return coord.x >= origin.x && coord.y >= origin.y &&
+                       coord.x < origin.x + width && coord.y < origin.y + height;
+            }
+
+            inline uint8_t &at(Vector2i coord) {
+                return cells[(long) (coord.y - origin.y) * width + (coord.x - origin.x)];
+            }
+        };
+
+        // Writes the occupancy of the filled cells, before apply_fill auto tiles them
+        virtual void fill_cells(FillGrid &grid, bool erasing);
+
+    private:
+        void apply_fill(FillGrid &grid, bool erasing);
+
+    public:
+
         static inline Array<Vector2i, 4> coords_cardinal_to(Vector2i coord) {
             return {
                     Vector2i(0, 1),
@@ -106,74 +268,125 @@ namespace jovial {
         struct JonObject<TileMap *> {
             static String save(Generator &generator, TileMap *v);
         };
+
+        // The "tiles" array every tile map type writes, as coord/tile pairs
+        String save_tiles(Generator &generator, const TileStorage &tiles, std::atomic<long> *progress);
     }// namespace jon
 
 
-    class WangTileMap : public TileMap {
-    public:
-        WangTileMap(const Array<Vector2i, 16> &wang_tiles, const Texture &texture, Vector2 tile_size)
-            : wang_tiles(wang_tiles), TileMap(texture, tile_size) {}
+    // Neighbourhood shapes for auto tiling, bit i of a mask is set when the coord at offset (X[i], Y[i]) is occupied
+    struct Cardinal4 {
+        static constexpr int COUNT = 4;
+        static constexpr int X[COUNT] = {0, 1, 0, -1};
+        static constexpr int Y[COUNT] = {1, 0, -1, 0};
+    };
 
-        WangTileMap() = default;
+    struct Moore8 {
+        static constexpr int COUNT = 8;
+        static constexpr int X[COUNT] = {0, 1, 0, -1, 1, 1, -1, -1};
+        static constexpr int Y[COUNT] = {1, 0, -1, 0, 1, -1, -1, 1};
+    };
 
-        Array<Vector2i, 16> wang_tiles;
+    // Auto tile policies. A policy picks the tile of a coord from the occupancy mask of its
+    // neighbourhood (or from the map itself when USES_MASK is false) and says how far a
+    // placement reaches. AutoTileMap inherits from its policy, so policy data is directly on the map.
+    struct NoAutoTilePolicy {
+        using Neighbourhood = Cardinal4;
+        static constexpr bool USES_MASK = false;
+
+        Vector2i fill_tile;
+
+        template<typename Map>
+        [[nodiscard]] inline Vector2i resolve(const Map &map, Vector2i coord, int mask) const {
+            return fill_tile;
+        }
+
+        [[nodiscard]] inline int range() const {
+            return 0;
+        }
+
+        [[nodiscard]] inline long table_memory() const {
+            return (long) sizeof(fill_tile);
+        }
+    };
+
+    struct WangPolicy {
+        using Neighbourhood = Cardinal4;
+        static constexpr bool USES_MASK = true;
 
         static const int UP = 0b0001;
         static const int RIGHT = 0b0010;
         static const int DOWN = 0b0100;
         static const int LEFT = 0b1000;
 
-    public:
-        int calc_wang(Vector2i coord);
-
-        inline void rewang_all() {
-            for (auto &tile: tiles) {
-                rewang(tile.key);
-            }
-        }
+        static constexpr int TABLE_SIZE = 16;
+        static_assert(TABLE_SIZE == Tileset::WANG_TILE_COUNT, "Tileset wang table size out of date");
+        static constexpr const char *TABLE_NAME = "wang";// Key of the table in saved maps
 
-        inline void rewang(Vector2i coord) {
-            if (!has(coord)) return;
+        Array<Vector2i, TABLE_SIZE> wang_tiles;
 
-            int bits = calc_wang(coord);
-            place(coord, wang_tiles[bits]);
+        template<typename Map>
+        [[nodiscard]] inline Vector2i resolve(const Map &, Vector2i, int mask) const {
+            return wang_tiles[mask];
         }
 
-        inline void rewang_around(Vector2i coord) {
-            for (auto dir: coords_cardinal_to(coord))
-                rewang(coord + dir);
+        [[nodiscard]] inline int range() const {
+            return 1;
         }
 
-        inline void erase_wang(Vector2i coord) {
-            erase(coord);
-            rewang_around(coord);
+        [[nodiscard]] inline long table_memory() const {
+            return (long) sizeof(wang_tiles);
         }
 
-        inline void place_wang(Vector2i coord) {
-            int bits = calc_wang(coord);
-            place(coord, wang_tiles[bits]);
+        inline Vector2i *mask_table() {
+            return wang_tiles.items;
+        }
 
-            rewang_around(coord);
+        // Every mask has its own tile
+        static inline int table_index(int mask) {
+            return mask;
         }
 
-        inline void place_auto(Vector2i coord) override {
-            place_wang(coord);
+        static inline int table_mask(int index) {
+            return index;
         }
-        inline void erase_auto(Vector2i coord) override {
-            erase_wang(coord);
+    };
+
+    // A blob corner only shows when both edges next to it are set, so the 256 Moore masks collapse
+    // to 47 distinct tiles once the other corner bits are dropped
+    struct BlobTable {
+        static constexpr int COUNT = 47;
+
+        uint8_t index_of[256];// Any mask to the index of its tile
+        uint8_t mask_of[COUNT];// Tile index to its canonical mask
+
+        static constexpr int canonical(int mask) {
+            int edges = mask & 0b1111;
+            bool n = edges & 0b0001, e = edges & 0b0010, s = edges & 0b0100, w = edges & 0b1000;
+            int corners = (n && e ? 0b00010000 : 0) | (s && e ? 0b00100000 : 0) |
+                          (s && w ? 0b01000000 : 0) | (n && w ? 0b10000000 : 0);
+            return edges | (mask & corners);
         }
 
-        bool load_wang_from_jon(jon::JonNode &object);
+        static constexpr BlobTable make() {
+            BlobTable table{};
+            int count = 0;
+            for (int mask = 0; mask < 256; ++mask) {
+                if (canonical(mask) != mask) continue;
+                table.index_of[mask] = (uint8_t) count;
+                table.mask_of[count++] = (uint8_t) mask;
+            }
+            for (int mask = 0; mask < 256; ++mask) table.index_of[mask] = table.index_of[canonical(mask)];
+            return table;
+        }
     };
 
-    class BlobTileMap : public TileMap {
-    public:
-        BlobTileMap(const Array<Vector2i, 256> &blob_tiles, const Texture &texture, Vector2 tile_size)
-            : blob_tiles(blob_tiles), TileMap(texture, tile_size) {}
+    inline constexpr BlobTable BLOB_TABLE = BlobTable::make();
+    static_assert(BLOB_TABLE.mask_of[BlobTable::COUNT - 1] == 255, "Blob masks don't collapse to 47 tiles");
 
-        BlobTileMap() = default;
-
-        Array<Vector2i, 256> blob_tiles;
+    struct BlobPolicy {
+        using Neighbourhood = Moore8;
+        static constexpr bool USES_MASK = true;
 
         static const int N = 0b00000001;
         static const int E = 0b00000010;
@@ -184,8 +397,369 @@ namespace jovial {
         static const int SW = 0b01000000;
         static const int NW = 0b10000000;
 
+        static constexpr int TABLE_SIZE = BlobTable::COUNT;
+        static_assert(TABLE_SIZE == Tileset::BLOB_TILE_COUNT, "Tileset blob table size out of date");
+        static constexpr const char *TABLE_NAME = "blob";
+
+        Array<Vector2i, TABLE_SIZE> blob_tiles;
+
+        template<typename Map>
+        [[nodiscard]] inline Vector2i resolve(const Map &, Vector2i, int mask) const {
+            return blob_tiles[BLOB_TABLE.index_of[mask]];
+        }
+
+        [[nodiscard]] inline int range() const {
+            return 1;
+        }
+
+        [[nodiscard]] inline long table_memory() const {
+            return (long) sizeof(blob_tiles);
+        }
+
+        inline Vector2i *mask_table() {
+            return blob_tiles.items;
+        }
+
+        static inline int table_index(int mask) {
+            return BLOB_TABLE.index_of[mask];
+        }
+
+        static inline int table_mask(int index) {
+            return BLOB_TABLE.mask_of[index];
+        }
+    };
+
+    struct RulePolicy {
+        using Neighbourhood = Moore8;
+        static constexpr bool USES_MASK = false;
+
+        // Rules are compiled to bitmasks over the 7x7 window around the coord
+        static constexpr int WINDOW_RANGE = 3;
+        static constexpr int WINDOW_SIZE = WINDOW_RANGE * 2 + 1;
+        // compile_rules() builds a lookup table when the rules look at no more offsets than this
+        static constexpr int MAX_TABLE_BITS = 16;
+
+        // needed holds the offsets that have to be occupied. The parser records '#' as true and '.' as
+        // false, but both need a tile there
+        struct Rule {
+            Vec<Pair<Vector2i, bool>> needed;
+            Vector2i output;
+        };
+
+        int effect_range = 1;
+        Vec<Rule> rules;
+
+        inline void add_rule(const Rule &rule) {
+            CompiledRule compiled;
+            for (auto &need: rule.needed) {
+                int reach = math::MAX(need.first.x < 0 ? -need.first.x : need.first.x, need.first.y < 0 ? -need.first.y : need.first.y);
+                JV_CORE_ASSERT(reach <= WINDOW_RANGE, "Rules can only look 3 tiles away!");
+                rule_range = math::MAX(rule_range, reach);
+
+                compiled.occupied |= 1ull << window_bit(need.first);
+            }
+            window |= compiled.occupied;
+            compiled_rules.push_back(compiled);
+            rules.push_back(rule);
+
+            // A pattern that is already there never matches first
+            match_table.clear();
+            for (auto &match: matches) {
+                if (match.occupied == compiled.occupied) return;
+            }
+            matches.push_back({compiled.occupied, (int) rules.size() - 1});
+        }
+
+        inline void clear_rules() {
+            rules.clear();
+            compiled_rules.clear();
+            matches.clear();
+            match_table.clear();
+            window = 0;
+            rule_range = 1;
+        }
+
+        // Tabulates the first matching rule for every occupancy of the offsets the rules look at, so
+        // resolving is one lookup however many rules and symmetric variants there are. parse() and
+        // replace_rules() call this, after add_rule() the rules are tested in order until it's called again.
+        void compile_rules() {
+            match_table.clear();
+            int bits = __builtin_popcountll(window);
+            if (bits > MAX_TABLE_BITS || rules.size() >= UINT16_MAX) return;
+
+            int positions[WINDOW_SIZE * WINDOW_SIZE];
+            int count = 0;
+            for (uint64_t left = window; left; left &= left - 1) positions[count++] = __builtin_ctzll(left);
+
+            match_table.resize(1l << bits);
+            for (long index = 0; index < (1l << bits); ++index) {
+                uint64_t occupied = 0;
+                for (int i = 0; i < bits; ++i) {
+                    if (index >> i & 1) occupied |= 1ull << positions[i];
+                }
+                uint16_t found = 0;
+                for (auto &match: matches) {
+                    if ((occupied & match.occupied) == match.occupied) {
+                        found = (uint16_t) (match.rule + 1);
+                        break;
+                    }
+                }
+                match_table[index] = found;
+            }
+        }
+
+        template<typename Map>
+        [[nodiscard]] inline bool rule_works(const Map &map, const Rule &rule, Vector2i coord) const {
+            for (auto &need: rule.needed) {
+                if (!map.has(coord + need.first)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Reads every offset any rule looks at once, then the first rule whose masks match wins
+        template<typename Map>
+        [[nodiscard]] inline Vector2i resolve(const Map &map, Vector2i coord, int) const {
+            uint64_t occupied = 0;
+            long index = 0;// The same bits packed together, for the table
+            int packed = 0;
+            for (uint64_t bits = window; bits; bits &= bits - 1, ++packed) {
+                int bit = __builtin_ctzll(bits);
+                if (!map.has(coord + Vector2i(bit % WINDOW_SIZE - WINDOW_RANGE, bit / WINDOW_SIZE - WINDOW_RANGE))) continue;
+                occupied |= 1ull << bit;
+                index |= 1l << packed;
+            }
+            if (!match_table.is_empty()) {
+                uint16_t rule = match_table[index];
+                return rule ? rules[rule - 1].output : Vector2i(0, 0);
+            }
+            for (auto &match: matches) {
+                if ((occupied & match.occupied) == match.occupied) return rules[match.rule].output;
+            }
+            return {0, 0};
+        }
+
+        [[nodiscard]] inline int range() const {
+            return math::MAX(effect_range, rule_range);
+        }
+
+        [[nodiscard]] inline long table_memory() const {
+            long bytes = rules.size() * (long) sizeof(Rule) + compiled_rules.size() * (long) sizeof(CompiledRule) +
+                         matches.size() * (long) sizeof(Match) + match_table.size() * (long) sizeof(uint16_t);
+            for (auto &rule: rules) bytes += rule.needed.size() * (long) sizeof(Pair<Vector2i, bool>);
+            return bytes;
+        }
+
+        // Swaps in new_rules and returns the outputs whose cells may resolve differently now. Only
+        // the occupancy decides a cell's tile, so a cell whose first matching rule comes before the
+        // first rule with changed needs still matches it first and only changes if its output did.
+        // Everything matched at or after that rule, and the unmatched cells ({0, 0}), are stale.
+        Vec<Vector2i> replace_rules(const Vec<Rule> &new_rules) {
+            Vec<CompiledRule> old_compiled = compiled_rules;
+            Vec<Rule> old_rules = rules;
+            clear_rules();
+            for (auto &rule: new_rules) add_rule(rule);
+            compile_rules();
+
+            long same = 0;
+            while (same < old_rules.size() && same < rules.size() &&
+                   old_compiled[same].occupied == compiled_rules[same].occupied) {
+                ++same;
+            }
+
+            Vec<Vector2i> stale;
+            auto add_stale = [&](Vector2i output) {
+                for (auto tile: stale) {
+                    if (tile == output) return;
+                }
+                stale.push_back(output);
+            };
+            for (long i = 0; i < same; ++i) {
+                if (old_rules[i].output != rules[i].output) add_stale(old_rules[i].output);
+            }
+            for (long i = same; i < old_rules.size(); ++i) add_stale(old_rules[i].output);
+            if (same < old_rules.size() || same < rules.size()) add_stale({0, 0});
+            return stale;
+        }
+
+    private:
+        struct CompiledRule {
+            uint64_t occupied = 0;
+        };
+
+        struct Match {
+            uint64_t occupied;
+            int rule;
+        };
+
+        static inline int window_bit(Vector2i offset) {
+            return (offset.y + WINDOW_RANGE) * WINDOW_SIZE + offset.x + WINDOW_RANGE;
+        }
+
+        Vec<CompiledRule> compiled_rules;// One per rule, for diffing rule sets
+        Vec<Match> matches;              // Without the patterns an earlier rule already has
+        Vec<uint16_t> match_table;       // Rule index + 1 by packed window occupancy, 0 if none matches
+        uint64_t window = 0;             // Every offset some rule looks at
+        int rule_range = 1;
+    };
+
+    // A tile map with its auto tiling specialized at compile time. The overrides are final, so calls
+    // through the concrete type (and every loop inside the map) inline the mask and table lookup,
+    // while TileMap * users still go through the virtual functions.
+    template<typename Policy>
+    class AutoTileMap : public TileMap, public Policy {
     public:
-        int calc_blob(Vector2i coord);
+        using Neighbourhood = typename Policy::Neighbourhood;
+
+        AutoTileMap() = default;
+
+        AutoTileMap(const Tileset *tileset, Vector2 tile_size)
+            : TileMap(tileset, tile_size) {}
+
+        [[nodiscard]] inline int calc_mask(Vector2i coord) const {
+            int mask = 0;
+            for (int i = 0; i < Neighbourhood::COUNT; ++i) {
+                if (has(coord + Vector2i(Neighbourhood::X[i], Neighbourhood::Y[i]))) mask |= 1 << i;
+            }
+            return mask;
+        }
+
+        [[nodiscard]] inline Vector2i resolve_tile(Vector2i coord) const {
+            return Policy::resolve(*this, coord, Policy::USES_MASK ? calc_mask(coord) : 0);
+        }
+
+        inline void retile(Vector2i coord) final {
+            if (!has(coord)) return;
+            place(coord, resolve_tile(coord));
+        }
+
+        inline void retile_around(Vector2i coord) {
+            int range = Policy::range();
+            if (range <= 1) {
+                for (int i = 0; i < Neighbourhood::COUNT; ++i) {
+                    AutoTileMap::retile(coord + Vector2i(Neighbourhood::X[i], Neighbourhood::Y[i]));
+                }
+                return;
+            }
+            for (int y = -range; y <= range; ++y) {
+                for (int x = -range; x <= range; ++x) {
+                    if (x != 0 || y != 0) AutoTileMap::retile(coord + Vector2i(x, y));
+                }
+            }
+        }
+
+        inline void place_auto(Vector2i coord) final {
+            place(coord, resolve_tile(coord));
+            retile_around(coord);
+        }
+
+        inline void erase_auto(Vector2i coord) final {
+            erase(coord);
+            retile_around(coord);
+        }
+
+        inline void place_auto_batch(const Vec<Vector2i> &coords) final {
+            for (auto coord: coords) tiles.insert(coord, {0, 0});
+            retile_batch(coords, Policy::range(), true);
+            tiles.compact();
+        }
+
+        inline void erase_auto_batch(const Vec<Vector2i> &coords) final {
+            for (auto coord: coords) erase(coord);
+            retile_batch(coords, Policy::range(), true);
+            tiles.compact();
+        }
+
+        [[nodiscard]] inline int retile_range() const final {
+            return Policy::range();
+        }
+
+        [[nodiscard]] inline MemoryStats memory_stats() const override {
+            MemoryStats stats = TileMap::memory_stats();
+            stats.rule_tables += Policy::table_memory();
+            return stats;
+        }
+
+        inline long resolve_chunk(Vector2i chunk_coord, Vector2i *coords, Vector2i *resolved) const final {
+            long count = 0;
+            Vector2i from(chunk_coord.x * TileStorage::CHUNK_SIZE, chunk_coord.y * TileStorage::CHUNK_SIZE);
+            tiles.for_each_in_rect(from, from + Vector2i(TileStorage::CHUNK_MASK, TileStorage::CHUNK_MASK), [&](Vector2i coord, Vector2i) {
+                coords[count] = coord;
+                resolved[count++] = resolve_tile(coord);
+            });
+            return count;
+        }
+
+        inline void retile_all() {
+            JV_TILE_ZONE("AutoTileMap::retile_all");
+            for (auto &tile: tiles) {
+                tiles.insert(tile.key, resolve_tile(tile.key));
+            }
+            tiles.compact();
+            if (!listeners.is_empty()) notify_changed(Vector2i(INT32_MIN, INT32_MIN), Vector2i(INT32_MAX, INT32_MAX));
+        }
+    };
+
+    class WangTileMap : public AutoTileMap<WangPolicy> {
+    public:
+        WangTileMap(const Array<Vector2i, 16> &wang_tiles, const Tileset *tileset, Vector2 tile_size)
+            : AutoTileMap(tileset, tile_size) {
+            this->wang_tiles = wang_tiles;
+        }
+
+        // Starts out with the tileset's wang table, at its tile size
+        explicit WangTileMap(const Tileset *tileset)
+            : WangTileMap(tileset->wang_tiles, tileset, tileset->tile_size) {}
+
+        WangTileMap() = default;
+
+    public:
+        [[nodiscard]] inline int calc_wang(Vector2i coord) const {
+            return calc_mask(coord);
+        }
+
+        inline void rewang_all() {
+            retile_all();
+        }
+
+        inline void rewang(Vector2i coord) {
+            retile(coord);
+        }
+
+        inline void rewang_around(Vector2i coord) {
+            retile_around(coord);
+        }
+
+        inline void erase_wang(Vector2i coord) {
+            erase_auto(coord);
+        }
+
+        inline void place_wang(Vector2i coord) {
+            place_auto(coord);
+        }
+
+        bool load_wang_from_jon(jon::JonNode &object);
+    };
+
+    class BlobTileMap : public AutoTileMap<BlobPolicy> {
+    public:
+        BlobTileMap(const Array<Vector2i, TABLE_SIZE> &blob_tiles, const Tileset *tileset, Vector2 tile_size)
+            : AutoTileMap(tileset, tile_size) {
+            this->blob_tiles = blob_tiles;
+        }
+
+        // Starts out with the tileset's blob table, at its tile size
+        explicit BlobTileMap(const Tileset *tileset)
+            : BlobTileMap(tileset->blob_tiles, tileset, tileset->tile_size) {}
+
+        BlobTileMap() = default;
+
+    public:
+        // Index into blob_tiles
+        [[nodiscard]] inline int calc_blob(Vector2i coord) const {
+            return BLOB_TABLE.index_of[calc_mask(coord)];
+        }
 
         static inline Vector2i get_direction_vector(int direction) {
             switch (direction) {
@@ -212,174 +786,458 @@ namespace jovial {
         }
 
         inline void reblob_all() {
-            for (auto &tile: tiles) {
-                reblob(tile.key);
-            }
+            retile_all();
         }
 
         inline void reblob(Vector2i coord) {
-            if (!has(coord)) return;
-
-            int bits = calc_blob(coord);
-            place(coord, blob_tiles[bits]);
+            retile(coord);
         }
 
-
         inline void reblob_around(Vector2i coord) {
-            for (auto dir: coords_around(coord))
-                reblob(coord + dir);
+            retile_around(coord);
         }
 
         inline void erase_blob(Vector2i coord) {
-            erase(coord);
-            reblob_around(coord);
+            erase_auto(coord);
         }
 
         inline void place_blob(Vector2i coord) {
-            int bits = calc_blob(coord);
-            place(coord, blob_tiles[bits]);
-
-            reblob_around(coord);
-        }
-
-        inline void place_auto(Vector2i coord) override {
-            place_blob(coord);
-        }
-        inline void erase_auto(Vector2i coord) override {
-            erase_blob(coord);
+            place_auto(coord);
         }
 
         bool load_blob_from_jon(jon::JonNode &object);
     };
 
-    class RuleTileMap : public TileMap {
+    class RuleTileMap : public AutoTileMap<RulePolicy> {
     public:
-        struct Rule {
-            Vec<Pair<Vector2i, bool>> needed;
+        // A symmetric copy of a rule: its offsets mirrored, then turned clockwise
+        struct Variant {
+            int turns = 0;
+            bool mirror_x = false;
+            bool mirror_y = false;
             Vector2i output;
         };
 
-        int effect_range = 1;
-        Vec<Rule> rules;
-
-        Vector2i parse_header(StrView &rule_file) {
-            rule_file.trim_lead();
-
-            if (rule_file[0] != '[') JV_CORE_FATAL("Expected start of rule: '[' but found: '", rule_file[0], "'")
+        static bool parse_uv(StrView &rule_file, Vector2i &uv) {
+            if (rule_file.is_empty() || rule_file[0] != '[') {
+                JV_CORE_ERROR("Expected start of rule: '[' but found: '", rule_file.is_empty() ? ' ' : rule_file[0], "'");
+                return false;
+            }
             rule_file.c_str += 1;
             rule_file.trim_lead();
 
-            Vector2i uv;
-
             StrView x = rule_file.chop_to(',');
             uv.x = x.to_int();
             rule_file.c_str += x.len;
+            if (rule_file[0] == ',') rule_file.c_str += 1;
             rule_file.trim_lead();
 
             StrView y = rule_file.chop_to(']');
             uv.y = y.to_int();
             rule_file.c_str += y.len;
+            if (rule_file[0] != ']') {
+                JV_CORE_ERROR("Expected end of rule output: ']'");
+                return false;
+            }
             rule_file.c_str += 1;// skip ']'
-            rule_file.trim_lead();
-
-            return uv;
+            while (rule_file[0] == ' ' || rule_file[0] == '\t') rule_file.c_str += 1;
+            return true;
         }
 
-        void parse(StrView rule_file) {
+        // The output, then optionally symmetry annotations on the same line, each followed by the
+        // outputs of the variants it adds (the rule's own output where left out):
+        //     [0, 0] rotate [2, 0] [2, 2] [0, 2]   turned 90, 180 and 270 degrees clockwise
+        //     [0, 0] mirror_x [2, 0]               mirrored left to right
+        //     [0, 0] mirror_y [0, 2]               mirrored top to bottom
+        static bool parse_header(StrView &rule_file, Vector2i &uv, Vec<Variant> &variants) {
             rule_file.trim_lead();
-            if (rule_file.is_empty()) return;
-            Vector2i uv = parse_header(rule_file);
-
-            Vector2i rule_pos;
-            int rule_pos_index = rule_file.find_char('x');
-            for (int i = 0; i < rule_pos_index; ++i) {
-                if (rule_file[i] == '.' || rule_file[i] == '#' || rule_file[i] == '?') {
-                    rule_pos.x += 1;
+            if (!parse_uv(rule_file, uv)) return false;
+
+            while ((rule_file[0] >= 'a' && rule_file[0] <= 'z') || rule_file[0] == '_') {
+                long length = 0;
+                while ((rule_file[length] >= 'a' && rule_file[length] <= 'z') || rule_file[length] == '_' ||
+                       (rule_file[length] >= '0' && rule_file[length] <= '9')) {
+                    ++length;
                 }
-                if (rule_file[i] == '\n') {
-                    rule_pos.x = 0;
-                    rule_pos.y += 1;
+                StrView keyword(rule_file.c_str, length);
+                rule_file.c_str += length;
+                while (rule_file[0] == ' ' || rule_file[0] == '\t') rule_file.c_str += 1;
+
+                bool rotate = keyword == C_STR_VIEW("rotate");
+                if (!rotate && !(keyword == C_STR_VIEW("mirror_x")) && !(keyword == C_STR_VIEW("mirror_y"))) {
+                    JV_CORE_ERROR("Unknown rule annotation: '", String(keyword).c_str(), "'");
+                    return false;
+                }
+                for (int i = 0; i < (rotate ? 3 : 1); ++i) {
+                    Variant variant;
+                    variant.turns = rotate ? i + 1 : 0;
+                    variant.mirror_x = keyword == C_STR_VIEW("mirror_x");
+                    variant.mirror_y = keyword == C_STR_VIEW("mirror_y");
+                    variant.output = uv;
+                    if (rule_file[0] == '[' && !parse_uv(rule_file, variant.output)) return false;
+                    variants.push_back(variant);
                 }
             }
+            rule_file.trim_lead();
+            return true;
+        }
+
+        static inline Vector2i transform(Vector2i offset, const Variant &variant) {
+            if (variant.mirror_x) offset.x = -offset.x;
+            if (variant.mirror_y) offset.y = -offset.y;
+            for (int i = 0; i < variant.turns; ++i) offset = Vector2i(offset.y, -offset.x);// y is up in rules
+            return offset;
+        }
 
-            Rule rule;
-            Vector2i pos(0, 0);
+        // Parses every rule of rule_file into out, with its symmetric variants expanded after it.
+        // Variants that come out the same as an earlier one are dropped. Returns false if the file
+        // is malformed.
+        static bool parse_rules(StrView rule_file, Vec<Rule> &out) {
             while (true) {
-                if (rule_file[0] == '?' || rule_file[0] == 'x') {
-                    pos.x += 1;
-                } else if (rule_file[0] == '.') {
-                    Vector2i rel = pos - rule_pos;
-                    rel.y = -rel.y;
-                    rule.needed.push_back({rel, false});
-                    pos.x += 1;
-                } else if (rule_file[0] == '#') {
-                    Vector2i rel = pos - rule_pos;
-                    rel.y = -rel.y;
-                    rule.needed.push_back({rel, true});
-                    pos.x += 1;
-                } else if (rule_file[0] == '\n') {
-                    pos.x = 0;
-                    pos.y += 1;
-                } else {
-                    break;
+                rule_file.trim_lead();
+                if (rule_file.is_empty() || rule_file[0] == '\0') return true;
+
+                Vector2i uv;
+                Vec<Variant> variants;
+                if (!parse_header(rule_file, uv, variants)) return false;
+
+                Vector2i rule_pos;
+                int rule_pos_index = rule_file.find_char('x');
+                for (int i = 0; i < rule_pos_index; ++i) {
+                    if (rule_file[i] == '.' || rule_file[i] == '#' || rule_file[i] == '?') {
+                        rule_pos.x += 1;
+                    }
+                    if (rule_file[i] == '\n') {
+                        rule_pos.x = 0;
+                        rule_pos.y += 1;
+                    }
                 }
-                rule_file.c_str += 1;
-                while (rule_file[0] == ' ') {
+
+                Rule rule;
+                Vector2i pos(0, 0);
+                while (true) {
+                    if (rule_file[0] == '?' || rule_file[0] == 'x') {
+                        pos.x += 1;
+                    } else if (rule_file[0] == '.') {
+                        Vector2i rel = pos - rule_pos;
+                        rel.y = -rel.y;
+                        rule.needed.push_back({rel, false});
+                        pos.x += 1;
+                    } else if (rule_file[0] == '#') {
+                        Vector2i rel = pos - rule_pos;
+                        rel.y = -rel.y;
+                        rule.needed.push_back({rel, true});
+                        pos.x += 1;
+                    } else if (rule_file[0] == '\n') {
+                        pos.x = 0;
+                        pos.y += 1;
+                    } else {
+                        break;
+                    }
                     rule_file.c_str += 1;
+                    while (rule_file[0] == ' ') {
+                        rule_file.c_str += 1;
+                    }
+                }
+                // uv.y = -uv.y;
+                rule.output = uv;
+                for (auto &need: rule.needed) {
+                    int reach = math::MAX(need.first.x < 0 ? -need.first.x : need.first.x, need.first.y < 0 ? -need.first.y : need.first.y);
+                    if (reach > WINDOW_RANGE) {
+                        JV_CORE_ERROR("Rule for ", uv, " looks further than ", WINDOW_RANGE, " tiles away");
+                        return false;
+                    }
+                }
+                long first = out.size();
+                out.push_back(rule);
+
+                for (auto &variant: variants) {
+                    Rule turned;
+                    turned.output = variant.output;
+                    for (auto &need: rule.needed) turned.needed.push_back({transform(need.first, variant), need.second});
+
+                    bool duplicate = false;
+                    for (long i = first; i < out.size() && !duplicate; ++i) duplicate = same_needs(out[i], turned);
+                    if (!duplicate) out.push_back(turned);
                 }
             }
-            // uv.y = -uv.y;
-            rule.output = uv;
-            print("Output: ", rule.output, ", Needs: ", rule.needed);
-            rules.push_back(rule);
+        }
 
-            rule_file.trim_lead();
-            if (rule_file.is_empty() || rule_file[0] == '\0') {
-                return;
+        static bool same_needs(const Rule &a, const Rule &b) {
+            if (a.needed.size() != b.needed.size()) return false;
+            for (auto &need: a.needed) {
+                bool found = false;
+                for (auto &other: b.needed) found = found || (other.first == need.first && other.second == need.second);
+                if (!found) return false;
             }
+            return true;
+        }
 
-            parse(rule_file);
+        void parse(StrView rule_file) {
+            Vec<Rule> parsed;
+            if (!parse_rules(rule_file, parsed)) JV_CORE_FATAL("Could not parse the tile map rules!")
+            for (auto &rule: parsed) add_rule(rule);
+            compile_rules();
         }
 
-        inline bool rule_works(const Rule &rule, Vector2i coord) {
-            for (auto &need: rule.needed) {
-                if (!has(coord + need.first)) {
-                    return false;
-                }
-            }
+        // Swaps the rules for the ones in rule_file without touching the tiles and returns the outputs
+        // whose cells have to be retiled (see replace_rules), for a TileRetileJob to spread over frames.
+        // A malformed file keeps the current rules.
+        bool reload(StrView rule_file, Vec<Vector2i> &stale_outputs) {
+            JV_TILE_ZONE("RuleTileMap::reload");
+            Vec<Rule> parsed;
+            if (!parse_rules(rule_file, parsed)) return false;
+            stale_outputs = replace_rules(parsed);
             return true;
         }
 
+        inline bool rule_works(const Rule &rule, Vector2i coord) {
+            return RulePolicy::rule_works(*this, rule, coord);
+        }
+
         void rerule(Vector2i coord) {
-            for (auto &rule: rules) {
-                if (rule_works(rule, coord)) {
-                    place(coord, rule.output);
-                    return;
-                }
-            }
-            place(coord, {0, 0});
+            place(coord, resolve_tile(coord));
         }
 
         inline void place_rule(Vector2i coord) {
-            for (auto &rule: rules) {
-                if (rule_works(rule, coord)) {
-                    place(coord, rule.output);
-                    for (int i = effect_range; i > 0; --i) {
-                        for (auto dir: BlobTileMap::coords_around(coord)) {
-                            if (has(coord + dir)) {
-                                rerule(coord + dir);
-                            }
-                        }
-                    }
-                    return;
+            place_auto(coord);
+        }
+    };
+
+    // Several terrains auto tiled in one map. Every cell has a terrain id in the terrain layer (0 is
+    // empty) and gets its tile from the transition table of its terrain and the terrain it borders:
+    // a wang table indexed by which cardinal neighbours share the cell's terrain. The bordered
+    // terrain is the highest other id around the cell, and pairs without a table fall back to the
+    // table against empty. place_auto and the bulk operations paint paint_terrain.
+    class TerrainTileMap : public TileMap {
+    public:
+        using Neighbourhood = Cardinal4;
+
+        static constexpr int MAX_TERRAINS = 8;// Including empty
+
+        TileStorage terrain;// The id is in x
+        int paint_terrain = 1;
+
+        TerrainTileMap() = default;
+
+        TerrainTileMap(const Tileset *tileset, Vector2 tile_size)
+            : TileMap(tileset, tile_size) {}
+
+        // The tiles of terrain_id next to other (0 for empty), indexed like WangPolicy::wang_tiles
+        inline void set_transition(int terrain_id, int other, const Array<Vector2i, 16> &wang_tiles) {
+            JV_CORE_ASSERT(terrain_id > 0 && terrain_id < MAX_TERRAINS && other >= 0 && other < MAX_TERRAINS, "Terrain id out of range!");
+            transitions[terrain_id * MAX_TERRAINS + other] = wang_tiles;
+            has_transition |= 1ull << (terrain_id * MAX_TERRAINS + other);
+        }
+
+        [[nodiscard]] inline int terrain_at(Vector2i coord) const {
+            Vector2i id;
+            return terrain.get_if_contains(coord, id) ? id.x : 0;
+        }
+
+        [[nodiscard]] inline Vector2i resolve_tile(int terrain_id, int other, int mask) const {
+            int pair = terrain_id * MAX_TERRAINS + other;
+            if (!(has_transition >> pair & 1)) pair = terrain_id * MAX_TERRAINS;
+            return transitions[pair][mask];
+        }
+
+        [[nodiscard]] inline Vector2i resolve_tile(Vector2i coord) const {
+            int terrain_id = terrain_at(coord), other = 0, mask = 0;
+            for (int i = 0; i < Neighbourhood::COUNT; ++i) {
+                int neighbour = terrain_at(coord + Vector2i(Neighbourhood::X[i], Neighbourhood::Y[i]));
+                if (neighbour == terrain_id) mask |= 1 << i;
+                else other = math::MAX(other, neighbour);
+            }
+            return resolve_tile(terrain_id, other, mask);
+        }
+
+        inline void retile(Vector2i coord) final {
+            if (!has(coord)) return;
+            place(coord, resolve_tile(coord));
+        }
+
+        inline void retile_around(Vector2i coord) {
+            for (int i = 0; i < Neighbourhood::COUNT; ++i) {
+                TerrainTileMap::retile(coord + Vector2i(Neighbourhood::X[i], Neighbourhood::Y[i]));
+            }
+        }
+
+        inline void place_auto(Vector2i coord) final {
+            terrain.insert(coord, {paint_terrain, 0});
+            place(coord, resolve_tile(coord));
+            retile_around(coord);
+        }
+
+        inline void erase_auto(Vector2i coord) final {
+            terrain.erase(coord);
+            erase(coord);
+            retile_around(coord);
+        }
+
+        void place_auto_batch(const Vec<Vector2i> &coords) final;
+        void erase_auto_batch(const Vec<Vector2i> &coords) final;
+
+        [[nodiscard]] inline int retile_range() const final {
+            return 1;
+        }
+
+        // The terrain layer counts as cells, the transition tables as rule tables
+        [[nodiscard]] inline MemoryStats memory_stats() const override {
+            MemoryStats stats = TileMap::memory_stats();
+            stats += terrain.memory_stats();
+            stats.rule_tables += (long) sizeof(transitions);
+            return stats;
+        }
+
+        // Every terrain's neighbour masks in one pass over the chunk's bitplanes
+        long resolve_chunk(Vector2i chunk_coord, Vector2i *coords, Vector2i *resolved) const final;
+
+        void retile_all();
+
+        inline TileStorage *journaled_layer() final {
+            return &terrain;
+        }
+
+    protected:
+        void fill_cells(FillGrid &grid, bool erasing) final;
+
+    private:
+        Array<Vector2i, 16> transitions[MAX_TERRAINS * MAX_TERRAINS];
+        uint64_t has_transition = 0;// Bit terrain_id * MAX_TERRAINS + other
+    };
+
+    // Type erased handle to an auto tiled map with a mask table (wang, blob), so callers like the
+    // editor can edit the table without knowing the policy. Indexed by mask, masks that share a
+    // tile share the entry.
+    class AnyAutoTileMap {
+    public:
+        AnyAutoTileMap() = default;
+
+        template<typename Policy>
+        explicit AnyAutoTileMap(AutoTileMap<Policy> *map)
+            : map(map), table(map->mask_table()), table_size(Policy::TABLE_SIZE), table_name(Policy::TABLE_NAME),
+              mask_count(1 << Policy::Neighbourhood::COUNT), index_of(Policy::table_index), mask_of(Policy::table_mask) {}
+
+        [[nodiscard]] inline bool is_valid() const {
+            return map != nullptr;
+        }
+
+        inline TileMap *operator->() const {
+            return map;
+        }
+
+        inline Vector2i &operator[](int mask) const {
+            JV_CORE_ASSERT(mask >= 0 && mask < mask_count, "Auto tile mask out of range!");
+            return table[index_of(mask)];
+        }
+
+        // The mask standing in for every mask of that table entry
+        [[nodiscard]] inline int canonical_mask(int mask) const {
+            return mask_of(index_of(mask));
+        }
+
+        // The canonical mask of entry index < table_size
+        [[nodiscard]] inline int mask_at(int index) const {
+            return mask_of(index);
+        }
+
+        TileMap *map = nullptr;
+        Vector2i *table = nullptr;
+        int table_size = 0;
+        const char *table_name = nullptr;
+        int mask_count = 0;
+
+    private:
+        int (*index_of)(int) = nullptr;
+        int (*mask_of)(int) = nullptr;
+    };
+
+    // Turns the per-frame mouse samples of a held button into a continuous stroke. The cells between
+    // two samples are filled in with Bresenham, cells the stroke already covered are skipped and the
+    // new cells of every frame are auto tiled as one batch.
+    class TileStroke {
+    public:
+        // Call every frame the button is held
+        void paint(TileMap *map, Vector2i coord, bool erasing);
+
+        // Call once the button is released, the whole stroke becomes one undo step
+        inline void finish() {
+            if (active) map->end_action();
+            active = false;
+            map = nullptr;
+        }
+
+        [[nodiscard]] inline bool is_active() const {
+            return active;
+        }
+
+        int brush_radius = 0;
+        BrushShape brush_shape = BrushShape::Square;
+
+    private:
+        void add_line(Vector2i from, Vector2i to);
+
+        inline void add_cell(Vector2i coord) {
+            for (int y = -brush_radius; y <= brush_radius; ++y) {
+                for (int x = -brush_radius; x <= brush_radius; ++x) {
+                    if (brush_shape == BrushShape::Circle && x * x + y * y > brush_radius * brush_radius) continue;
+
+                    Vector2i at = coord + Vector2i(x, y);
+                    if (painted.has(at)) continue;
+                    painted.insert(at, true);
+                    pending.push_back(at);
                 }
             }
-            place(coord, {0, 0});
         }
 
-        inline void place_auto(Vector2i coord) override {
-            place_rule(coord);
+        bool active = false;
+        bool erasing = false;
+        TileMap *map = nullptr;
+        Vector2i last;
+        Vector2iMap<bool> painted;
+        Vec<Vector2i> pending;
+    };
+
+    // Re-auto tiles a whole map over several frames after its table changed, so a table edit doesn't
+    // hitch. Chunks nearest to the focus go first and every update() stops once its time budget
+    // is spent, picking up at the next chunk the frame after. Starting again while running starts
+    // over, the chunks that were already done used the old table.
+    class TileRetileJob {
+    public:
+        // Microseconds update() may spend, it always does at least one chunk
+        long frame_budget_us = 2000;
+
+        void start(TileMap *map, Vector2i focus);
+
+        // Only retiles the chunks holding one of stale_tiles, like the outputs a rule reload changed.
+        // Restarting a job that is still running keeps the tiles it was looking for as well.
+        void start(TileMap *map, Vector2i focus, const Vec<Vector2i> &stale_tiles);
+
+        // Call every frame, returns true while there are chunks left
+        bool update();
+
+        inline void cancel() {
+            map = nullptr;
+            chunk_coords.clear();
+            next = 0;
         }
+
+        [[nodiscard]] inline bool is_running() const {
+            return map != nullptr;
+        }
+
+        [[nodiscard]] inline float get_progress() const {
+            return chunk_coords.is_empty() ? 1.0f : (float) next / (float) chunk_coords.size();
+        }
+
+    private:
+        [[nodiscard]] bool has_stale_tile(Vector2i chunk_coord) const;
+
+        TileMap *map = nullptr;
+        Vec<Vector2i> chunk_coords;
+        long next = 0;
+        bool filtered = false;
+        Vec<Vector2i> stale_tiles;
     };
 
     namespace jon {
@@ -424,79 +1282,460 @@ namespace jovial {
         return true;
     }
 
-    void TileMap::load_tiles() {
-        float tiles_x = (float) texture.width / tile_size.x;
-        float tiles_y = (float) texture.height / tile_size.y;
-        float w = 1.0f / tiles_x;
-        float h = 1.0f / tiles_y;
+    void TileMap::retile_batch(const Vec<Vector2i> &coords, int range, bool diagonals) {
+        JV_TILE_ZONE("TileMap::retile_batch");
+        Vector2iMap<bool> visited;
+        for (auto coord: coords) {
+            for (int y = -range; y <= range; ++y) {
+                for (int x = -range; x <= range; ++x) {
+                    if (!diagonals && x != 0 && y != 0) continue;
+
+                    Vector2i at = coord + Vector2i(x, y);
+                    if (visited.has(at)) continue;
+                    visited.insert(at, true);
+                    if (has(at)) retile(at);
+                }
+            }
+        }
+    }
+
+    void TileMap::fill_rect_auto(Vector2i from, Vector2i to) {
+        Vector2i min(math::MIN(from.x, to.x), math::MIN(from.y, to.y));
+        Vector2i max(math::MAX(from.x, to.x), math::MAX(from.y, to.y));
+        int range = retile_range();
+
+        FillGrid grid;
+        grid.reset(min - Vector2i(range, range), max + Vector2i(range, range));
+        for (int y = min.y; y <= max.y; ++y) {
+            for (int x = min.x; x <= max.x; ++x) grid.at({x, y}) = FillGrid::FILLED;
+        }
+        apply_fill(grid, false);
+    }
+
+    void TileMap::erase_rect_auto(Vector2i from, Vector2i to) {
+        Vector2i min(math::MIN(from.x, to.x), math::MIN(from.y, to.y));
+        Vector2i max(math::MAX(from.x, to.x), math::MAX(from.y, to.y));
+        int range = retile_range();
+
+        FillGrid grid;
+        grid.reset(min - Vector2i(range, range), max + Vector2i(range, range));
+        for (int y = min.y; y <= max.y; ++y) {
+            for (int x = min.x; x <= max.x; ++x) grid.at({x, y}) = FillGrid::FILLED;
+        }
+        apply_fill(grid, true);
+    }
+
+    void TileMap::paint_brush_auto(Vector2i center, int radius, BrushShape shape, bool erasing) {
+        Vector2i extent(radius, radius);
+        if (shape == BrushShape::Square) {
+            if (erasing) erase_rect_auto(center - extent, center + extent);
+            else fill_rect_auto(center - extent, center + extent);
+            return;
+        }
 
-        for (int x = 0; x < (int) tiles_x; ++x) {
-            for (int y = 0; y < (int) tiles_y; ++y) {
-                Rect2 uv = {w * (float) x, h * (float) y,
-                            w * ((float) x + 1), h * ((float) y + 1)};
-                add_tile({x, y}, uv);
+        int range = retile_range();
+        FillGrid grid;
+        grid.reset(center - extent - Vector2i(range, range), center + extent + Vector2i(range, range));
+        for (int y = -radius; y <= radius; ++y) {
+            for (int x = -radius; x <= radius; ++x) {
+                if (x * x + y * y <= radius * radius) grid.at(center + Vector2i(x, y)) = FillGrid::FILLED;
             }
         }
+        apply_fill(grid, erasing);
     }
 
-    void TileMap::draw(TextureDrawProps props) {
-        if (!visable) return;
+    long TileMap::flood_fill_auto(Vector2i start, Vector2i from, Vector2i to) {
+        Vector2i min(math::MIN(from.x, to.x), math::MIN(from.y, to.y));
+        Vector2i max(math::MAX(from.x, to.x), math::MAX(from.y, to.y));
+        if (start.x < min.x || start.y < min.y || start.x > max.x || start.y > max.y || has(start)) return 0;
+
+        int range = retile_range();
+        FillGrid grid;
+        grid.reset(min - Vector2i(range, range), max + Vector2i(range, range));
+
+        auto fillable = [&](Vector2i coord) {
+            return coord.x >= min.x && coord.x <= max.x && !(grid.at(coord) & FillGrid::FILLED) && !has(coord);
+        };
 
-        for (auto &tile: tiles) {
-            if (is_tile_visible(tile.key)) {
-                Rect2 uv;
-                if (!tile_uvs.get_if_contains(tile.value, uv)) {
-                    JV_CORE_FATAL("Tilemap does not contain key: ", tile.value);
+        long filled = 0;
+        Vec<Vector2i> seeds;
+        seeds.push_back(start);
+        while (!seeds.is_empty()) {
+            Vector2i seed = seeds[seeds.size() - 1];
+            seeds.resize(seeds.size() - 1);
+            if (!fillable(seed)) continue;
+
+            int left = seed.x, right = seed.x;
+            while (fillable({left - 1, seed.y})) --left;
+            while (fillable({right + 1, seed.y})) ++right;
+            for (int x = left; x <= right; ++x) grid.at({x, seed.y}) = FillGrid::FILLED;
+            filled += right - left + 1;
+
+            // Push one seed per run of fillable coords on the rows above and below
+            for (int y = seed.y - 1; y <= seed.y + 1; y += 2) {
+                if (y < min.y || y > max.y) continue;
+                bool in_run = false;
+                for (int x = left; x <= right; ++x) {
+                    bool open = fillable({x, y});
+                    if (open && !in_run) seeds.push_back({x, y});
+                    in_run = open;
                 }
+            }
+        }
+
+        apply_fill(grid, false);
+        return filled;
+    }
 
-                props.uv = tile_uvs.get(tile.value);
-                draw_texture(texture, coord_to_world(tile.key), props);
+    void TileMap::fill_cells(FillGrid &grid, bool erasing) {
+        JV_TILE_ZONE("TileMap::fill_cells");
+        if (!erasing) {
+            long filled = 0;
+            for (auto flags: grid.cells) filled += flags & FillGrid::FILLED;
+            tiles.reserve(tiles.size() + filled);
+        }
+
+        Vector2i end = grid.origin + Vector2i(grid.width, grid.height);
+        for (int y = grid.origin.y; y < end.y; ++y) {
+            for (int x = grid.origin.x; x < end.x; ++x) {
+                if (!(grid.at({x, y}) & FillGrid::FILLED)) continue;
+                if (erasing) tiles.erase({x, y});
+                else tiles.insert({x, y}, {0, 0});
             }
         }
     }
 
-    namespace jon {
-        String JonObject<TileMap *>::save(Generator &generator, TileMap *v) {
-            String res;
-            res += generator.push_object();
+    void TileMap::apply_fill(FillGrid &grid, bool erasing) {
+        int range = retile_range();
+        Vector2i end = grid.origin + Vector2i(grid.width, grid.height);
+
+        fill_cells(grid, erasing);
+
+        // Every coord whose whole neighbourhood got filled ends up with the same tile,
+        // so only the first one needs to be computed
+        bool has_interior_tile = false;
+        Vector2i interior_tile;
+
+        for (int y = grid.origin.y; y < end.y; ++y) {
+            for (int x = grid.origin.x; x < end.x; ++x) {
+                Vector2i coord(x, y);
+                if (!(grid.at(coord) & FillGrid::FILLED)) continue;
+
+                bool interior = !erasing;
+                for (int ny = y - range; ny <= y + range; ++ny) {
+                    for (int nx = x - range; nx <= x + range; ++nx) {
+                        uint8_t &flags = grid.at({nx, ny});
+                        if (flags & FillGrid::FILLED) continue;
+                        interior = false;
+                        if (flags & FillGrid::RETILED) continue;
+                        flags |= FillGrid::RETILED;
+                        if (has({nx, ny})) retile({nx, ny});
+                    }
+                }
 
-            res += generator.save_str("size", v->tile_size);
+                if (erasing) continue;
+                if (!interior) {
+                    retile(coord);
+                } else if (has_interior_tile) {
+                    tiles.insert(coord, interior_tile);
+                } else {
+                    retile(coord);
+                    interior_tile = tiles.get(coord);
+                    has_interior_tile = true;
+                }
+            }
+        }
+
+        tiles.compact();
+        if (!listeners.is_empty()) notify_changed(grid.origin, end - Vector2i(1, 1));
+    }
+
+    void TileStroke::paint(TileMap *map, Vector2i coord, bool erasing) {
+        if (!active || erasing != this->erasing || map != this->map) {
+            finish();
+            map->begin_action();
+            this->map = map;
+            active = true;
+            this->erasing = erasing;
+            painted.clear();
+            add_cell(coord);
+        } else if (coord != last) {
+            add_line(last, coord);
+        }
+        last = coord;
+
+        if (pending.is_empty()) return;
+        if (erasing) map->erase_auto_batch(pending);
+        else map->place_auto_batch(pending);
+        pending.clear();
+    }
+
+    void TileStroke::add_line(Vector2i from, Vector2i to) {
+        int dx = to.x > from.x ? to.x - from.x : from.x - to.x;
+        int dy = to.y > from.y ? from.y - to.y : to.y - from.y;
+        int sx = from.x < to.x ? 1 : -1;
+        int sy = from.y < to.y ? 1 : -1;
+        int err = dx + dy;
+
+        Vector2i at = from;
+        while (true) {
+            add_cell(at);
+            if (at == to) break;
+            int e2 = 2 * err;
+            if (e2 >= dy) {
+                err += dy;
+                at.x += sx;
+            }
+            if (e2 <= dx) {
+                err += dx;
+                at.y += sy;
+            }
+        }
+    }
+
+    void TileRetileJob::start(TileMap *map, Vector2i focus, const Vec<Vector2i> &stale_tiles) {
+        // Chunks a running job hasn't reached yet still hold tiles stale from the rules before, so
+        // those stay stale too. Chunks it did reach only get retiled again, which changes nothing.
+        bool restarted = is_running() && this->map == map;
+        if (restarted && !filtered) {
+            start(map, focus);
+            return;
+        }
+        Vec<Vector2i> pending;
+        if (restarted) pending = this->stale_tiles;
+
+        start(map, focus);
+        filtered = true;
+        this->stale_tiles = stale_tiles;
+        for (auto tile: pending) {
+            bool found = false;
+            for (auto stale: this->stale_tiles) found = found || stale == tile;
+            if (!found) this->stale_tiles.push_back(tile);
+        }
+        if (this->stale_tiles.is_empty()) cancel();
+    }
+
+    bool TileRetileJob::has_stale_tile(Vector2i chunk_coord) const {
+        const TileStorage::Chunk *chunk = map->tiles.find_chunk(chunk_coord);
+        if (!chunk) return false;
+        auto is_stale = [&](Vector2i tile) {
+            for (auto stale: stale_tiles) {
+                if (stale == tile) return true;
+            }
+            return false;
+        };
+        if (chunk->kind == TileStorage::Chunk::Uniform) return is_stale(chunk->uniform);
+        for (int y = 0; y < TileStorage::CHUNK_SIZE; ++y) {
+            for (uint32_t bits = chunk->rows[y]; bits; bits &= bits - 1) {
+                if (is_stale(chunk->tiles[y * TileStorage::CHUNK_SIZE + __builtin_ctz(bits)])) return true;
+            }
+        }
+        return false;
+    }
+
+    void TileRetileJob::start(TileMap *map, Vector2i focus) {
+        cancel();
+        filtered = false;
+        this->map = map;
+        map->tiles.for_each_chunk([&](Vector2i chunk_coord, const TileStorage::Chunk *) {
+            chunk_coords.push_back(chunk_coord);
+        });
+
+        Vector2i focus_chunk = TileStorage::chunk_of(focus);
+        auto distance = [&](Vector2i chunk_coord) {
+            long dx = chunk_coord.x - focus_chunk.x, dy = chunk_coord.y - focus_chunk.y;
+            return dx * dx + dy * dy;
+        };
+        std::sort(chunk_coords.ptrw(), chunk_coords.ptrw() + chunk_coords.size(),
+                  [&](Vector2i a, Vector2i b) { return distance(a) < distance(b); });
+    }
+
+    bool TileRetileJob::update() {
+        JV_TILE_ZONE("TileRetileJob::update");
+        if (!map) return false;
+
+        auto start_time = std::chrono::steady_clock::now();
+        Vector2i chunk_min(INT32_MAX, INT32_MAX), chunk_max(INT32_MIN, INT32_MIN);
+        while (next < chunk_coords.size()) {
+            Vector2i chunk_coord = chunk_coords[next++];
+            // Cells without a stale tile resolve to what they already hold, so only whole chunks are skipped
+            if (filtered && !has_stale_tile(chunk_coord)) continue;
+            map->retile_chunk(chunk_coord);
+            chunk_min = Vector2i(math::MIN(chunk_min.x, chunk_coord.x), math::MIN(chunk_min.y, chunk_coord.y));
+            chunk_max = Vector2i(math::MAX(chunk_max.x, chunk_coord.x), math::MAX(chunk_max.y, chunk_coord.y));
+
+            auto spent = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time);
+            if (spent.count() >= frame_budget_us) break;
+        }
+        map->tiles.compact();
+
+        if (chunk_min.x <= chunk_max.x && !map->listeners.is_empty()) {
+            map->notify_changed(Vector2i(chunk_min.x * TileStorage::CHUNK_SIZE, chunk_min.y * TileStorage::CHUNK_SIZE),
+                                Vector2i(chunk_max.x * TileStorage::CHUNK_SIZE + TileStorage::CHUNK_MASK,
+                                         chunk_max.y * TileStorage::CHUNK_SIZE + TileStorage::CHUNK_MASK));
+        }
+        if (next < chunk_coords.size()) return true;
+        map = nullptr;
+        return false;
+    }
+
+    void TerrainTileMap::place_auto_batch(const Vec<Vector2i> &coords) {
+        for (auto coord: coords) {
+            terrain.insert(coord, {paint_terrain, 0});
+            tiles.insert(coord, {0, 0});
+        }
+        retile_batch(coords, 1, false);
+        terrain.compact();
+        tiles.compact();
+    }
+
+    void TerrainTileMap::erase_auto_batch(const Vec<Vector2i> &coords) {
+        for (auto coord: coords) {
+            terrain.erase(coord);
+            erase(coord);
+        }
+        retile_batch(coords, 1, false);
+        terrain.compact();
+        tiles.compact();
+    }
 
+    void TerrainTileMap::fill_cells(FillGrid &grid, bool erasing) {
+        TileMap::fill_cells(grid, erasing);
+
+        Vector2i end = grid.origin + Vector2i(grid.width, grid.height);
+        for (int y = grid.origin.y; y < end.y; ++y) {
+            for (int x = grid.origin.x; x < end.x; ++x) {
+                if (!(grid.at({x, y}) & FillGrid::FILLED)) continue;
+                if (erasing) terrain.erase({x, y});
+                else terrain.insert({x, y}, {paint_terrain, 0});
+            }
+        }
+        terrain.compact();
+    }
+
+    long TerrainTileMap::resolve_chunk(Vector2i chunk_coord, Vector2i *coords, Vector2i *resolved) const {
+        constexpr int SIZE = TileStorage::CHUNK_SIZE;
+        Vector2i origin(chunk_coord.x * SIZE, chunk_coord.y * SIZE);
+
+        // One bitplane per terrain over the chunk and the ring of cells around it, bit x + 1 of
+        // row y + 1 is the cell at origin + (x, y)
+        uint64_t planes[MAX_TERRAINS][SIZE + 2] = {};
+        uint8_t ids[TileStorage::CHUNK_AREA] = {};
+        terrain.for_each_in_rect(origin - Vector2i(1, 1), origin + Vector2i(SIZE, SIZE), [&](Vector2i coord, Vector2i id) {
+            if (id.x <= 0 || id.x >= MAX_TERRAINS) return;
+            int x = coord.x - origin.x, y = coord.y - origin.y;
+            planes[id.x][y + 1] |= 1ull << (x + 1);
+            if (x >= 0 && y >= 0 && x < SIZE && y < SIZE) ids[y * SIZE + x] = (uint8_t) id.x;
+        });
+
+        long count = 0;
+        constexpr uint64_t INSIDE = ((1ull << SIZE) - 1) << 1;
+        for (int y = 1; y <= SIZE; ++y) {
+            uint64_t occupied = 0;
+            for (int t = 1; t < MAX_TERRAINS; ++t) occupied |= planes[t][y];
+            occupied &= INSIDE;
+            if (!occupied) continue;
+
+            // The highest other terrain next to every cell, a whole row per terrain
+            uint8_t other[SIZE + 2] = {};
+            uint64_t undecided = occupied;
+            for (int t = MAX_TERRAINS - 1; t > 0 && undecided; --t) {
+                uint64_t row = planes[t][y];
+                uint64_t bordering = (planes[t][y + 1] | planes[t][y - 1] | row << 1 | row >> 1) & ~row & undecided;
+                for (uint64_t bits = bordering; bits; bits &= bits - 1) other[__builtin_ctzll(bits)] = (uint8_t) t;
+                undecided &= ~bordering;
+            }
+
+            for (uint64_t bits = occupied; bits; bits &= bits - 1) {
+                int x = __builtin_ctzll(bits);
+                int terrain_id = ids[(y - 1) * SIZE + x - 1];
+                const uint64_t *plane = planes[terrain_id];
+                int mask = (int) (plane[y + 1] >> x & 1) | (int) (plane[y] >> (x + 1) & 1) << 1 |
+                           (int) (plane[y - 1] >> x & 1) << 2 | (int) (plane[y] >> (x - 1) & 1) << 3;
+                coords[count] = origin + Vector2i(x - 1, y - 1);
+                resolved[count++] = resolve_tile(terrain_id, other[x], mask);
+            }
+        }
+        return count;
+    }
+
+    void TerrainTileMap::retile_all() {
+        JV_TILE_ZONE("TerrainTileMap::retile_all");
+        Vec<Vector2i> chunk_coords;
+        terrain.for_each_chunk([&](Vector2i chunk_coord, const TileStorage::Chunk *) {
+            chunk_coords.push_back(chunk_coord);
+        });
+        for (auto chunk_coord: chunk_coords) retile_chunk(chunk_coord);
+        tiles.compact();
+        if (!listeners.is_empty()) notify_changed(Vector2i(INT32_MIN, INT32_MIN), Vector2i(INT32_MAX, INT32_MAX));
+    }
+
+    MemoryStats TileMap::memory_stats() const {
+        MemoryStats stats = tiles.memory_stats();
+        stats += journal.memory_stats();
+        if (tileset) stats += tileset->memory_stats().shared_by(tileset->get_refs());
+        stats.chunk_overhead += listeners.size() * (long) sizeof(TileMapListener *);
+        return stats;
+    }
+
+    void TileMap::draw(TextureDrawProps props) {
+        JV_TILE_ZONE("TileMap::draw");
+        if (!visable || !tileset) return;
+
+        // Only walk the chunks under the camera, with a tile of margin for the rounding in world_to_coord
+        Rect2 visible = Camera2D::get_visable_rect(using_vsize);
+        Vector2i a = world_to_coord(visible.min_pos()), b = world_to_coord(visible.max_pos());
+        Vector2i from = Vector2i(math::MIN(a.x, b.x), math::MIN(a.y, b.y)) - Vector2i(1, 1);
+        Vector2i to = Vector2i(math::MAX(a.x, b.x), math::MAX(a.y, b.y)) + Vector2i(1, 1);
+        bool animated = tileset->has_animations();
+        float clock = animated ? tileset->get_clock() : 0.0f;
+        tiles.for_each_in_rect(from, to, [&](Vector2i coord, Vector2i tile) {
+            if (!is_tile_visible(coord)) return;
+            if (animated) tile = tileset->frame_of(tile, clock);
+
+            Rect2 uv;
+            if (!tileset->tile_uvs.get_if_contains(tile, uv)) {
+                JV_CORE_FATAL("Tilemap does not contain key: ", tile);
+            }
+
+            props.uv = uv;
+            draw_texture(tileset->texture, coord_to_world(coord), props);
+        });
+    }
+
+    namespace jon {
+        String save_tiles(Generator &generator, const TileStorage &tiles, std::atomic<long> *progress) {
+            String res;
             res += generator.get_indent();
             res += "tiles ";
             res += generator.push_array();
             res += "\n";
-            for (auto &tile: v->tiles) {
+            long written = 0;
+            for (auto &tile: tiles) {
                 res += generator.get_indent();
                 res += JonObject<Vector2i>::save(generator, tile.key);
                 res += "\n";
                 res += generator.get_indent();
                 res += JonObject<Vector2i>::save(generator, tile.value);
                 res += "\n";
+                if (progress && (++written & 1023) == 0) progress->store(written, std::memory_order_relaxed);
             }
+            if (progress) progress->store(written, std::memory_order_relaxed);
             res += generator.pop_array();
-            res += generator.pop_object();
             return res;
         }
-    }// namespace jon
 
-    int WangTileMap::calc_wang(Vector2i coord) {
-        int bits = 0;
+        String JonObject<TileMap *>::save(Generator &generator, TileMap *v) {
+            String res;
+            res += generator.push_object();
 
-        if (has(coord + Vector2i(0, 1))) {
-            bits |= UP;
-        }
-        if (has(coord + Vector2i(1, 0))) {
-            bits |= RIGHT;
-        }
-        if (has(coord + Vector2i(0, -1))) {
-            bits |= DOWN;
-        }
-        if (has(coord + Vector2i(-1, 0))) {
-            bits |= LEFT;
+            res += generator.save_str("size", v->tile_size);
+
+            res += save_tiles(generator, v->tiles, v->save_progress);
+            res += generator.pop_object();
+            return res;
         }
-        return bits;
-    }
+    }// namespace jon
 
     bool WangTileMap::load_wang_from_jon(jon::JonNode &object) {
         if (!load_from_jon(object)) return false;
@@ -523,36 +1762,13 @@ namespace jovial {
             res += generator.save_str("size", v->tile_size);
             res += generator.save_str("wang", v->wang_tiles);
 
-            res += generator.get_indent();
-            res += "tiles ";
-            res += generator.push_array();
-            res += "\n";
-            for (auto &tile: v->tiles) {
-                res += generator.get_indent();
-                res += JonObject<Vector2i>::save(generator, tile.key);
-                res += "\n";
-                res += generator.get_indent();
-                res += JonObject<Vector2i>::save(generator, tile.value);
-                res += "\n";
-            }
-            res += generator.pop_array();
+            res += save_tiles(generator, v->tiles, v->save_progress);
             res += generator.pop_object();
             return res;
         }
     }// namespace jon
 
 
-    int BlobTileMap::calc_blob(Vector2i coord) {
-        int bits = 0;
-        for (int direction = 1; direction <= NW; direction *= 2) {
-            if (has(coord + get_direction_vector(direction))) {
-                bits |= direction;
-            }
-        }
-        return bits;
-    }
-
-
 #endif
 
 }// namespace jovial
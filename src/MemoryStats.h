@@ -0,0 +1,57 @@
+#pragma once
+
+#include "Jovial/JovialEngine.h"
+
+#include <cstdio>
+
+namespace jovial {
+
+    // Bytes held by a map, tileset or editor, by what they are for. Memory shared between owners
+    // (interned chunks, snapshot chunks, a tileset) is split evenly between its references, so the
+    // stats of every map in a level add up to what the level really uses.
+    struct MemoryStats {
+        long cells = 0;         // Tile values and occupancy rows
+        long chunk_overhead = 0;// Chunk headers and the chunk tables
+        long uv_tables = 0;     // Tileset uvs, animations and atlas pixels
+        long rule_tables = 0;   // Auto tile tables and compiled rules
+        long undo_history = 0;
+        long cached_meshes = 0; // Geometry only rebuilt when the tiles change, like the editor overlay
+
+        [[nodiscard]] inline long total() const {
+            return cells + chunk_overhead + uv_tables + rule_tables + undo_history + cached_meshes;
+        }
+
+        inline MemoryStats &operator+=(const MemoryStats &other) {
+            cells += other.cells;
+            chunk_overhead += other.chunk_overhead;
+            uv_tables += other.uv_tables;
+            rule_tables += other.rule_tables;
+            undo_history += other.undo_history;
+            cached_meshes += other.cached_meshes;
+            return *this;
+        }
+
+        // This owner's part of memory split between that many owners
+        [[nodiscard]] inline MemoryStats shared_by(long shares) const {
+            MemoryStats part = *this;
+            if (shares <= 1) return part;
+            part.cells /= shares;
+            part.chunk_overhead /= shares;
+            part.uv_tables /= shares;
+            part.rule_tables /= shares;
+            part.undo_history /= shares;
+            part.cached_meshes /= shares;
+            return part;
+        }
+
+        [[nodiscard]] inline String to_json() const {
+            char buffer[256];
+            snprintf(buffer, sizeof(buffer),
+                     "{\"cells\": %ld, \"chunk_overhead\": %ld, \"uv_tables\": %ld, \"rule_tables\": %ld, "
+                     "\"undo_history\": %ld, \"cached_meshes\": %ld, \"total\": %ld}",
+                     cells, chunk_overhead, uv_tables, rule_tables, undo_history, cached_meshes, total());
+            return String(buffer);
+        }
+    };
+
+}// namespace jovial
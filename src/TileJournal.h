@@ -0,0 +1,273 @@
+#pragma once
+
+#include "Jovial/Core/Assert.h"
+#include "Jovial/JovialEngine.h"
+#include "TileStorage.h"
+
+namespace jovial {
+
+    inline void write_varint(Vec<uint8_t> &out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back((uint8_t) (value | 0x80));
+            value >>= 7;
+        }
+        out.push_back((uint8_t) value);
+    }
+
+    inline uint64_t read_varint(const uint8_t *&in) {
+        uint64_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            uint8_t byte = *in++;
+            value |= (uint64_t) (byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return value;
+        }
+    }
+
+    inline uint64_t zigzag(int64_t value) {
+        return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+    }
+
+    inline int64_t unzigzag(uint64_t value) {
+        return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+    }
+
+    // Undo/redo history of a tile storage. begin() takes a snapshot, which only copies chunk
+    // pointers, and end() diffs the storage against it. Chunks that were never written to are
+    // still shared with the snapshot and get skipped, so an action costs O(chunks) plus the cells
+    // of the chunks it touched, and every auto tile side effect ends up in the delta for free.
+    //
+    // A delta is a list of changed chunks, each a list of runs of changed cells (in row order)
+    // holding the old and new values run-length encoded, all as varints. Big fills mostly write
+    // one tile over empty space, so they cost well under a byte per cell. A map can have a second
+    // storage (terrain ids, ...) journaled along with its tiles, its chunks are tagged as layer 1.
+    class TileJournal {
+    public:
+        // Oldest actions are dropped once the history is over this many bytes, the newest always stays
+        long memory_budget = 8 * 1024 * 1024;
+
+        // Nests, everything until the outermost end() becomes a single undo step
+        inline void begin(TileStorage &tiles, TileStorage *layer = nullptr) {
+            if (depth++ > 0) return;
+            before = tiles.snapshot();
+            if (layer) before_layer = layer->snapshot();
+        }
+
+        // Returns false if the action ended up not changing anything
+        bool end(TileStorage &tiles, TileStorage *layer = nullptr) {
+            JV_CORE_ASSERT(depth > 0, "end called without begin");
+            if (--depth > 0) return false;
+
+            Delta delta;
+            Vector2i chunk_min(INT32_MAX, INT32_MAX), chunk_max(INT32_MIN, INT32_MIN);
+            auto diff = [&](int index, const TileStorage &storage, const TileStorage &old_storage) {
+                storage.for_each_changed_chunk(old_storage, [&](Vector2i chunk_coord, const TileStorage::Chunk *old, const TileStorage::Chunk *now) {
+                    long size = delta.data.size();
+                    encode_chunk(delta.data, index, chunk_coord, old, now);
+                    if (delta.data.size() == size) return;
+                    chunk_min = Vector2i(math::MIN(chunk_min.x, chunk_coord.x), math::MIN(chunk_min.y, chunk_coord.y));
+                    chunk_max = Vector2i(math::MAX(chunk_max.x, chunk_coord.x), math::MAX(chunk_max.y, chunk_coord.y));
+                });
+            };
+            diff(0, tiles, before);
+            if (layer) diff(1, *layer, before_layer);
+            before.clear();
+            before_layer.clear();
+            if (delta.data.is_empty()) return false;
+
+            delta.from = Vector2i(chunk_min.x * TileStorage::CHUNK_SIZE, chunk_min.y * TileStorage::CHUNK_SIZE);
+            delta.to = Vector2i(chunk_max.x * TileStorage::CHUNK_SIZE + TileStorage::CHUNK_MASK,
+                                chunk_max.y * TileStorage::CHUNK_SIZE + TileStorage::CHUNK_MASK);
+
+            // A new action forgets whatever could have been redone
+            for (long i = cursor; i < history.size(); ++i) used -= history[i].data.size();
+            history.resize(cursor);
+
+            used += delta.data.size();
+            history.push_back(delta);
+            ++cursor;
+
+            while (used > memory_budget && history.size() > 1) {
+                used -= history[0].data.size();
+                history.remove_at(0);
+                --cursor;
+            }
+            return true;
+        }
+
+        // Reverts or reapplies one action. The changed region is returned for listeners, inclusive.
+        bool undo(TileStorage &tiles, Vector2i &from, Vector2i &to, TileStorage *layer = nullptr) {
+            if (!can_undo()) return false;
+            const Delta &delta = history[--cursor];
+            apply(delta, false, tiles, layer);
+            from = delta.from;
+            to = delta.to;
+            return true;
+        }
+
+        bool redo(TileStorage &tiles, Vector2i &from, Vector2i &to, TileStorage *layer = nullptr) {
+            if (!can_redo()) return false;
+            const Delta &delta = history[cursor++];
+            apply(delta, true, tiles, layer);
+            from = delta.from;
+            to = delta.to;
+            return true;
+        }
+
+        [[nodiscard]] inline bool can_undo() const {
+            return depth == 0 && cursor > 0;
+        }
+
+        [[nodiscard]] inline bool can_redo() const {
+            return depth == 0 && cursor < history.size();
+        }
+
+        [[nodiscard]] inline bool is_recording() const {
+            return depth > 0;
+        }
+
+        [[nodiscard]] inline long memory_used() const {
+            return used;
+        }
+
+        // The deltas, plus the snapshots of the action being recorded (chunks mostly still shared with the map)
+        [[nodiscard]] inline MemoryStats memory_stats() const {
+            MemoryStats stats;
+            stats.undo_history = used + history.size() * (long) sizeof(Delta) +
+                                 before.memory_stats().total() + before_layer.memory_stats().total();
+            return stats;
+        }
+
+        inline void clear() {
+            history.clear();
+            cursor = 0;
+            used = 0;
+        }
+
+    private:
+        struct Delta {
+            Vec<uint8_t> data;
+            Vector2i from;
+            Vector2i to;
+        };
+
+        static inline bool cell(const TileStorage::Chunk *chunk, int index, Vector2i &tile) {
+            int x = index & TileStorage::CHUNK_MASK, y = index >> TileStorage::CHUNK_SHIFT;
+            if (!chunk || !chunk->has(x, y)) return false;
+            tile = chunk->get(x, y);
+            return true;
+        }
+
+        static inline bool same_cell(const TileStorage::Chunk *a, const TileStorage::Chunk *b, int index) {
+            Vector2i tile_a, tile_b;
+            bool has_a = cell(a, index, tile_a), has_b = cell(b, index, tile_b);
+            return has_a == has_b && (!has_a || tile_a == tile_b);
+        }
+
+        static void encode_chunk(Vec<uint8_t> &out, int layer, Vector2i chunk_coord, const TileStorage::Chunk *old, const TileStorage::Chunk *now) {
+            long start_size = out.size();
+            write_varint(out, layer);
+            write_varint(out, zigzag(chunk_coord.x));
+            write_varint(out, zigzag(chunk_coord.y));
+
+            bool changed = false;
+            int last_end = 0;
+            for (int i = 0; i < TileStorage::CHUNK_AREA;) {
+                if (same_cell(old, now, i)) {
+                    ++i;
+                    continue;
+                }
+                int start = i;
+                while (i < TileStorage::CHUNK_AREA && !same_cell(old, now, i)) ++i;
+
+                write_varint(out, start - last_end);
+                write_varint(out, i - start);
+                write_values(out, old, start, i - start);
+                write_values(out, now, start, i - start);
+                last_end = i;
+                changed = true;
+            }
+
+            // Written and then put back the way it was
+            if (!changed) {
+                out.resize(start_size);
+                return;
+            }
+            write_varint(out, 0);
+            write_varint(out, 0);
+        }
+
+        // (repeat, tile) pairs, with the tile as 0 for empty or zigzag(x) + 1 followed by zigzag(y)
+        static void write_values(Vec<uint8_t> &out, const TileStorage::Chunk *chunk, int start, int length) {
+            int end = start + length;
+            for (int i = start; i < end;) {
+                Vector2i tile;
+                bool present = cell(chunk, i, tile);
+                int repeat = 1;
+                while (i + repeat < end) {
+                    Vector2i next;
+                    bool next_present = cell(chunk, i + repeat, next);
+                    if (next_present != present || (present && next != tile)) break;
+                    ++repeat;
+                }
+
+                write_varint(out, repeat);
+                if (present) {
+                    write_varint(out, zigzag(tile.x) + 1);
+                    write_varint(out, zigzag(tile.y));
+                } else {
+                    write_varint(out, 0);
+                }
+                i += repeat;
+            }
+        }
+
+        static void apply(const Delta &delta, bool forward, TileStorage &tiles, TileStorage *layer) {
+            const uint8_t *in = delta.data.ptr();
+            const uint8_t *end = in + delta.data.size();
+
+            while (in < end) {
+                bool on_layer = read_varint(in) == 1;
+                JV_CORE_ASSERT(!on_layer || layer, "Undoing a layer the map doesn't have");
+                TileStorage &storage = on_layer ? *layer : tiles;
+                int chunk_x = (int) unzigzag(read_varint(in));
+                int chunk_y = (int) unzigzag(read_varint(in));
+                Vector2i origin(chunk_x * TileStorage::CHUNK_SIZE, chunk_y * TileStorage::CHUNK_SIZE);
+                int index = 0;
+                while (true) {
+                    index += (int) read_varint(in);
+                    int length = (int) read_varint(in);
+                    if (!length) break;
+
+                    // The old values come first, skip over them when redoing
+                    for (int pass = 0; pass < 2; ++pass) {
+                        bool write = (pass == 1) == forward;
+                        for (int i = index; i < index + length;) {
+                            int repeat = (int) read_varint(in);
+                            uint64_t x = read_varint(in);
+                            Vector2i tile;
+                            if (x) tile = Vector2i((int) unzigzag(x - 1), (int) unzigzag(read_varint(in)));
+
+                            for (int j = i; write && j < i + repeat; ++j) {
+                                Vector2i coord = origin + Vector2i(j & TileStorage::CHUNK_MASK, j >> TileStorage::CHUNK_SHIFT);
+                                if (x) storage.insert(coord, tile);
+                                else storage.erase(coord);
+                            }
+                            i += repeat;
+                        }
+                    }
+                    index += length;
+                }
+            }
+            tiles.compact();
+            if (layer) layer->compact();
+        }
+
+        Vec<Delta> history;
+        long cursor = 0;// history[0, cursor) can be undone, the rest redone
+        long used = 0;
+        int depth = 0;
+        TileStorage before;
+        TileStorage before_layer;
+    };
+
+}// namespace jovial
@@ -9,6 +9,9 @@
 #include "Jovial/Shapes/Rect.h"
 #include "Jovial/Shapes/ShapeDrawer.h"
 #include "JovialTileMap.h"
+#include "TileMapLoader.h"
+#include "TileMapSaver.h"
+#include "TileRegion.h"
 
 using namespace jovial;
 
@@ -17,9 +20,11 @@ public:
     TileMapEditor() = default;
 
     TileMapEditor(const Texture &texture, Font *font)
-        : tile_map(new WangTileMap({}, texture, {32, 32})),
-          editable_tile_map(new WangTileMap({}, texture, {32, 32})),
+        : tileset(Tileset::create(texture, {32, 32})),
+          tile_map(new WangTileMap({}, tileset, {32, 32})),
+          editable_tile_map(new WangTileMap({}, tileset, {32, 32})),
           font(font) {
+        saver.format = TileMapSaver::Format::Chunked;
         // String file = fs::read_entire_file(fs::Path::res() + "map.jon");
         // jon::Lexer lexer(file);
         // jon::Parser parser(lexer);
@@ -34,16 +39,21 @@ public:
     void init(const Texture &texture, Font *font, Vector2 tile_size) {
         this->font = font;
 
-        delete tile_map;
+        retile_job.cancel();
+        delete tile_map.map;
         delete editable_tile_map;
 
+        // Both maps draw from the one tileset
+        Tileset::release(tileset);
+        tileset = Tileset::create(texture, tile_size);
+
         switch (mode) {
             case TileMapMode::Wang:
-                tile_map = new WangTileMap();
+                tile_map = AnyAutoTileMap(new WangTileMap());
                 editable_tile_map = new WangTileMap();
                 break;
             case TileMapMode::Blob:
-                tile_map = new BlobTileMap();
+                tile_map = AnyAutoTileMap(new BlobTileMap());
                 editable_tile_map = new BlobTileMap();
                 break;
             default:
@@ -51,38 +61,29 @@ public:
         }
 
         tile_map->tile_size = tile_size;
-        tile_map->texture = texture;
-        tile_map->load_tiles();
+        tile_map->set_tileset(tileset);
         tile_map->using_vsize = false;
 
         editable_tile_map->tile_size = tile_size;
-        editable_tile_map->texture = texture;
-        editable_tile_map->load_tiles();
+        editable_tile_map->set_tileset(tileset);
         editable_tile_map->using_vsize = false;
 
         editable_tile_map->visable = false;
         Vector2i pos(0, 0);
-        for (auto &t: editable_tile_map->tile_uvs) {
+        for (auto &t: tileset->tile_uvs) {
             editable_tile_map->place(Vector2i{t.key.x, -t.key.y} + pos, t.key);
         }
 
-        switch (mode) {
-            case TileMapMode::Wang: {
-                for (int i = 0; i < ((WangTileMap *) tile_map)->wang_tiles.length; ++i) {
-                    auto it = ((WangTileMap *) tile_map)->wang_tiles[i];
-                    edited_tiles.insert({it.x + pos.x, pos.y - it.y}, i);
-                }
-            } break;
-            case TileMapMode::Blob: {
-                for (int i = 0; i < ((BlobTileMap *) tile_map)->blob_tiles.length; ++i) {
-                    auto it = ((BlobTileMap *) tile_map)->blob_tiles[i];
-                    edited_tiles.insert({it.x + pos.x, pos.y - it.y}, i);
-                }
-            } break;
+        for (int i = 0; i < tile_map.table_size; ++i) {
+            int mask = tile_map.mask_at(i);
+            auto it = tile_map[mask];
+            edited_tiles.insert({it.x + pos.x, pos.y - it.y}, mask);
         }
+        overlay_dirty = true;
     }
 
     void update() {
+        JV_TILE_ZONE("TileMapEditor::update");
         const char *edit_mode_str;
         switch (edit_mode) {
             case DRAWING: {
@@ -108,19 +109,34 @@ public:
         auto pos = as_ui({0, 10});// - Vector2(-offset, offset);
         draw_circle({2, pos + Vector2(5, 0)}, 16, {.color = Colors::Red});
         font->draw(pos, edit_mode_str, props);
+        draw_save_status(as_ui({0, 30}), props);
+        draw_memory_stats(as_ui({0, 50}), props);
 
+        // Saving happens on the saver's thread, this only snapshots the map. The loader tells the formats apart.
+        fs::Path save_path = fs::Path::res() + "map.jtm";
         if (Input::is_just_pressed(Actions::S) && Input::is_pressed(Actions::LeftControl)) {
-            jon::Generator generator;
-            switch (mode) {
-                case TileMapMode::Wang:
-                    generator.save("tilemap", (WangTileMap *) tile_map);
-                    break;
-                default:
-                    JV_TODO();
-            }
-            generator.generate(fs::Path::res() + "map.jon");
+            saver.save(tile_map, save_path);
+        }
+        // Ctrl+L streams the saved map back in, nearest chunks to the camera first
+        if (Input::is_just_pressed(Actions::L) && Input::is_pressed(Actions::LeftControl)) {
+            Rect2 rect = Camera2D::get_visable_rect(false);
+            stroke.finish();
+            retile_job.cancel();
+            loader.load(tile_map, save_path, tile_map->world_to_coord(rect.position() + rect.size() / 2.0f));
+        }
+        loader.update();
+
+        // Ctrl+T writes the zones traced so far, only in builds with JOVIAL_TILEMAP_TRACE
+        if (Input::is_just_pressed(Actions::T) && Input::is_pressed(Actions::LeftControl)) {
+            JV_TILE_TRACE_DUMP((fs::Path::res() + "trace.json").c_str());
         }
 
+        // Table edits retile the map a few chunks per frame, but not into the middle of an undo step
+        if (!loader.is_loading() && !tile_map->journal.is_recording()) retile_job.update();
+
+        // Don't autosave a half loaded map over the file it's coming from
+        if (!loader.is_loading()) saver.update(tile_map, save_path);
+
         if (Input::is_just_pressed(Actions::B)) {
             save_all_edits();
             edit_mode = DRAWING;
@@ -128,220 +144,329 @@ public:
             edit_mode = EDITING;
         }
 
-        if (edit_mode == DRAWING) {
+        // Edits made while chunks are still streaming in would end up undoing the load
+        if (loader.is_loading()) {
+            stroke.finish();
+        } else if (edit_mode == DRAWING) {
             draw();
         } else if (edit_mode == EDITING) {
+            stroke.finish();
             edit();
         }
 
-        tile_map->draw();
-
         Rect2 rect = Camera2D::get_visable_rect(false);
         editable_tile_map->position = rect.position() + rect.size() / 2.0f;
+        tile_map->draw();
         editable_tile_map->draw({.z_index = 5});
     }
 
-    void draw() const {
-        if (Input::is_pressed(Actions::LeftMouseButton)) {
-            // tile_map.place(tile_map.world_to_coord(Input::get_mouse_position()), tile);
-            tile_map->place_auto(tile_map->world_to_coord(Input::get_mouse_position() / Camera2D::get_current_zoom()));
-        } else if (Input::is_pressed(Actions::RightMouseButton)) {
-            tile_map->erase_auto(tile_map->world_to_coord(Input::get_mouse_position() / Camera2D::get_current_zoom()));
+    // Everything the editor holds: both maps, the shared tileset, the edit tables, the overlay and the clipboard
+    [[nodiscard]] MemoryStats memory_stats() const {
+        MemoryStats stats;
+        if (tile_map.map) stats += tile_map->memory_stats();
+        if (editable_tile_map) stats += editable_tile_map->memory_stats();
+        // The editor's own reference is a share of the tileset too
+        if (tileset) stats += tileset->memory_stats().shared_by(tileset->get_refs());
+        stats.rule_tables += edited_tiles.memory_usage();
+        stats.cached_meshes += (long) sizeof(overlay_rects);
+        stats += clipboard.memory_stats();
+        return stats;
+    }
+
+    // Walking every chunk each frame would show up in the frame time, so this refreshes twice a second
+    void draw_memory_stats(Vector2 pos, TextDrawProps props) {
+        auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<float>(now - memory_stats_time).count() > 0.5f) {
+            memory_stats_time = now;
+            MemoryStats stats = memory_stats();
+            auto kb = [](long bytes) { return (int) ((bytes + 1023) / 1024); };
+            snprintf(memory_status, sizeof(memory_status), "Memory %d KB: cells %d, chunks %d, uvs %d, rules %d, undo %d, meshes %d",
+                     kb(stats.total()), kb(stats.cells), kb(stats.chunk_overhead), kb(stats.uv_tables),
+                     kb(stats.rule_tables), kb(stats.undo_history), kb(stats.cached_meshes));
         }
+        font->draw(pos, memory_status, props);
     }
 
-    void edit() {
-        draw_rect2(Camera2D::get_visable_rect(false), {.color = Color(0, 0, 0, 126), .z_index = 1});
-        auto color = Color(55, 55, 255, 170);
-        ShapeDrawProps props{.color = color, .z_index = 100};
+    void draw_save_status(Vector2 pos, TextDrawProps props) {
+        char status[64];
+        if (loader.is_loading()) {
+            snprintf(status, sizeof(status), "Loading %d%%", (int) (loader.get_progress() * 100.0f));
+            font->draw(pos, status, props);
+            return;
+        }
+        if (retile_job.is_running()) {
+            snprintf(status, sizeof(status), "Retiling %d%%", (int) (retile_job.get_progress() * 100.0f));
+            font->draw(pos, status, props);
+            return;
+        }
+        switch (saver.get_status()) {
+            case TileMapSaver::Status::Idle:
+                return;
+            case TileMapSaver::Status::Serializing:
+                snprintf(status, sizeof(status), "Saving %d%%", (int) (saver.get_progress() * 100.0f));
+                break;
+            case TileMapSaver::Status::Writing:
+                snprintf(status, sizeof(status), "Writing");
+                break;
+            case TileMapSaver::Status::Saved:
+                snprintf(status, sizeof(status), "Saved");
+                break;
+            case TileMapSaver::Status::Failed:
+                props.color = Colors::Red;
+                snprintf(status, sizeof(status), "Save failed");
+                break;
+        }
+        font->draw(pos, status, props);
+    }
 
-        for (auto &t: edited_tiles) {
-            Vector2 pos = editable_tile_map->coord_to_world(t.key);
-            int bits = t.value;
+    void draw() {
+        Vector2i coord = tile_map->world_to_coord(Input::get_mouse_position() / Camera2D::get_current_zoom());
 
-            auto rects = get_edit_squares(pos, bits);
+        if (Input::is_just_pressed(Actions::Left_bracket)) {
+            stroke.brush_radius = math::MAX(stroke.brush_radius - 1, 0);
+        } else if (Input::is_just_pressed(Actions::Right_bracket)) {
+            stroke.brush_radius = math::MIN(stroke.brush_radius + 1, MAX_BRUSH_RADIUS);
+        }
+        if (Input::is_just_pressed(Actions::Tab)) {
+            stroke.brush_shape = stroke.brush_shape == BrushShape::Square ? BrushShape::Circle : BrushShape::Square;
+        }
+        if (Input::is_just_pressed(Actions::F)) {
+            Rect2 rect = Camera2D::get_visable_rect(false);
+            tile_map->begin_action();
+            tile_map->flood_fill_auto(coord, tile_map->world_to_coord(rect.min_pos()), tile_map->world_to_coord(rect.max_pos()));
+            tile_map->end_action();
+        }
 
-            if (bits & WangTileMap::UP) {
-                draw_rect2(rects[0], props);
+        // Ctrl+Z undoes, Ctrl+Shift+Z and Ctrl+Y redo
+        if (Input::is_pressed(Actions::LeftControl) && !stroke.is_active() && !is_dragging_rect) {
+            if (Input::is_just_pressed(Actions::Z)) {
+                if (Input::is_pressed(Actions::LeftShift)) tile_map->redo();
+                else tile_map->undo();
+                return;
             }
-            if (bits & WangTileMap::RIGHT) {
-                draw_rect2(rects[1], props);
+            if (Input::is_just_pressed(Actions::Y)) {
+                tile_map->redo();
+                return;
             }
-            if (bits & WangTileMap::DOWN) {
-                draw_rect2(rects[2], props);
+
+            // Ctrl+C and Ctrl+X copy or cut the selection, Ctrl+V pastes it with its top left corner
+            // at the mouse and Ctrl+Shift+V stamps it, leaving the map under its empty cells
+            if (Input::is_just_pressed(Actions::C) && has_selection) {
+                clipboard = TileRegion::copy(tile_map.map, selection_start, selection_end);
+                return;
             }
-            if (bits & WangTileMap::LEFT) {
-                draw_rect2(rects[3], props);
+            if (Input::is_just_pressed(Actions::X) && has_selection) {
+                tile_map->begin_action();
+                clipboard = TileRegion::cut(tile_map.map, selection_start, selection_end);
+                tile_map->end_action();
+                return;
             }
-            draw_rect2(rects[4], props);
-            if (mode == TileMapMode::Blob) {
-                if (bits & BlobTileMap::NE) {
-                    draw_rect2(rects[5], props);
-                }
-                if (bits & BlobTileMap::SE) {
-                    draw_rect2(rects[6], props);
-                }
-                if (bits & BlobTileMap::SW) {
-                    draw_rect2(rects[7], props);
-                }
-                if (bits & BlobTileMap::NW) {
-                    draw_rect2(rects[8], props);
-                }
+            if (Input::is_just_pressed(Actions::V) && !clipboard.is_empty()) {
+                tile_map->begin_action();
+                if (Input::is_pressed(Actions::LeftShift)) clipboard.stamp(tile_map.map, coord);
+                else clipboard.paste(tile_map.map, coord);
+                tile_map->end_action();
+                return;
             }
         }
+        if (Input::is_just_pressed(Actions::R) && !clipboard.is_empty()) {
+            clipboard = clipboard.rotated();
+        } else if (Input::is_just_pressed(Actions::H) && !clipboard.is_empty()) {
+            clipboard = clipboard.flipped(true);
+        }
+        if (Input::is_just_pressed(Actions::Escape)) has_selection = false;
+
+        bool placing = Input::is_pressed(Actions::LeftMouseButton);
+        bool erasing = Input::is_pressed(Actions::RightMouseButton);
+
+        if (has_selection) {
+            Vector2i min(math::MIN(selection_start.x, selection_end.x), math::MIN(selection_start.y, selection_end.y));
+            Vector2i max(math::MAX(selection_start.x, selection_end.x), math::MAX(selection_start.y, selection_end.y));
+            Rect2 rect(tile_map->coord_to_world(min), tile_map->coord_to_world(max + Vector2i(1, 1)));
+            draw_rect2(rect, {.color = Color(255, 255, 255, 60), .z_index = 2});
+        }
 
-        Vector2i coord = editable_tile_map->world_to_coord(Input::get_mouse_position() / Camera2D::get_current_zoom());
+        // Alt + drag selects the rect between the press and the release
+        if (is_selecting) {
+            selection_end = coord;
+            if (!placing) is_selecting = false;
+            return;
+        }
+        if (placing && !stroke.is_active() && Input::is_pressed(Actions::LeftAlt)) {
+            is_selecting = true;
+            has_selection = true;
+            selection_start = selection_end = coord;
+            return;
+        }
+
+        // Shift + drag fills or erases the rect between the press and the release
+        if (is_dragging_rect) {
+            if (!placing && !erasing) {
+                tile_map->begin_action();
+                if (rect_erasing) tile_map->erase_rect_auto(rect_start, coord);
+                else tile_map->fill_rect_auto(rect_start, coord);
+                tile_map->end_action();
+                is_dragging_rect = false;
+            }
+            return;
+        }
+        if ((placing || erasing) && !stroke.is_active() && Input::is_pressed(Actions::LeftShift)) {
+            is_dragging_rect = true;
+            rect_erasing = !placing;
+            rect_start = coord;
+            return;
+        }
+
+        if (placing) {
+            stroke.paint(tile_map.map, coord, false);
+        } else if (erasing) {
+            stroke.paint(tile_map.map, coord, true);
+        } else {
+            stroke.finish();
+        }
+    }
+
+    void edit() {
+        if (overlay_dirty) rebuild_overlay();
+        overlay_origin = editable_tile_map->position;
+        draw_rect2(Camera2D::get_visable_rect(false), {.color = Color(0, 0, 0, 126), .z_index = 1});
+
+        rendering::ZOrderer::push_cmd(rendering::ZOrderer::Cmd(100, this, draw_overlay));
+
+        Vector2 mouse = Input::get_mouse_position() / Camera2D::get_current_zoom();
+        Vector2i coord = editable_tile_map->world_to_coord(mouse);
 
         if (editable_tile_map->has(coord)) {
             Vector2 pos = editable_tile_map->coord_to_world(coord);
 
             int bits = 0;
-            edited_tiles.get_if_contains(coord, bits);
+            bool was_edited = edited_tiles.get_if_contains(coord, bits);
 
-            auto rects = get_edit_squares(pos, bits);
-            bool is_single_tile = false;
+            auto rects = get_edit_squares(pos);
             if (Input::is_pressed(Actions::LeftMouseButton)) {
-                if (rects[0].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom())) {
-                    bits |= WangTileMap::UP;
-                }
-                if (rects[1].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom())) {
-                    bits |= WangTileMap::RIGHT;
-                }
-                if (rects[2].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom())) {
-                    bits |= WangTileMap::DOWN;
-                }
-                if (rects[3].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom())) {
-                    bits |= WangTileMap::LEFT;
-                }
-                if (rects[4].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom())) {
-                    is_single_tile = true;
-                }
-                if (mode == TileMapMode::Blob) {
-                    if (rects[5].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom())) {
-                        bits |= BlobTileMap::NE;
-                    }
-                    if (rects[6].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom())) {
-                        bits |= BlobTileMap::SE;
-                    }
-                    if (rects[7].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom())) {
-                        bits |= BlobTileMap::SW;
-                    }
-                    if (rects[8].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom())) {
-                        bits |= BlobTileMap::NW;
-                    }
+                int old_bits = bits;
+                bool is_single_tile = false;
+                for (int i = 0; i < edit_square_count(); ++i) {
+                    if (!rects[i].overlaps(mouse)) continue;
+                    if (i == CENTER_SQUARE) is_single_tile = true;
+                    else bits |= EDIT_SQUARE_BITS[i];
                 }
+                // Blob corners only count next to both of their edges
+                bits = tile_map.canonical_mask(bits);
 
                 if (bits || is_single_tile) {
-                    edited_tiles.insert(coord, bits);
-
-                    switch (mode) {
-                        case TileMapMode::Wang:
-                            ((WangTileMap *) tile_map)->wang_tiles[bits] = editable_tile_map->tiles.get(coord);
-                            break;
-                        case TileMapMode::Blob:
-                            ((BlobTileMap *) tile_map)->blob_tiles[bits] = editable_tile_map->tiles.get(coord);
-                            break;
+                    if (!was_edited || bits != old_bits) {
+                        edited_tiles.insert(coord, bits);
+                        overlay_dirty = true;
                     }
+
+                    set_table_entry(bits, editable_tile_map->tiles.get(coord));
                 }
             } else if (Input::is_pressed(Actions::RightMouseButton)) {
-                erase_edit(coord, rects, bits);
+                erase_edit(coord, rects, bits, mouse);
             }
         }
     }
 
     void save_all_edits() {
         for (auto &t: edited_tiles) {
-            switch (mode) {
-                case TileMapMode::Wang:
-                    ((WangTileMap *) tile_map)->wang_tiles[t.value] = editable_tile_map->tiles.get(t.key);
-                    break;
-                case TileMapMode::Blob:
-                    ((BlobTileMap *) tile_map)->blob_tiles[t.value] = editable_tile_map->tiles.get(t.key);
-                    break;
-            }
+            set_table_entry(t.value, editable_tile_map->tiles.get(t.key));
         }
     }
 
-    void erase_edit(Vector2i coord, Vec<Rect2> &rects, int bits) {
-        if (rects[0].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom()) && bits & WangTileMap::UP) {
-            bits ^= WangTileMap::UP;
-        }
-        if (rects[1].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom()) && bits & WangTileMap::RIGHT) {
-            bits ^= WangTileMap::RIGHT;
-        }
-        if (rects[2].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom()) && bits & WangTileMap::DOWN) {
-            bits ^= WangTileMap::DOWN;
-        }
-        if (rects[3].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom()) && bits & WangTileMap::LEFT) {
-            bits ^= WangTileMap::LEFT;
-        }
-        if (mode == TileMapMode::Blob) {
-            if (rects[5].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom()) && bits & BlobTileMap::NE) {
-                bits ^= BlobTileMap::NE;
-            }
-            if (rects[6].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom()) && bits & BlobTileMap::SE) {
-                bits ^= BlobTileMap::SE;
-            }
-            if (rects[7].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom()) && bits & BlobTileMap::SW) {
-                bits ^= BlobTileMap::SW;
-            }
-            if (rects[8].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom()) && bits & BlobTileMap::NW) {
-                bits ^= BlobTileMap::NW;
+    void set_table_entry(int mask, Vector2i tile) {
+        if (tile_map[mask] == tile) return;
+        tile_map[mask] = tile;
+        // Undo steps from before would bring back tiles resolved with the old table, and the retile
+        // doesn't write to the journal, so they would stay that way
+        tile_map->journal.clear();
+        Rect2 rect = Camera2D::get_visable_rect(false);
+        retile_job.start(tile_map.map, tile_map->world_to_coord(rect.position() + rect.size() / 2.0f));
+    }
+
+    void erase_edit(Vector2i coord, const Array<Rect2, 9> &rects, int bits, Vector2 mouse) {
+        int old_bits = bits;
+        for (int i = 0; i < edit_square_count(); ++i) {
+            if (i != CENTER_SQUARE && rects[i].overlaps(mouse) && bits & EDIT_SQUARE_BITS[i]) {
+                bits ^= EDIT_SQUARE_BITS[i];
             }
         }
-        if (rects[4].overlaps(Input::get_mouse_position() / Camera2D::get_current_zoom())) {
-            edited_tiles.erase(coord);
-        } else if (bits) {
+        bits = tile_map.canonical_mask(bits);
+        if (rects[CENTER_SQUARE].overlaps(mouse)) {
+            if (edited_tiles.has(coord)) {
+                edited_tiles.erase(coord);
+                overlay_dirty = true;
+            }
+        } else if (bits && bits != old_bits) {
             edited_tiles.insert(coord, bits);
+            overlay_dirty = true;
         }
 
         save_all_edits();
     }
 
-    [[nodiscard]] Vec<Rect2> get_edit_squares(Vector2 pos, int bits) const {
-        auto tile_size = editable_tile_map->tile_size;
-        Vec<Rect2> res = {
-                {pos + Vector2(tile_size.x / 3, 2 * tile_size.y / 3),
-                 pos + Vector2(2 * tile_size.x / 3, tile_size.y)},
-
-                {pos + Vector2(2 * tile_size.x / 3, tile_size.y / 3),
-                 pos + Vector2(tile_size.x, 2 * tile_size.y / 3)},
-
-                {pos + Vector2(tile_size.x / 3, 0.0f),
-                 pos + Vector2(2 * tile_size.x / 3, tile_size.y / 3)},
-
-                {pos + Vector2(0.0f, tile_size.y / 3),
-                 pos + Vector2(tile_size.x / 3, 2 * tile_size.y / 3)},
+    [[nodiscard]] inline int edit_square_count() const {
+        return mode == TileMapMode::Blob ? 9 : 5;
+    }
 
-                {pos + Vector2(tile_size.x / 3, tile_size.y / 3),
-                 pos + Vector2(2 * tile_size.x / 3, 2 * tile_size.y / 3)},
+    // The squares of one tile, in the order of EDIT_SQUARE_BITS. Only the first edit_square_count() are used.
+    [[nodiscard]] Array<Rect2, 9> get_edit_squares(Vector2 pos) const {
+        auto tile_size = editable_tile_map->tile_size;
+        float x1 = tile_size.x / 3, x2 = 2 * tile_size.x / 3;
+        float y1 = tile_size.y / 3, y2 = 2 * tile_size.y / 3;
+        return {
+                Rect2(pos + Vector2(x1, y2), pos + Vector2(x2, tile_size.y)),
+                Rect2(pos + Vector2(x2, y1), pos + Vector2(tile_size.x, y2)),
+                Rect2(pos + Vector2(x1, 0.0f), pos + Vector2(x2, y1)),
+                Rect2(pos + Vector2(0.0f, y1), pos + Vector2(x1, y2)),
+                Rect2(pos + Vector2(x1, y1), pos + Vector2(x2, y2)),
+                Rect2(pos + Vector2(x2, y2), pos + Vector2(tile_size.x, tile_size.y)),
+                Rect2(pos + Vector2(x2, 0.0f), pos + Vector2(tile_size.x, y1)),
+                Rect2(pos + Vector2(0.0f, 0.0f), pos + Vector2(x1, y1)),
+                Rect2(pos + Vector2(0.0f, y2), pos + Vector2(x1, tile_size.y)),
         };
+    }
 
-        if (mode == TileMapMode::Blob) {
-            res.push_back({pos + Vector2(2 * tile_size.x / 3, 2 * tile_size.y / 3),
-                           pos + Vector2(tile_size.x, tile_size.y)});
-
-            res.push_back({pos + Vector2(2 * tile_size.x / 3, 0.0f),
-                           pos + Vector2(tile_size.x, tile_size.y / 3)});
-
-            res.push_back({pos + Vector2(0.0f, 0.0f),
-                           pos + Vector2(tile_size.x / 3, tile_size.y / 3)});
-
-            res.push_back({pos + Vector2(0.0f, 2 * tile_size.y / 3),
-                           pos + Vector2(tile_size.x / 3, tile_size.y)});
+    // Lays out the blue squares of every edited tile relative to the map origin, so the cache
+    // survives the editable map following the camera.
+    void rebuild_overlay() {
+        overlay_dirty = false;
+        overlay_rect_count = 0;
 
-            // static const int NE = 0b00010000;
-            // static const int SE = 0b00100000;
-            // static const int SW = 0b01000000;
-            // static const int NW = 0b10000000;
+        for (auto &t: edited_tiles) {
+            auto rects = get_edit_squares((Vector2) t.key * editable_tile_map->tile_size);
+            for (int i = 0; i < edit_square_count(); ++i) {
+                if (i != CENTER_SQUARE && !(t.value & EDIT_SQUARE_BITS[i])) continue;
+                if (overlay_rect_count == MAX_OVERLAY_RECTS) {
+                    JV_CORE_WARN("Too many edited tiles for the overlay, only drawing ", MAX_OVERLAY_RECTS, " squares");
+                    return;
+                }
+                overlay_rects[overlay_rect_count++] = rects[i];
+            }
         }
+    }
 
-        return res;
+    static void draw_overlay(void *data) {
+        auto *editor = (TileMapEditor *) data;
+        Vector2 origin = editor->overlay_origin;
+
+        rendering::begin(rendering::RenderingModes::Quads);
+        rendering::color(Color(55, 55, 255, 170));
+        for (int i = 0; i < editor->overlay_rect_count; ++i) {
+            Vector2 min = editor->overlay_rects[i].min_pos() + origin;
+            Vector2 max = editor->overlay_rects[i].max_pos() + origin;
+            rendering::vertex2(min);
+            rendering::vertex2({max.x, min.y});
+            rendering::vertex2(max);
+            rendering::vertex2({min.x, max.y});
+        }
+        rendering::end();
     }
 
     ~TileMapEditor() {
-        delete tile_map;
+        delete tile_map.map;
         delete editable_tile_map;
+        Tileset::release(tileset);
     }
 
     enum {
@@ -350,13 +475,41 @@ public:
     } edit_mode = DRAWING;
 
     Font *font{};
-    HashMap<Vector2i, int> edited_tiles;// Table of the edited keys (the blue boxes that are used for wanging)
+    Vector2iMap<int> edited_tiles;// Table of the edited keys (the blue boxes that are used for wanging)
+
+    static constexpr int CENTER_SQUARE = 4;
+    static constexpr int EDIT_SQUARE_BITS[9] = {
+            WangTileMap::UP, WangTileMap::RIGHT, WangTileMap::DOWN, WangTileMap::LEFT, 0,
+            BlobTileMap::NE, BlobTileMap::SE, BlobTileMap::SW, BlobTileMap::NW};
+
+    // Overlay geometry, rebuilt only when edited_tiles changes
+    static constexpr int MAX_OVERLAY_RECTS = 1024 * 9;
+    Rect2 overlay_rects[MAX_OVERLAY_RECTS];
+    int overlay_rect_count = 0;
+    bool overlay_dirty = true;
+    Vector2 overlay_origin;
 
     enum class TileMapMode {
         Wang,
         Blob,
     };
     TileMapMode mode = TileMapEditor::TileMapMode::Wang;
+    Tileset *tileset = nullptr;          // Owned here, every map of the editor holds a reference
     TileMap *editable_tile_map = nullptr;// The tile map that is shown in edit mode that allows you to change the edited_tiles
-    TileMap *tile_map = nullptr;         // The displayed tile map that you paint in drawing mode
+    AnyAutoTileMap tile_map;             // The displayed tile map that you paint in drawing mode
+    TileStroke stroke;
+    TileMapSaver saver;
+    TileMapLoader loader;
+    TileRetileJob retile_job;
+    static constexpr int MAX_BRUSH_RADIUS = 32;
+    bool is_dragging_rect = false;
+    bool rect_erasing = false;
+    Vector2i rect_start;
+    bool is_selecting = false;
+    bool has_selection = false;
+    Vector2i selection_start;
+    Vector2i selection_end;
+    TileRegion clipboard;
+    char memory_status[128] = "";
+    std::chrono::steady_clock::time_point memory_stats_time;
 };
@@ -0,0 +1,431 @@
+#pragma once
+
+#include "Jovial/Core/Logger.h"
+#include "Jovial/JovialEngine.h"
+#include "TileJournal.h"
+#include "TileStorage.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+
+namespace jovial {
+
+    // Small LZ77 block codec in the style of LZ4: a sequence is a token byte (literal count and match
+    // length, 4 bits each, 15 meaning more length bytes follow), the literals and a 16 bit match offset.
+    // The last sequence only has literals. Matches are found through a single hash of the next 4 bytes.
+    namespace lz {
+        static constexpr int HASH_BITS = 12;
+        static constexpr int MIN_MATCH = 4;
+        static constexpr long MAX_OFFSET = 65535;
+
+        inline uint32_t read32(const uint8_t *p) {
+            uint32_t v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        inline void write_length(Vec<uint8_t> &out, long length) {
+            for (; length >= 255; length -= 255) out.push_back(255);
+            out.push_back((uint8_t) length);
+        }
+
+        inline void write_sequence(Vec<uint8_t> &out, const uint8_t *literals, long literal_count, long offset, long match_length) {
+            long match_code = offset ? match_length - MIN_MATCH : 0;
+            out.push_back((uint8_t) (math::MIN(literal_count, 15l) << 4 | math::MIN(match_code, 15l)));
+            if (literal_count >= 15) write_length(out, literal_count - 15);
+
+            long start = out.size();
+            out.resize(start + literal_count);
+            memcpy(out.ptrw() + start, literals, literal_count);
+
+            if (!offset) return;
+            out.push_back((uint8_t) offset);
+            out.push_back((uint8_t) (offset >> 8));
+            if (match_code >= 15) write_length(out, match_code - 15);
+        }
+
+        // Appends the compressed form of src to out
+        inline void compress(const uint8_t *src, long size, Vec<uint8_t> &out) {
+            int32_t table[1 << HASH_BITS];
+            memset(table, -1, sizeof(table));
+
+            long anchor = 0, pos = 0;
+            while (pos + MIN_MATCH <= size) {
+                uint32_t sequence = read32(src + pos);
+                uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+                long candidate = table[hash];
+                table[hash] = (int32_t) pos;
+
+                if (candidate < 0 || pos - candidate > MAX_OFFSET || read32(src + candidate) != sequence) {
+                    ++pos;
+                    continue;
+                }
+
+                long length = MIN_MATCH;
+                while (pos + length < size && src[candidate + length] == src[pos + length]) ++length;
+                write_sequence(out, src + anchor, pos - anchor, pos - candidate, length);
+                pos += length;
+                anchor = pos;
+            }
+            write_sequence(out, src + anchor, size - anchor, 0, 0);
+        }
+
+        // Returns false if src is corrupt or doesn't decompress to exactly size bytes
+        inline bool decompress(const uint8_t *src, long src_size, uint8_t *dst, long size) {
+            const uint8_t *in = src, *in_end = src + src_size;
+            long out = 0;
+
+            auto read_length = [&](long length) {
+                if (length < 15) return length;
+                while (in < in_end) {
+                    uint8_t byte = *in++;
+                    length += byte;
+                    if (byte != 255) break;
+                }
+                return length;
+            };
+
+            while (in < in_end) {
+                uint8_t token = *in++;
+                long literal_count = read_length(token >> 4);
+                if (literal_count > in_end - in || literal_count > size - out) return false;
+                memcpy(dst + out, in, literal_count);
+                in += literal_count;
+                out += literal_count;
+                if (in == in_end) break;
+
+                if (in_end - in < 2) return false;
+                long offset = in[0] | in[1] << 8;
+                in += 2;
+                long length = read_length(token & 15) + MIN_MATCH;
+                if (!offset || offset > out || length > size - out) return false;
+
+                // Byte at a time, the match can overlap what it's writing
+                for (long i = 0; i < length; ++i, ++out) dst[out] = dst[out - offset];
+            }
+            return out == size;
+        }
+    }// namespace lz
+
+    // Chunked binary tile map file. Every chunk is encoded and compressed on its own, so saving and
+    // loading both go wide over threads, and the chunk table lets a reader pick out single chunks.
+    //
+    //   "JTMC" u32 version
+    //   f32 tile size x, y
+    //   u32 table size, table size * (i32 x, i32 y)   (auto tile table, wang/blob tiles)
+    //   u32 chunk count, chunk count * ChunkEntry
+    //   the compressed chunks, back to back
+    //
+    // A chunk decompresses to a kind byte, then either the one tile of a uniform chunk or the 32 rows of
+    // occupancy bits followed by the occupied tiles in row order. Tiles are zigzag varints of the delta
+    // to the previous tile, so runs of the same tile become runs of zero bytes for the LZ pass.
+    // Integers and floats are stored little endian whatever the host is, put() and get() swap the bytes.
+    class TileMapFile {
+    public:
+        static constexpr uint32_t VERSION = 1;
+
+        struct Header {
+            Vector2 tile_size;
+            Vec<Vector2i> table;
+        };
+
+        struct ChunkEntry {
+            Vector2i coord;
+            uint64_t offset;
+            uint32_t compressed_size;
+            uint32_t raw_size;
+        };
+
+        // Tells a chunked file from a jon one
+        static bool is_chunked(const uint8_t *data, long size) {
+            return size >= 4 && memcmp(data, "JTMC", 4) == 0;
+        }
+
+        static void encode_chunk(const TileStorage::Chunk &chunk, Vec<uint8_t> &out);
+        static TileStorage::Chunk *decode_chunk(const uint8_t *data, long size);
+
+        // Encodes and compresses the chunks over threads (0 = every core) and writes them in order.
+        // progress counts the encoded chunks.
+        static bool write(const fs::Path &path, const Header &header, const TileStorage &tiles,
+                          int threads = 0, std::atomic<long> *progress = nullptr);
+
+        // Parses everything up to the chunk data, data has to stay around for decode_entry
+        static bool read_header(const uint8_t *data, long size, Header &header, Vec<ChunkEntry> &entries);
+        static TileStorage::Chunk *decode_entry(const uint8_t *data, long size, const ChunkEntry &entry);
+
+        // Loads only the chunks overlapping the inclusive rect, seeking past the rest
+        static bool read_region(const fs::Path &path, Vector2i from, Vector2i to, Header &header, TileStorage &tiles);
+
+    private:
+        // Turns native bytes into little endian ones and back, nothing to do on little endian hosts
+        static inline void swap_little(uint8_t *bytes, long size) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            std::reverse(bytes, bytes + size);
+#else
+            (void) bytes;
+            (void) size;
+#endif
+        }
+
+        template<typename T>
+        static inline void put(Vec<uint8_t> &out, T value) {
+            long at = out.size();
+            out.resize(at + (long) sizeof(T));
+            memcpy(out.ptrw() + at, &value, sizeof(T));
+            swap_little(out.ptrw() + at, sizeof(T));
+        }
+
+        template<typename T>
+        static inline bool get(const uint8_t *&in, const uint8_t *end, T &value) {
+            if (end - in < (long) sizeof(T)) return false;
+            uint8_t bytes[sizeof(T)];
+            memcpy(bytes, in, sizeof(T));
+            swap_little(bytes, sizeof(T));
+            memcpy(&value, bytes, sizeof(T));
+            in += sizeof(T);
+            return true;
+        }
+
+        // Bounds checked read_varint, chunk data can come from a damaged file
+        static inline bool get_varint(const uint8_t *&in, const uint8_t *end, int64_t &value) {
+            uint64_t raw = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                if (in >= end) return false;
+                uint8_t byte = *in++;
+                raw |= (uint64_t) (byte & 0x7F) << shift;
+                if (!(byte & 0x80)) {
+                    value = unzigzag(raw);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        static constexpr long ENTRY_SIZE = 4 + 4 + 8 + 4 + 4;
+        // Kind, rows and two 10 byte varints per tile, anything bigger is a damaged table
+        static constexpr uint32_t MAX_RAW_SIZE = 1 + 4 * TileStorage::CHUNK_SIZE + 20 * TileStorage::CHUNK_AREA;
+    };
+
+#ifdef JOVIAL_TILEMAP_IMPLEMENTATION
+
+    void TileMapFile::encode_chunk(const TileStorage::Chunk &chunk, Vec<uint8_t> &out) {
+        out.push_back((uint8_t) chunk.kind);
+        if (chunk.kind == TileStorage::Chunk::Uniform) {
+            write_varint(out, zigzag(chunk.uniform.x));
+            write_varint(out, zigzag(chunk.uniform.y));
+            return;
+        }
+
+        for (auto row: chunk.rows) put(out, row);
+        Vector2i previous;
+        for (int y = 0; y < TileStorage::CHUNK_SIZE; ++y) {
+            for (uint32_t bits = chunk.rows[y]; bits; bits &= bits - 1) {
+                Vector2i tile = chunk.get(__builtin_ctz(bits), y);
+                write_varint(out, zigzag((int64_t) tile.x - previous.x));
+                write_varint(out, zigzag((int64_t) tile.y - previous.y));
+                previous = tile;
+            }
+        }
+    }
+
+    TileStorage::Chunk *TileMapFile::decode_chunk(const uint8_t *data, long size) {
+        const uint8_t *in = data, *end = data + size;
+        uint8_t kind;
+        if (!get(in, end, kind)) return nullptr;
+
+        if (kind == TileStorage::Chunk::Uniform) {
+            int64_t x, y;
+            if (!get_varint(in, end, x) || !get_varint(in, end, y)) return nullptr;
+            auto *chunk = new TileStorage::Chunk();
+            chunk->make_uniform({(int) x, (int) y});
+            return chunk;
+        }
+        if (kind != TileStorage::Chunk::Dense) return nullptr;
+
+        auto *chunk = new TileStorage::Chunk();
+
+        for (auto &row: chunk->rows) {
+            if (!get(in, end, row)) {
+                delete chunk;
+                return nullptr;
+            }
+        }
+        Vector2i previous;
+        for (int y = 0; y < TileStorage::CHUNK_SIZE; ++y) {
+            for (uint32_t bits = chunk->rows[y]; bits; bits &= bits - 1) {
+                int64_t dx, dy;
+                if (!get_varint(in, end, dx) || !get_varint(in, end, dy)) {
+                    delete chunk;
+                    return nullptr;
+                }
+                previous.x += (int) dx;
+                previous.y += (int) dy;
+                chunk->tiles[y * TileStorage::CHUNK_SIZE + __builtin_ctz(bits)] = previous;
+                ++chunk->count;
+            }
+        }
+        return chunk;
+    }
+
+    bool TileMapFile::write(const fs::Path &path, const Header &header, const TileStorage &tiles, int threads, std::atomic<long> *progress) {
+        JV_TILE_ZONE("TileMapFile::write");
+        Vec<Vector2i> coords;
+        Vec<const TileStorage::Chunk *> chunks;
+        tiles.for_each_chunk([&](Vector2i coord, const TileStorage::Chunk *chunk) {
+            coords.push_back(coord);
+            chunks.push_back(chunk);
+        });
+
+        // Every chunk is independent, so threads just take the next one
+        Vec<Vec<uint8_t>> compressed;
+        Vec<uint32_t> raw_sizes;
+        compressed.resize(chunks.size());
+        raw_sizes.resize(chunks.size());
+        std::atomic<long> next{0};
+        auto encode = [&]() {
+            JV_TILE_ZONE("TileMapFile encode");
+            Vec<uint8_t> raw;
+            for (long i = next.fetch_add(1); i < chunks.size(); i = next.fetch_add(1)) {
+                raw.clear();
+                encode_chunk(*chunks[i], raw);
+                raw_sizes[i] = (uint32_t) raw.size();
+                lz::compress(raw.ptr(), raw.size(), compressed[i]);
+                if (progress) progress->fetch_add(1, std::memory_order_relaxed);
+            }
+        };
+
+        if (threads <= 0) threads = (int) math::MAX(std::thread::hardware_concurrency(), 1u);
+        threads = (int) math::CLAMP((long) threads, 1l, math::MAX(chunks.size(), 1l));
+        Vec<std::thread *> workers;
+        for (int t = 1; t < threads; ++t) workers.push_back(new std::thread(encode));
+        encode();
+        for (auto worker: workers) {
+            worker->join();
+            delete worker;
+        }
+
+        Vec<uint8_t> head;
+        head.push_back('J');
+        head.push_back('T');
+        head.push_back('M');
+        head.push_back('C');
+        put(head, VERSION);
+        put(head, header.tile_size.x);
+        put(head, header.tile_size.y);
+        put(head, (uint32_t) header.table.size());
+        for (auto tile: header.table) {
+            put(head, (int32_t) tile.x);
+            put(head, (int32_t) tile.y);
+        }
+        put(head, (uint32_t) chunks.size());
+
+        uint64_t offset = head.size() + ENTRY_SIZE * chunks.size();
+        for (long i = 0; i < chunks.size(); ++i) {
+            put(head, (int32_t) coords[i].x);
+            put(head, (int32_t) coords[i].y);
+            put(head, offset);
+            put(head, (uint32_t) compressed[i].size());
+            put(head, raw_sizes[i]);
+            offset += compressed[i].size();
+        }
+
+        FILE *file = std::fopen(path.c_str(), "wb");
+        if (!file) return false;
+        bool written = std::fwrite(head.ptr(), 1, head.size(), file) == (size_t) head.size();
+        for (long i = 0; i < compressed.size() && written; ++i) {
+            written = std::fwrite(compressed[i].ptr(), 1, compressed[i].size(), file) == (size_t) compressed[i].size();
+        }
+        return std::fclose(file) == 0 && written;
+    }
+
+    bool TileMapFile::read_header(const uint8_t *data, long size, Header &header, Vec<ChunkEntry> &entries) {
+        const uint8_t *in = data, *end = data + size;
+        uint32_t version, table_size, chunk_count;
+        if (!is_chunked(data, size)) return false;
+        in += 4;
+        if (!get(in, end, version) || version != VERSION) return false;
+        if (!get(in, end, header.tile_size.x) || !get(in, end, header.tile_size.y)) return false;
+
+        if (!get(in, end, table_size)) return false;
+        header.table.clear();
+        for (uint32_t i = 0; i < table_size; ++i) {
+            int32_t x, y;
+            if (!get(in, end, x) || !get(in, end, y)) return false;
+            header.table.push_back({x, y});
+        }
+
+        if (!get(in, end, chunk_count)) return false;
+        entries.clear();
+        for (uint32_t i = 0; i < chunk_count; ++i) {
+            ChunkEntry entry{};
+            if (!get(in, end, entry.coord.x) || !get(in, end, entry.coord.y) || !get(in, end, entry.offset) ||
+                !get(in, end, entry.compressed_size) || !get(in, end, entry.raw_size)) {
+                return false;
+            }
+            if (entry.raw_size > MAX_RAW_SIZE) return false;
+            entries.push_back(entry);
+        }
+        return true;
+    }
+
+    TileStorage::Chunk *TileMapFile::decode_entry(const uint8_t *data, long size, const ChunkEntry &entry) {
+        if (entry.offset > (uint64_t) size || entry.compressed_size > (uint64_t) size - entry.offset) return nullptr;
+        Vec<uint8_t> raw;
+        raw.resize(entry.raw_size);
+        if (!lz::decompress(data + entry.offset, entry.compressed_size, raw.ptrw(), raw.size())) return nullptr;
+        return decode_chunk(raw.ptr(), raw.size());
+    }
+
+    bool TileMapFile::read_region(const fs::Path &path, Vector2i from, Vector2i to, Header &header, TileStorage &tiles) {
+        JV_TILE_ZONE("TileMapFile::read_region");
+        FILE *file = std::fopen(path.c_str(), "rb");
+        if (!file) return false;
+
+        // The header and table are small, read them in pieces until they parse
+        Vec<uint8_t> head;
+        Vec<ChunkEntry> entries;
+        bool parsed = false;
+        for (long want = 4096; !parsed; want *= 4) {
+            head.resize(want);
+            std::fseek(file, 0, SEEK_SET);
+            long got = (long) std::fread(head.ptrw(), 1, want, file);
+            parsed = read_header(head.ptr(), got, header, entries);
+            if (got < want) break;
+        }
+        if (!parsed) {
+            std::fclose(file);
+            return false;
+        }
+
+        Vector2i chunk_min = TileStorage::chunk_of(from), chunk_max = TileStorage::chunk_of(to);
+        Vec<uint8_t> compressed;
+        bool valid = true;
+        for (auto &entry: entries) {
+            Vector2i c = entry.coord;
+            if (c.x < chunk_min.x || c.y < chunk_min.y || c.x > chunk_max.x || c.y > chunk_max.y) continue;
+
+            compressed.resize(entry.compressed_size);
+            std::fseek(file, (long) entry.offset, SEEK_SET);
+            if (std::fread(compressed.ptrw(), 1, entry.compressed_size, file) != entry.compressed_size) {
+                valid = false;
+                break;
+            }
+            ChunkEntry local = entry;
+            local.offset = 0;
+            TileStorage::Chunk *chunk = decode_entry(compressed.ptr(), compressed.size(), local);
+            if (!chunk) {
+                valid = false;
+                break;
+            }
+            tiles.adopt_chunk(c, chunk);
+        }
+        std::fclose(file);
+        tiles.compact();
+        return valid;
+    }
+
+#endif
+
+}// namespace jovial
@@ -0,0 +1,249 @@
+#pragma once
+
+#include "JovialTileMap.h"
+
+#include <atomic>
+#include <thread>
+
+namespace jovial {
+
+    // Bulk map generation. A generator fills in the cells of one chunk at a time on every core, the
+    // chunks are handed to the storage whole and the map is auto tiled once at the end, instead of
+    // place_auto per cell recomputing the neighbourhood of every placement. A cell is 0 when empty
+    // and occupied otherwise. Maps with a journaled layer (terrain ids) get the cell value there.
+    class TileMapGenerator {
+    public:
+        // Calls generate_chunk(chunk_coord, uint8_t *cells) for every chunk of the inclusive chunk
+        // range, on several threads at once. cells is CHUNK_AREA zeroes in row order to fill in.
+        // What gets generated is added to what the map already holds. threads = 0 uses every core.
+        template<typename Fn>
+        static void generate(TileMap *map, Vector2i chunk_from, Vector2i chunk_to, Fn &&generate_chunk, int threads = 0) {
+            JV_TILE_ZONE("TileMapGenerator::generate");
+            threads = thread_count(threads);
+            int width = chunk_to.x - chunk_from.x + 1;
+            long count = (long) width * (chunk_to.y - chunk_from.y + 1);
+            TileStorage *layer = map->journaled_layer();
+
+            Vec<TileStorage::Chunk *> built, built_layer;
+            built.resize(count);
+            built_layer.resize(layer ? count : 0);
+            parallel_for(count, threads, [&](long i) {
+                uint8_t cells[TileStorage::CHUNK_AREA] = {};
+                generate_chunk(Vector2i(chunk_from.x + (int) (i % width), chunk_from.y + (int) (i / width)), cells);
+                built[i] = build_chunk(cells, false);
+                if (layer) built_layer[i] = build_chunk(cells, true);
+            });
+
+            Vec<Vector2i> chunk_coords;
+            for (long i = 0; i < count; ++i) {
+                Vector2i chunk_coord(chunk_from.x + (int) (i % width), chunk_from.y + (int) (i / width));
+                if (built[i]->count) chunk_coords.push_back(chunk_coord);
+                map->tiles.adopt_chunk(chunk_coord, built[i]);
+                if (layer) layer->adopt_chunk(chunk_coord, built_layer[i]);
+            }
+            if (layer) layer->compact();
+            autotile_chunks(map, chunk_coords, threads);
+        }
+
+        // Copies a width * height buffer of cells (row major) to the map, with its first cell at origin
+        static void fill_from_buffer(TileMap *map, Vector2i origin, int width, int height, const uint8_t *cells, int threads = 0);
+
+        // Retiles the chunks and the chunks around them once, resolving chunks on several threads
+        static void autotile_chunks(TileMap *map, const Vec<Vector2i> &chunk_coords, int threads = 0);
+
+        // Caves: random noise smoothed by a few steps of the 4-5 cellular automaton rule, with
+        // everything outside the buffer counting as wall
+        static Vec<uint8_t> cellular_caves(int width, int height, uint64_t seed, float fill = 0.45f, int steps = 4, int threads = 0);
+
+        // Fractal value noise, every cell only depends on its coord so chunks can be generated in any
+        // order. Cells over threshold are occupied, with terrain ids 1 to terrains banded by height.
+        static void noise_chunk(Vector2i chunk_coord, uint8_t *cells, uint64_t seed, float scale, float threshold, int terrains = 1);
+
+    private:
+        static TileStorage::Chunk *build_chunk(const uint8_t *cells, bool values);
+
+        static inline int thread_count(int threads) {
+            return threads > 0 ? threads : (int) math::MAX(std::thread::hardware_concurrency(), 1u);
+        }
+
+        // Calls fn(i) for every i < count, handing out indices over threads
+        template<typename Fn>
+        static void parallel_for(long count, int threads, Fn &&fn) {
+            std::atomic<long> next{0};
+            auto work = [&]() {
+                JV_TILE_ZONE("TileMapGenerator worker");
+                for (long i = next.fetch_add(1, std::memory_order_relaxed); i < count; i = next.fetch_add(1, std::memory_order_relaxed)) {
+                    fn(i);
+                }
+            };
+
+            Vec<std::thread *> workers;
+            for (int t = 1; t < math::MIN((long) threads, count); ++t) workers.push_back(new std::thread(work));
+            work();
+            for (auto worker: workers) {
+                worker->join();
+                delete worker;
+            }
+        }
+
+        static inline uint64_t hash_cell(int x, int y, uint64_t seed) {
+            uint64_t h = seed ^ ((uint64_t) (uint32_t) x * 0x9E3779B97F4A7C15ull) ^ ((uint64_t) (uint32_t) y * 0xC2B2AE3D27D4EB4Full);
+            h ^= h >> 31;
+            h *= 0xBF58476D1CE4E5B9ull;
+            h ^= h >> 29;
+            return h;
+        }
+
+        static inline float unit_cell(int x, int y, uint64_t seed) {
+            return (float) (hash_cell(x, y, seed) >> 40) / (float) (1 << 24);
+        }
+    };
+
+#ifdef JOVIAL_TILEMAP_IMPLEMENTATION
+
+    TileStorage::Chunk *TileMapGenerator::build_chunk(const uint8_t *cells, bool values) {
+        auto *chunk = new TileStorage::Chunk();
+        for (int y = 0; y < TileStorage::CHUNK_SIZE; ++y) {
+            for (int x = 0; x < TileStorage::CHUNK_SIZE; ++x) {
+                int i = y * TileStorage::CHUNK_SIZE + x;
+                if (!cells[i]) continue;
+                chunk->rows[y] |= 1u << x;
+                if (values) chunk->tiles[i] = Vector2i(cells[i], 0);
+                ++chunk->count;
+            }
+        }
+        return chunk;
+    }
+
+    void TileMapGenerator::fill_from_buffer(TileMap *map, Vector2i origin, int width, int height, const uint8_t *cells, int threads) {
+        if (width <= 0 || height <= 0) return;
+        Vector2i chunk_from = TileStorage::chunk_of(origin);
+        Vector2i chunk_to = TileStorage::chunk_of(origin + Vector2i(width - 1, height - 1));
+        generate(map, chunk_from, chunk_to, [&](Vector2i chunk_coord, uint8_t *chunk_cells) {
+            Vector2i chunk_origin(chunk_coord.x * TileStorage::CHUNK_SIZE, chunk_coord.y * TileStorage::CHUNK_SIZE);
+            int x0 = math::MAX(origin.x - chunk_origin.x, 0), x1 = math::MIN(origin.x + width - chunk_origin.x, TileStorage::CHUNK_SIZE);
+            int y0 = math::MAX(origin.y - chunk_origin.y, 0), y1 = math::MIN(origin.y + height - chunk_origin.y, TileStorage::CHUNK_SIZE);
+            for (int y = y0; y < y1; ++y) {
+                const uint8_t *row = cells + (long) (chunk_origin.y + y - origin.y) * width + (chunk_origin.x - origin.x);
+                for (int x = x0; x < x1; ++x) chunk_cells[y * TileStorage::CHUNK_SIZE + x] = row[x];
+            }
+        }, threads);
+    }
+
+    void TileMapGenerator::autotile_chunks(TileMap *map, const Vec<Vector2i> &chunk_coords, int threads) {
+        threads = thread_count(threads);
+
+        // The chunks around the generated ones see new neighbours along their edges
+        Vec<Vector2i> todo;
+        Vector2iMap<bool> queued;
+        Vector2i chunk_min(INT32_MAX, INT32_MAX), chunk_max(INT32_MIN, INT32_MIN);
+        for (auto chunk_coord: chunk_coords) {
+            for (int y = -1; y <= 1; ++y) {
+                for (int x = -1; x <= 1; ++x) {
+                    Vector2i at = chunk_coord + Vector2i(x, y);
+                    if (queued.has(at) || !map->tiles.has_chunk(at)) continue;
+                    queued.insert(at, true);
+                    todo.push_back(at);
+                    chunk_min = Vector2i(math::MIN(chunk_min.x, at.x), math::MIN(chunk_min.y, at.y));
+                    chunk_max = Vector2i(math::MAX(chunk_max.x, at.x), math::MAX(chunk_max.y, at.y));
+                }
+            }
+        }
+
+        // Resolving only reads the map, so a batch of chunks is resolved in parallel and then written
+        long batch = 64l * threads;
+        Vec<Vector2i> coords, resolved;
+        Vec<long> counts;
+        coords.resize(batch * TileStorage::CHUNK_AREA);
+        resolved.resize(batch * TileStorage::CHUNK_AREA);
+        counts.resize(batch);
+        for (long start = 0; start < todo.size(); start += batch) {
+            long size = math::MIN(batch, todo.size() - start);
+            parallel_for(size, threads, [&](long i) {
+                long at = i * TileStorage::CHUNK_AREA;
+                counts[i] = map->resolve_chunk(todo[start + i], coords.ptrw() + at, resolved.ptrw() + at);
+            });
+            for (long i = 0; i < size; ++i) {
+                long at = i * TileStorage::CHUNK_AREA;
+                for (long j = 0; j < counts[i]; ++j) map->tiles.insert(coords[at + j], resolved[at + j]);
+            }
+        }
+
+        map->tiles.compact();
+        if (chunk_min.x <= chunk_max.x && !map->listeners.is_empty()) {
+            map->notify_changed(Vector2i(chunk_min.x * TileStorage::CHUNK_SIZE, chunk_min.y * TileStorage::CHUNK_SIZE),
+                                Vector2i(chunk_max.x * TileStorage::CHUNK_SIZE + TileStorage::CHUNK_MASK,
+                                         chunk_max.y * TileStorage::CHUNK_SIZE + TileStorage::CHUNK_MASK));
+        }
+    }
+
+    Vec<uint8_t> TileMapGenerator::cellular_caves(int width, int height, uint64_t seed, float fill, int steps, int threads) {
+        threads = thread_count(threads);
+        Vec<uint8_t> buffers[2];
+        buffers[0].resize((long) width * height);
+        buffers[1].resize((long) width * height);
+        parallel_for(height, threads, [&](long y) {
+            for (int x = 0; x < width; ++x) buffers[0][y * width + x] = unit_cell(x, (int) y, seed) < fill;
+        });
+
+        for (int step = 0; step < steps; ++step) {
+            const Vec<uint8_t> &cells = buffers[step & 1];
+            Vec<uint8_t> &next = buffers[(step + 1) & 1];
+            parallel_for(height, threads, [&](long y) {
+                // Walls in each column of the 3 rows around y, with x shifted by one for the border
+                Vec<uint8_t> columns;
+                columns.resize(width + 2);
+                for (int x = -1; x <= width; ++x) {
+                    int walls = 0;
+                    for (long ny = y - 1; ny <= y + 1; ++ny) {
+                        walls += x < 0 || ny < 0 || x >= width || ny >= height || cells[ny * width + x];
+                    }
+                    columns[x + 1] = (uint8_t) walls;
+                }
+
+                for (int x = 0; x < width; ++x) {
+                    uint8_t wall = cells[y * width + x];
+                    int walls = columns[x] + columns[x + 1] + columns[x + 2] - wall;
+                    next[y * width + x] = walls >= 5 || (wall && walls >= 4);
+                }
+            });
+        }
+        return buffers[steps & 1];
+    }
+
+    void TileMapGenerator::noise_chunk(Vector2i chunk_coord, uint8_t *cells, uint64_t seed, float scale, float threshold, int terrains) {
+        auto smooth = [](float t) {
+            return t * t * (3.0f - 2.0f * t);
+        };
+        auto value_noise = [&](float x, float y, uint64_t octave_seed) {
+            float fx = x >= 0.0f ? (float) (int) x : (float) (int) x - 1.0f;
+            float fy = y >= 0.0f ? (float) (int) y : (float) (int) y - 1.0f;
+            int ix = (int) fx, iy = (int) fy;
+            float tx = smooth(x - fx), ty = smooth(y - fy);
+            float a = unit_cell(ix, iy, octave_seed), b = unit_cell(ix + 1, iy, octave_seed);
+            float c = unit_cell(ix, iy + 1, octave_seed), d = unit_cell(ix + 1, iy + 1, octave_seed);
+            float top = a + (b - a) * tx, bottom = c + (d - c) * tx;
+            return top + (bottom - top) * ty;
+        };
+
+        Vector2i origin(chunk_coord.x * TileStorage::CHUNK_SIZE, chunk_coord.y * TileStorage::CHUNK_SIZE);
+        for (int y = 0; y < TileStorage::CHUNK_SIZE; ++y) {
+            for (int x = 0; x < TileStorage::CHUNK_SIZE; ++x) {
+                float value = 0.0f, amplitude = 0.5f, frequency = 1.0f / scale;
+                for (int octave = 0; octave < 3; ++octave) {
+                    value += amplitude * value_noise((float) (origin.x + x) * frequency, (float) (origin.y + y) * frequency, seed + octave);
+                    amplitude *= 0.5f;
+                    frequency *= 2.0f;
+                }
+                value /= 0.875f;
+                if (value <= threshold) continue;
+
+                int terrain = 1 + (int) ((value - threshold) / (1.0f - threshold) * (float) terrains);
+                cells[y * TileStorage::CHUNK_SIZE + x] = (uint8_t) math::CLAMP(terrain, 1, terrains);
+            }
+        }
+    }
+
+#endif
+
+}// namespace jovial
@@ -0,0 +1,501 @@
+#pragma once
+
+#include "Jovial/Core/Logger.h"
+#include "Jovial/JovialEngine.h"
+#include "Jovial/SavingLoading/Jon.h"
+#include "JovialTileMap.h"
+#include "TileMapFile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+
+namespace jovial {
+
+    // Bounded lock free multi producer, multi consumer queue (Vyukov). Every slot carries a sequence number that tells
+    // producers and the consumer whose turn it is, so nothing ever takes a lock.
+    template<typename T, long N>
+    class BoundedQueue {
+    public:
+        static_assert((N & (N - 1)) == 0, "Queue size has to be a power of two");
+
+        BoundedQueue() {
+            for (long i = 0; i < N; ++i) slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        bool try_push(const T &value) {
+            long pos = tail.load(std::memory_order_relaxed);
+            while (true) {
+                Slot &slot = slots[pos & (N - 1)];
+                long diff = slot.sequence.load(std::memory_order_acquire) - pos;
+                if (diff == 0) {
+                    if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        slot.value = value;
+                        slot.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;// Full
+                } else {
+                    pos = tail.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        bool try_pop(T &out) {
+            long pos = head.load(std::memory_order_relaxed);
+            while (true) {
+                Slot &slot = slots[pos & (N - 1)];
+                long diff = slot.sequence.load(std::memory_order_acquire) - (pos + 1);
+                if (diff == 0) {
+                    if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        out = slot.value;
+                        slot.sequence.store(pos + N, std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;// Empty
+                } else {
+                    pos = head.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+    private:
+        struct Slot {
+            std::atomic<long> sequence;
+            T value;
+        };
+
+        // Own cache lines, so producers and the consumer don't keep stealing each other's line
+        alignas(64) std::atomic<long> tail{0};
+        alignas(64) std::atomic<long> head{0};
+        Slot slots[N];
+    };
+
+    // Loads a tile map in the background, either a jon document or a chunked TileMapFile. One worker reads
+    // the file and works out which chunks it holds (parsing and bucketing the tiles by chunk for jon,
+    // just the chunk table for TileMapFile), then orders them by distance to the focus coord. Every
+    // worker then builds or decompresses chunks, nearest first, and pushes them through a lock free
+    // queue. update() installs them on the main thread a few at a time, so the area around the camera
+    // shows up first and the rest streams in.
+    class TileMapLoader {
+    public:
+        enum class Status {
+            Idle,
+            Parsing,
+            Streaming,
+            Done,
+            Failed,
+        };
+
+        TileMapLoader() = default;
+        TileMapLoader(const TileMapLoader &other) = delete;
+        TileMapLoader &operator=(const TileMapLoader &other) = delete;
+
+        ~TileMapLoader() {
+            cancel();
+        }
+
+        // Clears the map and starts loading into it. threads = 0 uses every core.
+        bool load(TileMap *map, const fs::Path &path, Vector2i focus, int threads = 0);
+
+        // Same, but also loads the auto tile table if the file has one of the same size
+        inline bool load(const AnyAutoTileMap &map, const fs::Path &path, Vector2i focus, int threads = 0) {
+            if (!load(map.map, path, focus, threads)) return false;
+            table_map = map;
+            return true;
+        }
+
+        // Call every frame, installs at most max_chunks chunks. Returns true while still loading.
+        bool update(int max_chunks = 64);
+
+        // Stops the workers, the chunks that already arrived stay in the map. Doesn't wait for a file that
+        // is still being read or parsed, that worker finishes on its own and throws the result away.
+        void cancel();
+
+        [[nodiscard]] inline Status get_status() const {
+            return status.load(std::memory_order_acquire);
+        }
+
+        [[nodiscard]] inline bool is_loading() const {
+            Status current = get_status();
+            return current == Status::Parsing || current == Status::Streaming;
+        }
+
+        // Fraction of the chunks that are in the map
+        [[nodiscard]] inline float get_progress() const {
+            long total = chunk_total.load(std::memory_order_acquire);
+            return total ? (float) installed / (float) total : 0.0f;
+        }
+
+    private:
+        struct LoadedChunk {
+            Vector2i coord;
+            TileStorage::Chunk *chunk;// Null when the chunk was corrupt
+        };
+
+        // The file as read by the parse worker before it touches the loader: the bytes of a TileMapFile
+        // or the parsed jon document
+        struct Source {
+            bool chunked = false;
+            Vec<uint8_t> file_data;// TileMapFile: the whole file, entries point into it
+            String text;
+            jon::Lexer *lexer = nullptr;
+            jon::Parser *parser = nullptr;
+
+            Source() = default;
+            Source(const Source &other) = delete;
+            Source &operator=(const Source &other) = delete;
+
+            ~Source() {
+                free_jon();
+            }
+
+            inline void free_jon() {
+                delete parser;
+                delete lexer;
+                parser = nullptr;
+                lexer = nullptr;
+                text = String();
+            }
+        };
+
+        // Who owns the worker while it reads the file. cancel() can leave a worker that is still Reading
+        // behind instead of waiting out a big read or jon parse, the worker then frees what it read and
+        // the state itself. Once the worker has Attached, cancel() joins it.
+        enum WorkerState {
+            Reading,
+            Attached,
+            Abandoned,
+        };
+
+        static Source *read_source(const fs::Path &path);
+        void parse(const fs::Path &path, Source *read, Vector2i focus, int threads);
+        bool parse_jon();
+        bool parse_chunked();
+        TileStorage::Chunk *build_chunk(long index);
+        void build_chunks();
+        void join_worker();
+
+        // Past reading the file the parse worker looks at this between stages and every
+        // CANCEL_CHECK_MASK + 1 tiles
+        [[nodiscard]] inline bool is_cancelled() const {
+            return cancelled.load(std::memory_order_relaxed);
+        }
+
+        static constexpr long CANCEL_CHECK_MASK = (1 << 16) - 1;
+
+        TileMap *map = nullptr;
+        AnyAutoTileMap table_map;
+        std::thread *worker = nullptr;// Parses, then builds chunks together with the threads it starts
+        std::atomic<int> *worker_state = nullptr;// A WorkerState, shared with the worker
+        std::atomic<Status> status{Status::Idle};
+        std::atomic<bool> cancelled{false};
+        std::atomic<bool> header_ready{false};
+        std::atomic<long> chunk_total{0};
+        std::atomic<long> next_chunk{0};
+        std::atomic<int> building{0};
+        long installed = 0;
+        bool corrupt = false;
+
+        // Filled in by the parse worker before chunk_total is published, read only afterwards
+        TileMapFile::Header header;
+        Source *source = nullptr;
+        Vec<Vector2i> chunk_coords;
+        Vec<long> order;// Indices into chunk_coords, nearest to the focus first
+        Vec<long> chunk_starts;// Jon: tiles of chunk i are pairs[chunk_starts[i], chunk_starts[i + 1])
+        Vec<Vector2i> pairs;   // coord, tile, coord, tile...
+        Vec<TileMapFile::ChunkEntry> entries;
+
+        BoundedQueue<LoadedChunk, 1024> queue;
+    };
+
+#ifdef JOVIAL_TILEMAP_IMPLEMENTATION
+
+    bool TileMapLoader::load(TileMap *map, const fs::Path &path, Vector2i focus, int threads) {
+        if (is_loading()) return false;
+        cancel();
+
+        this->map = map;
+        table_map = AnyAutoTileMap();
+        map->clear();
+        map->journal.clear();
+
+        installed = 0;
+        corrupt = false;
+        cancelled.store(false, std::memory_order_relaxed);
+        header_ready.store(false, std::memory_order_relaxed);
+        chunk_total.store(0, std::memory_order_relaxed);
+        next_chunk.store(0, std::memory_order_relaxed);
+        if (threads <= 0) threads = (int) math::MAX(std::thread::hardware_concurrency(), 1u);
+        building.store(threads, std::memory_order_relaxed);
+        status.store(Status::Parsing, std::memory_order_release);
+
+        auto *state = new std::atomic<int>(Reading);
+        worker_state = state;
+        worker = new std::thread([this, state, path, focus, threads]() {
+            Source *read = read_source(path);
+            int expected = Reading;
+            if (!state->compare_exchange_strong(expected, Attached, std::memory_order_acq_rel)) {
+                // Abandoned by cancel(), the loader may be gone already
+                delete read;
+                delete state;
+                return;
+            }
+            parse(path, read, focus, threads);
+        });
+        return true;
+    }
+
+    TileMapLoader::Source *TileMapLoader::read_source(const fs::Path &path) {
+        JV_TILE_ZONE("TileMapLoader::read_source");
+        FILE *file = std::fopen(path.c_str(), "rb");
+        if (!file) return nullptr;
+        char magic[4] = {};
+        auto *source = new Source();
+        source->chunked = std::fread(magic, 1, 4, file) == 4 && TileMapFile::is_chunked((const uint8_t *) magic, 4);
+        if (source->chunked) {
+            std::fseek(file, 0, SEEK_END);
+            long size = std::ftell(file);
+            std::fseek(file, 0, SEEK_SET);
+            source->file_data.resize(size);
+            bool read = std::fread(source->file_data.ptrw(), 1, size, file) == (size_t) size;
+            std::fclose(file);
+            if (!read) source->file_data.clear();
+            return source;
+        }
+        std::fclose(file);
+
+        source->text = fs::read_entire_file(path);
+        source->lexer = new jon::Lexer(source->text.view());
+        source->parser = new jon::Parser(*source->lexer);
+        return source;
+    }
+
+    void TileMapLoader::parse(const fs::Path &path, Source *read, Vector2i focus, int threads) {
+        JV_TILE_ZONE("TileMapLoader::parse");
+        source = read;
+        if (!source || !(source->chunked ? parse_chunked() : parse_jon())) {
+            building.store(0, std::memory_order_relaxed);
+            if (is_cancelled()) return;// cancel() is waiting, it sets the status
+            JV_CORE_ERROR("Could not load tilemap from ", path.c_str());
+            status.store(Status::Failed, std::memory_order_release);
+            return;
+        }
+        header_ready.store(true, std::memory_order_release);
+
+        // Nearest chunks first
+        Vector2i focus_chunk = TileStorage::chunk_of(focus);
+        order.resize(chunk_coords.size());
+        for (long i = 0; i < order.size(); ++i) order[i] = i;
+        auto distance = [&](long i) {
+            long dx = chunk_coords[i].x - focus_chunk.x, dy = chunk_coords[i].y - focus_chunk.y;
+            return dx * dx + dy * dy;
+        };
+        if (is_cancelled()) {
+            building.store(0, std::memory_order_relaxed);
+            return;
+        }
+        std::sort(order.ptrw(), order.ptrw() + order.size(), [&](long a, long b) { return distance(a) < distance(b); });
+
+        status.store(Status::Streaming, std::memory_order_relaxed);
+        chunk_total.store(chunk_coords.size(), std::memory_order_release);
+
+        Vec<std::thread *> builders;
+        for (int t = 1; t < threads; ++t) {
+            builders.push_back(new std::thread([this]() {
+                build_chunks();
+            }));
+        }
+        build_chunks();
+        for (auto builder: builders) {
+            builder->join();
+            delete builder;
+        }
+    }
+
+    bool TileMapLoader::parse_jon() {
+        JV_TILE_ZONE("TileMapLoader::parse_jon");
+        if (is_cancelled()) return false;
+
+        jon::JonNode object{}, temp{};
+        bool valid = source->parser->nodes->get_if_contains(C_STR_VIEW("tilemap"), object) && object.kind == jon::JonNode::Object;
+        valid = valid && object.as.object->get_if_contains(C_STR_VIEW("size"), temp) && temp.kind == jon::JonNode::Vec2;
+        if (valid) header.tile_size = temp.as.val.vec2;
+        header.table.clear();
+        bool has_table = valid && (object.as.object->get_if_contains(C_STR_VIEW("wang"), temp) ||
+                                   object.as.object->get_if_contains(C_STR_VIEW("blob"), temp));
+        if (has_table && temp.kind == jon::JonNode::Array) {
+            for (int i = 0; i < temp.as.arr->size(); ++i) header.table.push_back((*temp.as.arr)[i].vec2i);
+        }
+        valid = valid && object.as.object->get_if_contains(C_STR_VIEW("tiles"), temp) && temp.kind == jon::JonNode::Array;
+        if (!valid) return false;
+
+        // Counting sort of the tiles by chunk, so every chunk can be built without searching
+        Vec<jon::JonAtomicVal> &values = *temp.as.arr;
+        long pair_count = values.size() / 2;
+        Vector2iMap<long> chunk_index;
+        Vec<long> chunk_of_pair;
+        chunk_of_pair.resize(pair_count);
+        chunk_coords.clear();
+        chunk_starts.clear();
+        for (long i = 0; i < pair_count; ++i) {
+            if ((i & CANCEL_CHECK_MASK) == 0 && is_cancelled()) return false;
+            Vector2i chunk_coord = TileStorage::chunk_of(values[i * 2].vec2i);
+            long *index = chunk_index.getptr(chunk_coord);
+            if (!index) {
+                index = &chunk_index.insert(chunk_coord, chunk_coords.size());
+                chunk_coords.push_back(chunk_coord);
+                chunk_starts.push_back(0);
+            }
+            chunk_starts[*index] += 2;
+            chunk_of_pair[i] = *index;
+        }
+
+        // Counts to offsets, then every pair goes to the end of its chunk's range
+        long offset = 0;
+        for (long i = 0; i < chunk_starts.size(); ++i) {
+            long count = chunk_starts[i];
+            chunk_starts[i] = offset;
+            offset += count;
+        }
+        chunk_starts.push_back(offset);
+
+        Vec<long> cursor = chunk_starts;
+        pairs.resize(pair_count * 2);
+        for (long i = 0; i < pair_count; ++i) {
+            if ((i & CANCEL_CHECK_MASK) == 0 && is_cancelled()) return false;
+            long &at = cursor[chunk_of_pair[i]];
+            pairs[at] = values[i * 2].vec2i;
+            pairs[at + 1] = values[i * 2 + 1].vec2i;
+            at += 2;
+        }
+        source->free_jon();// Everything is in pairs now
+        return true;
+    }
+
+    bool TileMapLoader::parse_chunked() {
+        JV_TILE_ZONE("TileMapLoader::parse_chunked");
+        const Vec<uint8_t> &file_data = source->file_data;
+        if (file_data.is_empty() || is_cancelled() || !TileMapFile::read_header(file_data.ptr(), file_data.size(), header, entries)) return false;
+        chunk_coords.clear();
+        for (auto &entry: entries) chunk_coords.push_back(entry.coord);
+        return true;
+    }
+
+    TileStorage::Chunk *TileMapLoader::build_chunk(long index) {
+        if (source->chunked) return TileMapFile::decode_entry(source->file_data.ptr(), source->file_data.size(), entries[index]);
+
+        auto *chunk = new TileStorage::Chunk();
+        Vector2i origin(chunk_coords[index].x * TileStorage::CHUNK_SIZE, chunk_coords[index].y * TileStorage::CHUNK_SIZE);
+        for (long p = chunk_starts[index]; p < chunk_starts[index + 1]; p += 2) {
+            int x = pairs[p].x - origin.x, y = pairs[p].y - origin.y;
+            if (!chunk->has(x, y)) {
+                chunk->rows[y] |= 1u << x;
+                ++chunk->count;
+            }
+            chunk->tiles[y * TileStorage::CHUNK_SIZE + x] = pairs[p + 1];
+        }
+        return chunk;
+    }
+
+    void TileMapLoader::build_chunks() {
+        JV_TILE_ZONE("TileMapLoader::build_chunks");
+        long total = chunk_total.load(std::memory_order_acquire);
+        while (!cancelled.load(std::memory_order_relaxed)) {
+            long i = next_chunk.fetch_add(1, std::memory_order_relaxed);
+            if (i >= total) break;
+
+            LoadedChunk loaded = {chunk_coords[order[i]], build_chunk(order[i])};
+            while (!queue.try_push(loaded)) {
+                if (cancelled.load(std::memory_order_relaxed)) {
+                    if (loaded.chunk) TileStorage::release(loaded.chunk);
+                    break;
+                }
+                std::this_thread::yield();
+            }
+        }
+        building.fetch_sub(1, std::memory_order_release);
+    }
+
+    bool TileMapLoader::update(int max_chunks) {
+        JV_TILE_ZONE("TileMapLoader::update");
+        if (!map || get_status() == Status::Idle) return false;
+
+        if (header_ready.exchange(false, std::memory_order_acquire)) {
+            map->tile_size = header.tile_size;
+            if (table_map.is_valid() && header.table.size() == table_map.table_size) {
+                for (int i = 0; i < table_map.table_size; ++i) table_map[table_map.mask_at(i)] = header.table[i];
+            }
+        }
+
+        Vector2i chunk_min(INT32_MAX, INT32_MAX), chunk_max(INT32_MIN, INT32_MIN);
+        LoadedChunk loaded{};
+        for (int i = 0; i < max_chunks && queue.try_pop(loaded); ++i) {
+            ++installed;
+            if (!loaded.chunk) {
+                corrupt = true;
+                continue;
+            }
+            map->tiles.adopt_chunk(loaded.coord, loaded.chunk);
+            chunk_min = Vector2i(math::MIN(chunk_min.x, loaded.coord.x), math::MIN(chunk_min.y, loaded.coord.y));
+            chunk_max = Vector2i(math::MAX(chunk_max.x, loaded.coord.x), math::MAX(chunk_max.y, loaded.coord.y));
+        }
+        if (chunk_min.x <= chunk_max.x && !map->listeners.is_empty()) {
+            map->notify_changed(Vector2i(chunk_min.x * TileStorage::CHUNK_SIZE, chunk_min.y * TileStorage::CHUNK_SIZE),
+                                Vector2i(chunk_max.x * TileStorage::CHUNK_SIZE + TileStorage::CHUNK_MASK,
+                                         chunk_max.y * TileStorage::CHUNK_SIZE + TileStorage::CHUNK_MASK));
+        }
+
+        if (get_status() == Status::Streaming && installed == chunk_total.load(std::memory_order_acquire) &&
+            building.load(std::memory_order_acquire) == 0) {
+            join_worker();
+            map->tiles.compact();
+            pairs.clear();
+            if (corrupt) JV_CORE_ERROR("Some chunks of the tilemap were corrupt and got skipped");
+            status.store(corrupt ? Status::Failed : Status::Done, std::memory_order_release);
+        } else if (get_status() == Status::Failed) {
+            join_worker();
+        }
+        return is_loading();
+    }
+
+    void TileMapLoader::cancel() {
+        cancelled.store(true, std::memory_order_relaxed);
+        int expected = Reading;
+        if (worker && worker_state->compare_exchange_strong(expected, Abandoned, std::memory_order_acq_rel)) {
+            // Still reading the file, it cleans up after itself
+            worker->detach();
+            delete worker;
+            worker = nullptr;
+            worker_state = nullptr;
+            building.store(0, std::memory_order_relaxed);
+        } else {
+            join_worker();
+        }
+
+        LoadedChunk loaded{};
+        while (queue.try_pop(loaded)) {
+            if (!loaded.chunk) continue;
+            if (map) map->tiles.adopt_chunk(loaded.coord, loaded.chunk);
+            else TileStorage::release(loaded.chunk);
+        }
+        if (is_loading()) status.store(Status::Idle, std::memory_order_release);
+    }
+
+    void TileMapLoader::join_worker() {
+        if (!worker) return;
+        worker->join();
+        delete worker;
+        delete worker_state;
+        delete source;
+        worker = nullptr;
+        worker_state = nullptr;
+        source = nullptr;
+    }
+
+#endif
+
+}// namespace jovial
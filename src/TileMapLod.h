@@ -0,0 +1,207 @@
+#pragma once
+
+#include "JovialTileMap.h"
+#include "TileMapRenderer.h"
+
+namespace jovial {
+
+    // Draws a map zoomed far out as one quad per chunk instead of one per tile. Below lod_zoom every
+    // visible chunk is drawn as an impostor, a small texture of the chunk rendered on the CPU with
+    // TileMapRenderer at TILE_PIXELS pixels per tile. Impostors are built the first time their chunk
+    // is seen and marked stale when the map reports a change to it, then rebuilt a few per frame, so
+    // a frame zoomed out costs one quad per visible chunk however many tiles they hold. Impostors
+    // don't animate. The tileset needs its atlas pixels, see Tileset::set_pixels.
+    class TileMapLod : public TileMapListener {
+    public:
+        static constexpr int TILE_PIXELS = 2;// Largest size of a tile in an impostor
+
+        float lod_zoom = 0.35f;     // Camera zoom below which chunks are drawn as impostors
+        int rebuilds_per_frame = 32;// Impostors built or rebuilt at most per draw()
+        long max_impostors = 2048;  // Past this many, impostors not drawn this frame are unloaded
+
+        explicit TileMapLod(TileMap *tile_map);
+        ~TileMapLod() override;
+
+        TileMapLod(const TileMapLod &other) = delete;
+        TileMapLod &operator=(const TileMapLod &other) = delete;
+
+        // Draws the tiles as they are when zoomed in, the impostors of the visible chunks otherwise
+        void draw(TextureDrawProps props = {});
+
+        // Unloads every impostor, they are built again as they come into view
+        void clear();
+
+        void on_tiles_changed(TileMap *map, Vector2i from, Vector2i to) override;
+
+        [[nodiscard]] inline long impostor_count() const {
+            return impostors.size();
+        }
+
+        // The impostor textures, as cached meshes
+        [[nodiscard]] MemoryStats memory_stats() const;
+
+    private:
+        struct Impostor {
+            Texture texture;
+            bool loaded = false;// Nothing to draw if the chunk was empty
+            bool stale = true;
+            long last_drawn = 0;
+        };
+
+        bool update_mips();
+        void build(Vector2i chunk_coord, Impostor &impostor);
+        void unload(Impostor &impostor);
+
+        TileMap *tile_map;
+        Vector2iMap<Impostor> impostors;
+        TileMapRenderer::Mips mips;
+        const Tileset *mips_tileset = nullptr;// What mips were built from
+        bool mips_failed = false;
+        TileImage scratch;
+        long frame = 0;
+    };
+
+#ifdef JOVIAL_TILEMAP_IMPLEMENTATION
+
+    TileMapLod::TileMapLod(TileMap *tile_map)
+        : tile_map(tile_map) {
+        tile_map->listeners.push_back(this);
+    }
+
+    TileMapLod::~TileMapLod() {
+        tile_map->listeners.erase(this);
+        clear();
+    }
+
+    void TileMapLod::clear() {
+        for (auto &entry: impostors) unload(entry.value);
+        impostors.clear();
+    }
+
+    void TileMapLod::unload(Impostor &impostor) {
+        if (impostor.loaded) rendering::unload_texture(impostor.texture);
+        impostor.loaded = false;
+    }
+
+    bool TileMapLod::update_mips() {
+        const Tileset *tileset = tile_map->tileset;
+        if (tileset == mips_tileset) return !mips_failed;
+
+        // A new tileset draws every chunk differently
+        clear();
+        mips_tileset = tileset;
+        mips_failed = true;
+        if (!tileset) return false;
+        int tile_w = (int) tileset->tile_size.x, tile_h = (int) tileset->tile_size.y;
+        int level = 0;
+        while ((tile_w >> level) > TILE_PIXELS || (tile_h >> level) > TILE_PIXELS) ++level;
+        mips_failed = !TileMapRenderer::build_mips(tileset, math::MAX(tile_w >> level, 1), math::MAX(tile_h >> level, 1), mips);
+        return !mips_failed;
+    }
+
+    void TileMapLod::build(Vector2i chunk_coord, Impostor &impostor) {
+        JV_TILE_ZONE("TileMapLod::build");
+        unload(impostor);
+        impostor.stale = false;
+        const TileStorage::Chunk *chunk = tile_map->tiles.find_chunk(chunk_coord);
+        if (!chunk || !chunk->count) return;
+
+        // Image row 0 is the top chunk row, the top of the quad like the atlas rows of a tile
+        scratch.reset(TileStorage::CHUNK_SIZE * mips.width, TileStorage::CHUNK_SIZE * mips.height);
+        TileMapRenderer::draw_chunk(chunk, mips, 0, TileStorage::CHUNK_MASK, 0, TileStorage::CHUNK_MASK, scratch.pixels.ptrw(), scratch.width);
+        // The image only borrows the pixels, the texture keeps its own copy
+        Image image((unsigned char *) scratch.pixels.ptrw(), scratch.width, scratch.height, 4, false);
+        impostor.texture = Texture(image, Texture::Linear);
+        impostor.loaded = impostor.texture.id != 0;
+    }
+
+    void TileMapLod::draw(TextureDrawProps props) {
+        JV_TILE_ZONE("TileMapLod::draw");
+        if (!tile_map->visable) return;
+        if (Camera2D::get_current_zoom() >= lod_zoom || !update_mips()) {
+            tile_map->draw(props);
+            return;
+        }
+
+        ++frame;
+        Rect2 visible = Camera2D::get_visable_rect(tile_map->using_vsize);
+        Vector2i a = tile_map->world_to_coord(visible.min_pos()), b = tile_map->world_to_coord(visible.max_pos());
+        Vector2i from = TileStorage::chunk_of(Vector2i(math::MIN(a.x, b.x), math::MIN(a.y, b.y)) - Vector2i(1, 1));
+        Vector2i to = TileStorage::chunk_of(Vector2i(math::MAX(a.x, b.x), math::MAX(a.y, b.y)) + Vector2i(1, 1));
+
+        // The impostor is CHUNK_SIZE mips wide, scaled to CHUNK_SIZE cells
+        Vector2 scale = props.scale;
+        props.scale = Vector2(scale.x * tile_map->tile_size.x / (float) mips.width, scale.y * tile_map->tile_size.y / (float) mips.height);
+        props.uv = {0, 0, 1, 1};
+        int rebuilds = 0;
+        for (int cy = from.y; cy <= to.y; ++cy) {
+            for (int cx = from.x; cx <= to.x; ++cx) {
+                Vector2i chunk_coord(cx, cy);
+                Impostor *impostor = impostors.getptr(chunk_coord);
+                if (!tile_map->tiles.has_chunk(chunk_coord)) {
+                    // The chunk was freed since, by clear() or compact()
+                    if (impostor) {
+                        unload(*impostor);
+                        impostors.erase(chunk_coord);
+                    }
+                    continue;
+                }
+
+                if (!impostor) impostor = &impostors.insert(chunk_coord, {});
+                // Until its turn comes a stale impostor still shows what the chunk was
+                if (impostor->stale && rebuilds < rebuilds_per_frame) {
+                    build(chunk_coord, *impostor);
+                    ++rebuilds;
+                }
+                impostor->last_drawn = frame;
+                if (impostor->loaded) {
+                    draw_texture(impostor->texture, tile_map->coord_to_world(Vector2i(cx * TileStorage::CHUNK_SIZE, cy * TileStorage::CHUNK_SIZE)), props);
+                }
+            }
+        }
+
+        if (impostors.size() > max_impostors) {
+            Vec<Vector2i> unseen;
+            for (auto &entry: impostors) {
+                if (entry.value.last_drawn != frame) unseen.push_back(entry.key);
+            }
+            for (auto chunk_coord: unseen) {
+                unload(impostors.get(chunk_coord));
+                impostors.erase(chunk_coord);
+            }
+        }
+    }
+
+    void TileMapLod::on_tiles_changed(TileMap *, Vector2i from, Vector2i to) {
+        Vector2i chunk_from = TileStorage::chunk_of(from), chunk_to = TileStorage::chunk_of(to);
+        int64_t area = ((int64_t) chunk_to.x - chunk_from.x + 1) * ((int64_t) chunk_to.y - chunk_from.y + 1);
+        // Big regions, like the everything of clear(), are cheaper to test impostor by impostor
+        if (area > impostors.size()) {
+            for (auto &entry: impostors) {
+                if (entry.key.x >= chunk_from.x && entry.key.x <= chunk_to.x && entry.key.y >= chunk_from.y && entry.key.y <= chunk_to.y) {
+                    entry.value.stale = true;
+                }
+            }
+            return;
+        }
+        for (int cy = chunk_from.y; cy <= chunk_to.y; ++cy) {
+            for (int cx = chunk_from.x; cx <= chunk_to.x; ++cx) {
+                if (Impostor *impostor = impostors.getptr({cx, cy})) impostor->stale = true;
+            }
+        }
+    }
+
+    MemoryStats TileMapLod::memory_stats() const {
+        MemoryStats stats;
+        stats.cached_meshes = impostors.memory_usage() + mips.pixels.size() * (long) sizeof(uint32_t) + mips.offset_of.memory_usage() +
+                              scratch.pixels.size() * (long) sizeof(uint32_t);
+        long texture_bytes = (long) TileStorage::CHUNK_AREA * mips.width * mips.height * 4;
+        for (auto &entry: impostors) {
+            if (entry.value.loaded) stats.cached_meshes += texture_bytes;
+        }
+        return stats;
+    }
+
+#endif
+
+}// namespace jovial
@@ -0,0 +1,1022 @@
+#pragma once
+
+#include "JovialTileMap.h"
+
+#include <thread>
+
+namespace jovial {
+
+    // Grid pathfinder over the occupancy of a TileMap. Direct queries use Jump Point Search over
+    // a packed bit grid (row and column major so straight jumps scan 64 cells at a time), and the
+    // optional hierarchical mode keeps an HPA* style graph of cluster entrances that is rebuilt
+    // per cluster when tiles change, so long queries only search a handful of abstract nodes.
+    class TileMapPathfinder : public TileMapListener {
+    public:
+        enum class Connectivity {
+            Four,
+            Eight,
+        };
+
+        struct PathQuery {
+            Vector2i from;
+            Vector2i to;
+        };
+
+        struct PathResult {
+            Vec<Vector2i> path;
+            float cost = 0.0f;
+            bool found = false;
+        };
+
+        static const int CLUSTER_SIZE = 16;
+        static const int MAX_SINGLE_ENTRANCE = 6;// Entrances at least this long get a transition at both ends
+
+        TileMapPathfinder(TileMap *tile_map, Vector2i min, Vector2i max,
+                          Connectivity connectivity = Connectivity::Eight, bool tiles_block = true);
+
+        ~TileMapPathfinder() override;
+
+        Connectivity connectivity;
+        bool tiles_block;        // When false, placed tiles are the walkable cells (e.g. floors)
+        bool refine_paths = true;// Expand hierarchical paths into every cell instead of returning the waypoints
+
+    public:
+        bool find_path(Vector2i from, Vector2i to, PathResult &result);
+
+        void find_paths(const Vec<PathQuery> &queries, Vec<PathResult> &results, int threads = 1);
+
+        void set_hierarchical(bool enabled);
+
+        [[nodiscard]] inline bool is_hierarchical() const {
+            return hierarchical;
+        }
+
+        [[nodiscard]] inline bool is_walkable(Vector2i coord) const {
+            return walkable(coord.x - origin.x, coord.y - origin.y);
+        }
+
+        // Rebuilds the clusters touched since the last query. Queries call this themselves.
+        void flush();
+
+        void rebuild();
+
+        void on_tiles_changed(TileMap *map, Vector2i from, Vector2i to) override;
+
+    private:
+        struct AbstractEdge {
+            int to;
+            float cost;
+        };
+
+        struct AbstractNode {
+            Vector2i coord;// Local grid coordinates
+            int cluster = -1;
+            int partner = -1;// Node on the other side of the entrance
+            Vec<AbstractEdge> edges;
+            Vec<Vec<Vector2i>> edge_cells;// Cells walked along each edge after leaving the node, kept apart so the search stays compact
+        };
+
+        struct AbstractRecord {
+            float g = 0.0f;
+            int parent = -1;
+            bool closed = false;
+            uint32_t stamp = 0;
+        };
+
+        // Search state for the abstract graph indexed by node id. Records left over from older
+        // searches are told apart by their stamp, so nothing needs clearing between queries.
+        struct AbstractScratch {
+            Vec<AbstractRecord> records;
+            uint32_t stamp = 0;
+        };
+
+        TileMap *tile_map;
+        Vector2i origin;
+        int width, height;
+        int row_words, col_words;
+        Vec<uint64_t> rows;// Walkable bits, row major
+        Vec<uint64_t> cols;// Walkable bits, column major
+
+        bool hierarchical = false;
+        int clusters_x = 0, clusters_y = 0;
+        Vec<AbstractNode> nodes;
+        Vec<int> free_nodes;
+        Vec<Vec<int>> cluster_nodes;
+        Vec<Vec<int>> east_borders; // Nodes on the border between cluster (x, y) and (x + 1, y)
+        Vec<Vec<int>> north_borders;// Nodes on the border between cluster (x, y) and (x, y + 1)
+        Vec<uint8_t> dirty_clusters;
+        Vec<int> components;// Connected component of every abstract node, so unreachable goals fail fast
+        bool components_dirty = false;
+        bool any_dirty = false;
+        AbstractScratch scratch;
+
+    private:
+        [[nodiscard]] inline bool walkable(int x, int y) const {
+            if (x < 0 || y < 0 || x >= width || y >= height) return false;
+            return (rows[(long) y * row_words + (x >> 6)] >> (x & 63)) & 1;
+        }
+
+        inline void set_walkable(int x, int y, bool value) {
+            uint64_t row_bit = 1ull << (x & 63);
+            uint64_t col_bit = 1ull << (y & 63);
+            uint64_t &row = rows[(long) y * row_words + (x >> 6)];
+            uint64_t &col = cols[(long) x * col_words + (y >> 6)];
+            if (value) {
+                row |= row_bit;
+                col |= col_bit;
+            } else {
+                row &= ~row_bit;
+                col &= ~col_bit;
+            }
+        }
+
+        [[nodiscard]] inline const uint64_t *row_line(int y) const {
+            if (y < 0 || y >= height) return nullptr;
+            return rows.ptr() + (long) y * row_words;
+        }
+
+        [[nodiscard]] inline const uint64_t *col_line(int x) const {
+            if (x < 0 || x >= width) return nullptr;
+            return cols.ptr() + (long) x * col_words;
+        }
+
+        [[nodiscard]] inline float distance(Vector2i a, Vector2i b) const {
+            int dx = a.x > b.x ? a.x - b.x : b.x - a.x;
+            int dy = a.y > b.y ? a.y - b.y : b.y - a.y;
+            if (connectivity == Connectivity::Four) return (float) (dx + dy);
+            int lo = math::MIN(dx, dy);
+            int hi = math::MAX(dx, dy);
+            return (float) (hi - lo) + (float) lo * 1.41421356f;
+        }
+
+        [[nodiscard]] inline int cluster_of(Vector2i local) const {
+            return (local.y / CLUSTER_SIZE) * clusters_x + local.x / CLUSTER_SIZE;
+        }
+
+        static int scan_line(const uint64_t *line, const uint64_t *side_a, const uint64_t *side_b,
+                             int words, int from, int dir, int goal);
+
+        bool jump(Vector2i from, Vector2i dir, Vector2i goal, Vector2i &out) const;
+        int prune_neighbours(Vector2i coord, Vector2i parent, bool has_parent, Vector2i *out) const;
+        bool search_jps(Vector2i from, Vector2i to, PathResult &result) const;
+        bool search_hierarchical(Vector2i from, Vector2i to, PathResult &result, AbstractScratch &state) const;
+        bool search(Vector2i from, Vector2i to, PathResult &result, AbstractScratch &state) const;
+
+        void cluster_distances(int cluster, Vector2i from, float *dist) const;
+        void cluster_path(int cluster, const float *dist, Vector2i to, Vec<Vector2i> &cells) const;
+        int add_node(Vector2i coord);
+        void clear_border(Vec<int> &border);
+        void build_border(int cx, int cy, bool east);
+        void build_cluster_edges(int cluster);
+        void build_components();
+        void read_region(Vector2i from, Vector2i to);
+    };
+
+#ifdef JOVIAL_TILEMAP_IMPLEMENTATION
+
+    namespace {
+        struct PathHeapEntry {
+            float f;
+            float g;
+            int id;
+        };
+
+        // Min heap on f, preferring the deeper entry when f ties.
+        inline bool heap_less(const PathHeapEntry &a, const PathHeapEntry &b) {
+            return a.f < b.f || (a.f == b.f && a.g > b.g);
+        }
+
+        inline void heap_sift_up(PathHeapEntry *data, long i) {
+            while (i > 0) {
+                long parent = (i - 1) / 2;
+                if (!heap_less(data[i], data[parent])) break;
+                PathHeapEntry tmp = data[i];
+                data[i] = data[parent];
+                data[parent] = tmp;
+                i = parent;
+            }
+        }
+
+        inline void heap_sift_down(PathHeapEntry *data, long size) {
+            long i = 0;
+            while (true) {
+                long l = i * 2 + 1, r = l + 1, best = i;
+                if (l < size && heap_less(data[l], data[best])) best = l;
+                if (r < size && heap_less(data[r], data[best])) best = r;
+                if (best == i) break;
+                PathHeapEntry tmp = data[i];
+                data[i] = data[best];
+                data[best] = tmp;
+                i = best;
+            }
+        }
+
+        struct PathHeap {
+            Vec<PathHeapEntry> items;
+
+            [[nodiscard]] inline bool is_empty() const {
+                return items.is_empty();
+            }
+
+            inline void push(PathHeapEntry entry) {
+                items.push_back(entry);
+                heap_sift_up(items.ptrw(), items.size() - 1);
+            }
+
+            inline PathHeapEntry pop() {
+                PathHeapEntry *data = items.ptrw();
+                PathHeapEntry top = data[0];
+                long size = items.size() - 1;
+                data[0] = data[size];
+                items.resize(size);
+                if (size > 0) heap_sift_down(items.ptrw(), size);
+                return top;
+            }
+        };
+
+        struct JumpRecord {
+            float g;
+            Vector2i parent;
+            bool closed;
+        };
+
+        inline Vector2i step_towards(Vector2i from, Vector2i to) {
+            return {(to.x > from.x) - (to.x < from.x), (to.y > from.y) - (to.y < from.y)};
+        }
+
+        inline void append_segment(Vec<Vector2i> &path, Vector2i from, Vector2i to, Vector2i origin) {
+            Vector2i step = step_towards(from, to);
+            while (from != to) {
+                from += step;
+                path.push_back(from + origin);
+            }
+        }
+    }// namespace
+
+    TileMapPathfinder::TileMapPathfinder(TileMap *tile_map, Vector2i min, Vector2i max,
+                                         Connectivity connectivity, bool tiles_block)
+        : connectivity(connectivity), tiles_block(tiles_block), tile_map(tile_map), origin(min) {
+        JV_CORE_ASSERT(max.x >= min.x && max.y >= min.y, "Invalid pathfinding bounds!")
+
+        width = max.x - min.x + 1;
+        height = max.y - min.y + 1;
+        row_words = (width + 63) / 64;
+        col_words = (height + 63) / 64;
+        rows.resize((long) row_words * height);
+        cols.resize((long) col_words * width);
+
+        clusters_x = (width + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+        clusters_y = (height + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+        cluster_nodes.resize((long) clusters_x * clusters_y);
+        east_borders.resize((long) clusters_x * clusters_y);
+        north_borders.resize((long) clusters_x * clusters_y);
+        dirty_clusters.resize((long) clusters_x * clusters_y);
+
+        rebuild();
+        tile_map->listeners.push_back(this);
+    }
+
+    TileMapPathfinder::~TileMapPathfinder() {
+        tile_map->listeners.erase(this);
+    }
+
+    void TileMapPathfinder::rebuild() {
+        JV_TILE_ZONE("TileMapPathfinder::rebuild");
+        rows.fill(0);
+        cols.fill(0);
+        if (tiles_block) {
+            for (int y = 0; y < height; ++y) {
+                for (int x = 0; x < width; ++x) {
+                    set_walkable(x, y, true);
+                }
+            }
+        }
+        tile_map->tiles.for_each_in_rect(origin, origin + Vector2i(width - 1, height - 1), [&](Vector2i coord, Vector2i) {
+            set_walkable(coord.x - origin.x, coord.y - origin.y, !tiles_block);
+        });
+
+        dirty_clusters.fill(1);
+        any_dirty = true;
+    }
+
+    void TileMapPathfinder::read_region(Vector2i from, Vector2i to) {
+        for (int y = from.y; y <= to.y; ++y) {
+            for (int x = from.x; x <= to.x; ++x) {
+                bool has = tile_map->has(Vector2i(x, y) + origin);
+                set_walkable(x, y, has != tiles_block);
+            }
+        }
+    }
+
+    void TileMapPathfinder::on_tiles_changed(TileMap *, Vector2i from, Vector2i to) {
+        // Work in 64 bit so the 'everything changed' region from clear() can't overflow.
+        int64_t x0 = math::MAX((int64_t) from.x - origin.x, (int64_t) 0);
+        int64_t y0 = math::MAX((int64_t) from.y - origin.y, (int64_t) 0);
+        int64_t x1 = math::MIN((int64_t) to.x - origin.x, (int64_t) width - 1);
+        int64_t y1 = math::MIN((int64_t) to.y - origin.y, (int64_t) height - 1);
+        if (x0 > x1 || y0 > y1) return;
+
+        Vector2i lo((int) x0, (int) y0);
+        Vector2i hi((int) x1, (int) y1);
+        read_region(lo, hi);
+
+        for (int cy = lo.y / CLUSTER_SIZE; cy <= hi.y / CLUSTER_SIZE; ++cy) {
+            for (int cx = lo.x / CLUSTER_SIZE; cx <= hi.x / CLUSTER_SIZE; ++cx) {
+                dirty_clusters[(long) cy * clusters_x + cx] = 1;
+            }
+        }
+        any_dirty = true;
+    }
+
+    void TileMapPathfinder::set_hierarchical(bool enabled) {
+        if (enabled == hierarchical) return;
+        hierarchical = enabled;
+        if (!enabled) {
+            nodes.clear();
+            free_nodes.clear();
+            for (auto &list: cluster_nodes) list.clear();
+            for (auto &list: east_borders) list.clear();
+            for (auto &list: north_borders) list.clear();
+        }
+        dirty_clusters.fill(1);
+        any_dirty = true;
+    }
+
+    int TileMapPathfinder::scan_line(const uint64_t *line, const uint64_t *side_a, const uint64_t *side_b,
+                                     int words, int from, int dir, int goal) {
+        if (from < 0 || from >= words * 64) return -1;
+
+        // A cell is a jump point when a side neighbour opens up relative to the cell behind it,
+        // i.e. the side is walkable here but was blocked one step back along the scan.
+        if (dir > 0) {
+            uint64_t first_mask = ~0ull << (from & 63);
+            for (int w = from >> 6; w < words; ++w) {
+                uint64_t forced = 0;
+                if (side_a) forced |= side_a[w] & ~((side_a[w] << 1) | (w > 0 ? side_a[w - 1] >> 63 : 0));
+                if (side_b) forced |= side_b[w] & ~((side_b[w] << 1) | (w > 0 ? side_b[w - 1] >> 63 : 0));
+                uint64_t blocked = ~line[w];
+                uint64_t goal_bit = (goal >= 0 && (goal >> 6) == w) ? 1ull << (goal & 63) : 0;
+                uint64_t stop = (blocked | forced | goal_bit) & first_mask;
+                first_mask = ~0ull;
+                if (stop) {
+                    int bit = __builtin_ctzll(stop);
+                    if ((blocked >> bit) & 1) return -1;
+                    return w * 64 + bit;
+                }
+            }
+        } else {
+            uint64_t first_mask = (from & 63) == 63 ? ~0ull : (1ull << ((from & 63) + 1)) - 1;
+            for (int w = from >> 6; w >= 0; --w) {
+                uint64_t forced = 0;
+                if (side_a) forced |= side_a[w] & ~((side_a[w] >> 1) | (w + 1 < words ? side_a[w + 1] << 63 : 0));
+                if (side_b) forced |= side_b[w] & ~((side_b[w] >> 1) | (w + 1 < words ? side_b[w + 1] << 63 : 0));
+                uint64_t blocked = ~line[w];
+                uint64_t goal_bit = (goal >= 0 && (goal >> 6) == w) ? 1ull << (goal & 63) : 0;
+                uint64_t stop = (blocked | forced | goal_bit) & first_mask;
+                first_mask = ~0ull;
+                if (stop) {
+                    int bit = 63 - __builtin_clzll(stop);
+                    if ((blocked >> bit) & 1) return -1;
+                    return w * 64 + bit;
+                }
+            }
+        }
+        return -1;
+    }
+
+    bool TileMapPathfinder::jump(Vector2i from, Vector2i dir, Vector2i goal, Vector2i &out) const {
+        auto scan_x = [&](int x, int y, int dx) {
+            const uint64_t *line = row_line(y);
+            if (!line) return -1;
+            return scan_line(line, row_line(y - 1), row_line(y + 1), row_words, x, dx, goal.y == y ? goal.x : -1);
+        };
+        auto scan_y = [&](int x, int y, int dy) {
+            const uint64_t *line = col_line(x);
+            if (!line) return -1;
+            return scan_line(line, col_line(x - 1), col_line(x + 1), col_words, y, dy, goal.x == x ? goal.y : -1);
+        };
+
+        if (dir.y == 0) {
+            int x = scan_x(from.x + dir.x, from.y, dir.x);
+            if (x < 0) return false;
+            out = {x, from.y};
+            return true;
+        }
+
+        if (connectivity == Connectivity::Eight && dir.x == 0) {
+            int y = scan_y(from.x, from.y + dir.y, dir.y);
+            if (y < 0) return false;
+            out = {from.x, y};
+            return true;
+        }
+
+        Vector2i p = from + dir;
+        while (true) {
+            if (!walkable(p.x, p.y)) return false;
+            if (p == goal) break;
+
+            if (dir.x == 0) {
+                // Four way vertical jumps also stop wherever a horizontal jump would find something.
+                if ((walkable(p.x - 1, p.y) && !walkable(p.x - 1, p.y - dir.y)) ||
+                    (walkable(p.x + 1, p.y) && !walkable(p.x + 1, p.y - dir.y))) break;
+                if (scan_x(p.x + 1, p.y, 1) >= 0 || scan_x(p.x - 1, p.y, -1) >= 0) break;
+                p.y += dir.y;
+                continue;
+            }
+
+            if (scan_x(p.x + dir.x, p.y, dir.x) >= 0 || scan_y(p.x, p.y + dir.y, dir.y) >= 0) break;
+            if (!walkable(p.x + dir.x, p.y) || !walkable(p.x, p.y + dir.y)) return false;
+            p += dir;
+        }
+        out = p;
+        return true;
+    }
+
+    int TileMapPathfinder::prune_neighbours(Vector2i coord, Vector2i parent, bool has_parent, Vector2i *out) const {
+        int count = 0;
+        int x = coord.x, y = coord.y;
+
+        if (!has_parent) {
+            static const Vector2i cardinals[4] = {{0, 1}, {1, 0}, {0, -1}, {-1, 0}};
+            for (auto dir: cardinals) {
+                if (walkable(x + dir.x, y + dir.y)) out[count++] = coord + dir;
+            }
+            if (connectivity == Connectivity::Eight) {
+                static const Vector2i diagonals[4] = {{1, 1}, {1, -1}, {-1, -1}, {-1, 1}};
+                for (auto dir: diagonals) {
+                    if (walkable(x + dir.x, y) && walkable(x, y + dir.y) && walkable(x + dir.x, y + dir.y)) {
+                        out[count++] = coord + dir;
+                    }
+                }
+            }
+            return count;
+        }
+
+        Vector2i d = step_towards(parent, coord);
+        if (connectivity == Connectivity::Four) {
+            if (d.x != 0) {
+                if (walkable(x, y - 1)) out[count++] = {x, y - 1};
+                if (walkable(x, y + 1)) out[count++] = {x, y + 1};
+                if (walkable(x + d.x, y)) out[count++] = {x + d.x, y};
+            } else {
+                if (walkable(x - 1, y)) out[count++] = {x - 1, y};
+                if (walkable(x + 1, y)) out[count++] = {x + 1, y};
+                if (walkable(x, y + d.y)) out[count++] = {x, y + d.y};
+            }
+            return count;
+        }
+
+        if (d.x != 0 && d.y != 0) {
+            bool next_y = walkable(x, y + d.y);
+            bool next_x = walkable(x + d.x, y);
+            if (next_y) out[count++] = {x, y + d.y};
+            if (next_x) out[count++] = {x + d.x, y};
+            if (next_y && next_x && walkable(x + d.x, y + d.y)) out[count++] = {x + d.x, y + d.y};
+        } else if (d.x != 0) {
+            bool next = walkable(x + d.x, y);
+            bool up = walkable(x, y + 1);
+            bool down = walkable(x, y - 1);
+            if (next) {
+                out[count++] = {x + d.x, y};
+                if (up && walkable(x + d.x, y + 1)) out[count++] = {x + d.x, y + 1};
+                if (down && walkable(x + d.x, y - 1)) out[count++] = {x + d.x, y - 1};
+            }
+            if (up) out[count++] = {x, y + 1};
+            if (down) out[count++] = {x, y - 1};
+        } else {
+            bool next = walkable(x, y + d.y);
+            bool right = walkable(x + 1, y);
+            bool left = walkable(x - 1, y);
+            if (next) {
+                out[count++] = {x, y + d.y};
+                if (right && walkable(x + 1, y + d.y)) out[count++] = {x + 1, y + d.y};
+                if (left && walkable(x - 1, y + d.y)) out[count++] = {x - 1, y + d.y};
+            }
+            if (right) out[count++] = {x + 1, y};
+            if (left) out[count++] = {x - 1, y};
+        }
+        return count;
+    }
+
+    bool TileMapPathfinder::search_jps(Vector2i from, Vector2i to, PathResult &result) const {
+        result.path.clear();
+        result.cost = 0.0f;
+        result.found = false;
+        if (!walkable(from.x, from.y) || !walkable(to.x, to.y)) return false;
+
+        if (from == to) {
+            result.path.push_back(from + origin);
+            result.found = true;
+            return true;
+        }
+
+        Vector2iMap<JumpRecord> records;
+        Vec<Vector2i> coords;// Heap entries refer to jump points by index in here
+        PathHeap open;
+
+        records.insert(from, {0.0f, from, false});
+        coords.push_back(from);
+        open.push({distance(from, to), 0.0f, 0});
+
+        while (!open.is_empty()) {
+            PathHeapEntry entry = open.pop();
+            Vector2i coord = coords[entry.id];
+            JumpRecord *record = records.getptr(coord);
+            if (record->closed || entry.g > record->g) continue;
+            record->closed = true;
+
+            if (coord == to) {
+                Vec<Vector2i> jump_points;
+                Vector2i at = to;
+                while (at != from) {
+                    jump_points.push_back(at);
+                    at = records.get(at).parent;
+                }
+                result.path.push_back(from + origin);
+                Vector2i last = from;
+                for (long i = jump_points.size() - 1; i >= 0; --i) {
+                    append_segment(result.path, last, jump_points[i], origin);
+                    last = jump_points[i];
+                }
+                result.cost = entry.g;
+                result.found = true;
+                return true;
+            }
+
+            Vector2i neighbours[8];
+            int count = prune_neighbours(coord, record->parent, coord != from, neighbours);
+            float g = entry.g;
+
+            for (int i = 0; i < count; ++i) {
+                Vector2i jump_point;
+                if (!jump(coord, step_towards(coord, neighbours[i]), to, jump_point)) continue;
+
+                float next_g = g + distance(coord, jump_point);
+                JumpRecord *existing = records.getptr(jump_point);
+                if (existing) {
+                    if (existing->closed || next_g >= existing->g) continue;
+                    existing->g = next_g;
+                    existing->parent = coord;
+                } else {
+                    records.insert(jump_point, {next_g, coord, false});
+                }
+                coords.push_back(jump_point);
+                open.push({next_g + distance(jump_point, to), next_g, (int) coords.size() - 1});
+            }
+        }
+        return false;
+    }
+
+    void TileMapPathfinder::cluster_distances(int cluster, Vector2i from, float *dist) const {
+        int cx = (cluster % clusters_x) * CLUSTER_SIZE;
+        int cy = (cluster / clusters_x) * CLUSTER_SIZE;
+        int w = math::MIN(CLUSTER_SIZE, width - cx);
+        int h = math::MIN(CLUSTER_SIZE, height - cy);
+
+        for (int i = 0; i < CLUSTER_SIZE * CLUSTER_SIZE; ++i) dist[i] = INFINITY;
+
+        auto inside = [&](int x, int y) {
+            return x >= cx && y >= cy && x < cx + w && y < cy + h && walkable(x, y);
+        };
+
+        // Every cell is pushed at most once per neighbour, so the heap fits on the stack.
+        PathHeapEntry open[CLUSTER_SIZE * CLUSTER_SIZE * 8];
+        long open_size = 0;
+        int start = (from.y - cy) * CLUSTER_SIZE + (from.x - cx);
+        dist[start] = 0.0f;
+        open[open_size++] = {0.0f, 0.0f, start};
+
+        static const Vector2i dirs[8] = {{0, 1}, {1, 0}, {0, -1}, {-1, 0}, {1, 1}, {1, -1}, {-1, -1}, {-1, 1}};
+        int dir_count = connectivity == Connectivity::Eight ? 8 : 4;
+
+        while (open_size > 0) {
+            PathHeapEntry entry = open[0];
+            open[0] = open[--open_size];
+            heap_sift_down(open, open_size);
+            if (entry.f > dist[entry.id]) continue;
+            int x = cx + entry.id % CLUSTER_SIZE;
+            int y = cy + entry.id / CLUSTER_SIZE;
+
+            for (int i = 0; i < dir_count; ++i) {
+                int nx = x + dirs[i].x, ny = y + dirs[i].y;
+                if (!inside(nx, ny)) continue;
+                float step = 1.0f;
+                if (i >= 4) {
+                    if (!inside(nx, y) || !inside(x, ny)) continue;
+                    step = 1.41421356f;
+                }
+                int id = (ny - cy) * CLUSTER_SIZE + (nx - cx);
+                float d = entry.f + step;
+                if (d < dist[id]) {
+                    dist[id] = d;
+                    open[open_size] = {d, d, id};
+                    heap_sift_up(open, open_size++);
+                }
+            }
+        }
+    }
+
+    void TileMapPathfinder::cluster_path(int cluster, const float *dist, Vector2i to, Vec<Vector2i> &cells) const {
+        int cx = (cluster % clusters_x) * CLUSTER_SIZE;
+        int cy = (cluster / clusters_x) * CLUSTER_SIZE;
+        int w = math::MIN(CLUSTER_SIZE, width - cx);
+        int h = math::MIN(CLUSTER_SIZE, height - cy);
+        cells.clear();
+
+        auto inside = [&](int x, int y) {
+            return x >= cx && y >= cy && x < cx + w && y < cy + h && walkable(x, y);
+        };
+
+        static const Vector2i dirs[8] = {{0, 1}, {1, 0}, {0, -1}, {-1, 0}, {1, 1}, {1, -1}, {-1, -1}, {-1, 1}};
+        int dir_count = connectivity == Connectivity::Eight ? 8 : 4;
+
+        // Walks down the distance field from the far end, the best neighbour is always the one the
+        // distance came from
+        Vector2i at = to;
+        while (dist[(at.y - cy) * CLUSTER_SIZE + (at.x - cx)] > 0.0f) {
+            cells.push_back(at);
+            Vector2i best = at;
+            float best_dist = INFINITY;
+            for (int i = 0; i < dir_count; ++i) {
+                int nx = at.x + dirs[i].x, ny = at.y + dirs[i].y;
+                if (!inside(nx, ny)) continue;
+                float step = 1.0f;
+                if (i >= 4) {
+                    if (!inside(nx, at.y) || !inside(at.x, ny)) continue;
+                    step = 1.41421356f;
+                }
+                float d = dist[(ny - cy) * CLUSTER_SIZE + (nx - cx)] + step;
+                if (d < best_dist) {
+                    best_dist = d;
+                    best = Vector2i(nx, ny);
+                }
+            }
+            JV_CORE_ASSERT(best != at, "Broken cluster distances!")
+            at = best;
+        }
+        cells.reverse();
+    }
+
+    int TileMapPathfinder::add_node(Vector2i coord) {
+        int id;
+        if (!free_nodes.is_empty()) {
+            id = free_nodes[free_nodes.size() - 1];
+            free_nodes.resize(free_nodes.size() - 1);
+        } else {
+            id = (int) nodes.size();
+            nodes.resize(id + 1);
+        }
+        AbstractNode &node = nodes[id];
+        node.coord = coord;
+        node.cluster = cluster_of(coord);
+        node.partner = -1;
+        node.edges.clear();
+        node.edge_cells.clear();
+        cluster_nodes[node.cluster].push_back(id);
+        return id;
+    }
+
+    void TileMapPathfinder::clear_border(Vec<int> &border) {
+        for (int id: border) {
+            AbstractNode &node = nodes[id];
+            cluster_nodes[node.cluster].erase(id);
+            node.cluster = -1;
+            node.partner = -1;
+            node.edges.clear();
+            node.edge_cells.clear();
+            free_nodes.push_back(id);
+        }
+        border.clear();
+    }
+
+    void TileMapPathfinder::build_border(int cx, int cy, bool east) {
+        Vec<int> &border = east ? east_borders[(long) cy * clusters_x + cx] : north_borders[(long) cy * clusters_x + cx];
+        clear_border(border);
+        if (east ? cx + 1 >= clusters_x : cy + 1 >= clusters_y) return;
+
+        // Walk the shared edge, finding runs of cells that are open on both sides.
+        int length = east ? math::MIN(CLUSTER_SIZE, height - cy * CLUSTER_SIZE)
+                          : math::MIN(CLUSTER_SIZE, width - cx * CLUSTER_SIZE);
+        auto side = [&](int i, bool far) {
+            if (east) return Vector2i((cx + 1) * CLUSTER_SIZE - 1 + far, cy * CLUSTER_SIZE + i);
+            return Vector2i(cx * CLUSTER_SIZE + i, (cy + 1) * CLUSTER_SIZE - 1 + far);
+        };
+        auto transition = [&](int i) {
+            Vector2i a = side(i, false);
+            Vector2i b = side(i, true);
+            int na = add_node(a);
+            int nb = add_node(b);
+            nodes[na].partner = nb;
+            nodes[nb].partner = na;
+            border.push_back(na);
+            border.push_back(nb);
+        };
+
+        int run_start = -1;
+        for (int i = 0; i <= length; ++i) {
+            bool open = false;
+            if (i < length) {
+                Vector2i a = side(i, false);
+                Vector2i b = side(i, true);
+                open = walkable(a.x, a.y) && walkable(b.x, b.y);
+            }
+            if (open && run_start < 0) {
+                run_start = i;
+            } else if (!open && run_start >= 0) {
+                int run_end = i - 1;
+                if (run_end - run_start + 1 < MAX_SINGLE_ENTRANCE) {
+                    transition((run_start + run_end) / 2);
+                } else {
+                    transition(run_start);
+                    transition(run_end);
+                }
+                run_start = -1;
+            }
+        }
+    }
+
+    void TileMapPathfinder::build_cluster_edges(int cluster) {
+        Vec<int> &members = cluster_nodes[cluster];
+        for (int id: members) {
+            nodes[id].edges.clear();
+            nodes[id].edge_cells.clear();
+        }
+
+        float dist[CLUSTER_SIZE * CLUSTER_SIZE];
+        int cx = (cluster % clusters_x) * CLUSTER_SIZE;
+        int cy = (cluster / clusters_x) * CLUSTER_SIZE;
+
+        // The cells of every edge are kept, so refining a path is copying them instead of searching
+        Vec<Vector2i> cells, back;
+        for (long i = 0; i + 1 < members.size(); ++i) {
+            AbstractNode &from = nodes[members[i]];
+            cluster_distances(cluster, from.coord, dist);
+            for (long j = i + 1; j < members.size(); ++j) {
+                AbstractNode &to = nodes[members[j]];
+                float d = dist[(to.coord.y - cy) * CLUSTER_SIZE + (to.coord.x - cx)];
+                if (d == INFINITY) continue;
+                cluster_path(cluster, dist, to.coord, cells);
+                from.edges.push_back({members[j], d});
+                from.edge_cells.push_back(cells);
+                // Back the other way, ending on the first node. Nodes on a corner can share a cell
+                back.clear();
+                for (long k = cells.size() - 2; k >= 0; --k) back.push_back(cells[k]);
+                if (!cells.is_empty()) back.push_back(from.coord);
+                to.edges.push_back({members[i], d});
+                to.edge_cells.push_back(back);
+            }
+        }
+    }
+
+    void TileMapPathfinder::flush() {
+        JV_TILE_ZONE("TileMapPathfinder::flush");
+        if (!any_dirty) return;
+        any_dirty = false;
+
+        if (!hierarchical) {
+            dirty_clusters.fill(0);
+            return;
+        }
+
+        // Borders of dirty clusters change, which changes the node sets of their neighbours too.
+        Vec<uint8_t> affected;
+        affected.resize(dirty_clusters.size());
+        affected.fill(0);
+
+        for (int cy = 0; cy < clusters_y; ++cy) {
+            for (int cx = 0; cx < clusters_x; ++cx) {
+                if (!dirty_clusters[(long) cy * clusters_x + cx]) continue;
+                build_border(cx, cy, true);
+                build_border(cx, cy, false);
+                if (cx > 0) build_border(cx - 1, cy, true);
+                if (cy > 0) build_border(cx, cy - 1, false);
+
+                affected[(long) cy * clusters_x + cx] = 1;
+                if (cx > 0) affected[(long) cy * clusters_x + cx - 1] = 1;
+                if (cy > 0) affected[(long) (cy - 1) * clusters_x + cx] = 1;
+                if (cx + 1 < clusters_x) affected[(long) cy * clusters_x + cx + 1] = 1;
+                if (cy + 1 < clusters_y) affected[(long) (cy + 1) * clusters_x + cx] = 1;
+            }
+        }
+
+        for (long i = 0; i < affected.size(); ++i) {
+            if (affected[i]) build_cluster_edges((int) i);
+        }
+        dirty_clusters.fill(0);
+        components_dirty = true;
+    }
+
+    void TileMapPathfinder::build_components() {
+        if (!hierarchical || !components_dirty) return;
+        components_dirty = false;
+
+        components.resize(nodes.size());
+        components.fill(-1);
+
+        Vec<int> stack;
+        int component = 0;
+        for (long i = 0; i < nodes.size(); ++i) {
+            if (components[i] >= 0 || nodes[i].cluster < 0) continue;
+            stack.push_back((int) i);
+            components[i] = component;
+            while (!stack.is_empty()) {
+                int id = stack[stack.size() - 1];
+                stack.resize(stack.size() - 1);
+                const AbstractNode &node = nodes[id];
+                if (node.partner >= 0 && components[node.partner] < 0) {
+                    components[node.partner] = component;
+                    stack.push_back(node.partner);
+                }
+                for (auto &edge: node.edges) {
+                    if (components[edge.to] >= 0) continue;
+                    components[edge.to] = component;
+                    stack.push_back(edge.to);
+                }
+            }
+            component++;
+        }
+    }
+
+    bool TileMapPathfinder::search_hierarchical(Vector2i from, Vector2i to, PathResult &result, AbstractScratch &state) const {
+        result.path.clear();
+        result.cost = 0.0f;
+        result.found = false;
+        if (!walkable(from.x, from.y) || !walkable(to.x, to.y)) return false;
+
+        int start_cluster = cluster_of(from);
+        int goal_cluster = cluster_of(to);
+        if (start_cluster == goal_cluster) return search_jps(from, to, result);
+
+        // The start and goal are linked into the abstract graph as two extra nodes that only
+        // exist for this query, so queries never modify the graph and can run in parallel.
+        int start_id = (int) nodes.size();
+        int goal_id = start_id + 1;
+
+        float dist[CLUSTER_SIZE * CLUSTER_SIZE];
+        Vec<AbstractEdge> start_edges;
+        Vec<AbstractEdge> goal_edges;
+
+        auto link = [&](int cluster, Vector2i coord, Vec<AbstractEdge> &edges) {
+            cluster_distances(cluster, coord, dist);
+            int cx = (cluster % clusters_x) * CLUSTER_SIZE;
+            int cy = (cluster / clusters_x) * CLUSTER_SIZE;
+            for (int id: cluster_nodes[cluster]) {
+                Vector2i c = nodes[id].coord;
+                float d = dist[(c.y - cy) * CLUSTER_SIZE + (c.x - cx)];
+                if (d != INFINITY) edges.push_back({id, d});
+            }
+        };
+        link(start_cluster, from, start_edges);
+        link(goal_cluster, to, goal_edges);
+        if (start_edges.is_empty() || goal_edges.is_empty()) return false;
+
+        bool reachable = false;
+        for (auto &a: start_edges) {
+            for (auto &b: goal_edges) reachable |= components[a.to] == components[b.to];
+        }
+        if (!reachable) return false;
+
+        auto coord_of = [&](int id) {
+            if (id == start_id) return from;
+            if (id == goal_id) return to;
+            return nodes[id].coord;
+        };
+
+        if (state.records.size() < goal_id + 1) state.records.resize(goal_id + 1);
+        if (++state.stamp == 0) {
+            for (auto &record: state.records) record.stamp = 0;
+            state.stamp = 1;
+        }
+        AbstractRecord *records = state.records.ptrw();
+        auto record_of = [&](int id) -> AbstractRecord & {
+            AbstractRecord &record = records[id];
+            if (record.stamp != state.stamp) record = {INFINITY, -1, false, state.stamp};
+            return record;
+        };
+
+        PathHeap open;
+        record_of(start_id).g = 0.0f;
+        open.push({distance(from, to), 0.0f, start_id});
+
+        auto relax = [&](int node, int next, float next_g) {
+            AbstractRecord &record = record_of(next);
+            if (record.closed || next_g >= record.g) return;
+            record.g = next_g;
+            record.parent = node;
+            open.push({next_g + distance(coord_of(next), to), next_g, next});
+        };
+
+        bool found = false;
+        while (!open.is_empty()) {
+            PathHeapEntry entry = open.pop();
+            AbstractRecord &record = record_of(entry.id);
+            if (record.closed || entry.g > record.g) continue;
+            record.closed = true;
+
+            if (entry.id == goal_id) {
+                result.cost = entry.g;
+                found = true;
+                break;
+            }
+
+            if (entry.id == start_id) {
+                for (auto &edge: start_edges) relax(entry.id, edge.to, entry.g + edge.cost);
+                continue;
+            }
+
+            const AbstractNode &node = nodes[entry.id];
+            for (auto &edge: node.edges) relax(entry.id, edge.to, entry.g + edge.cost);
+            if (node.partner >= 0) relax(entry.id, node.partner, entry.g + 1.0f);
+            if (node.cluster == goal_cluster) {
+                for (auto &edge: goal_edges) {
+                    if (edge.to == entry.id) relax(entry.id, goal_id, entry.g + edge.cost);
+                }
+            }
+        }
+        if (!found) return false;
+
+        Vec<int> ids;
+        for (int at = goal_id; at != -1; at = records[at].parent) ids.push_back(at);
+        ids.reverse();
+
+        if (!refine_paths) {
+            for (int id: ids) result.path.push_back(coord_of(id) + origin);
+            result.found = true;
+            return true;
+        }
+
+        // Only the legs to and from the query's own cells need searching, and they stay inside one
+        // cluster. Border crossings are one step and the edges between nodes carry their cells.
+        result.path.push_back(from + origin);
+        PathResult leg;
+        for (long i = 1; i < ids.size(); ++i) {
+            Vector2i a = coord_of(ids[i - 1]);
+            Vector2i b = coord_of(ids[i]);
+            if (a == b) continue;
+            const Vec<Vector2i> *cells = nullptr;
+            if (ids[i - 1] != start_id && ids[i] != goal_id) {
+                const AbstractNode &node = nodes[ids[i - 1]];
+                for (long k = 0; k < node.edges.size(); ++k) {
+                    if (node.edges[k].to == ids[i]) cells = &node.edge_cells[k];
+                }
+            }
+            if (cells) {
+                for (auto cell: *cells) result.path.push_back(cell + origin);
+            } else if (ids[i - 1] != start_id && ids[i] != goal_id && nodes[ids[i - 1]].partner == ids[i]) {
+                result.path.push_back(b + origin);
+            } else {
+                if (!search_jps(a, b, leg)) return false;
+                for (long j = 1; j < leg.path.size(); ++j) result.path.push_back(leg.path[j]);
+            }
+        }
+        result.found = true;
+        return true;
+    }
+
+    bool TileMapPathfinder::search(Vector2i from, Vector2i to, PathResult &result, AbstractScratch &state) const {
+        from -= origin;
+        to -= origin;
+        if (hierarchical) return search_hierarchical(from, to, result, state);
+        return search_jps(from, to, result);
+    }
+
+    bool TileMapPathfinder::find_path(Vector2i from, Vector2i to, PathResult &result) {
+        JV_TILE_ZONE("TileMapPathfinder::find_path");
+        flush();
+        build_components();
+        return search(from, to, result, scratch);
+    }
+
+    void TileMapPathfinder::find_paths(const Vec<PathQuery> &queries, Vec<PathResult> &results, int threads) {
+        JV_TILE_ZONE("TileMapPathfinder::find_paths");
+        flush();
+        build_components();
+        results.resize(queries.size());
+        PathResult *out = results.ptrw();
+        const PathQuery *in = queries.ptr();
+        long count = queries.size();
+
+        threads = math::CLAMP(threads, 1, (int) math::MAX(count, (long) 1));
+        if (threads == 1) {
+            for (long i = 0; i < count; ++i) search(in[i].from, in[i].to, out[i], scratch);
+            return;
+        }
+
+        Vec<std::thread *> workers;
+        for (int t = 0; t < threads; ++t) {
+            long begin = count * t / threads;
+            long end = count * (t + 1) / threads;
+            workers.push_back(new std::thread([this, in, out, begin, end]() {
+                AbstractScratch state;
+                for (long i = begin; i < end; ++i) search(in[i].from, in[i].to, out[i], state);
+            }));
+        }
+        for (auto worker: workers) {
+            worker->join();
+            delete worker;
+        }
+    }
+
+#endif
+
+}// namespace jovial
@@ -0,0 +1,464 @@
+#pragma once
+
+#include "JovialTileMap.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+namespace jovial {
+
+    // RGBA8 pixels, red in the low byte, rows top to bottom
+    struct TileImage {
+        int width = 0;
+        int height = 0;
+        Vec<uint32_t> pixels;
+
+        inline void reset(int width, int height) {
+            this->width = width;
+            this->height = height;
+            pixels.clear();
+            pixels.resize((long) width * height);
+            pixels.fill(0);
+        }
+    };
+
+    // Draws maps into images on the CPU, for level select thumbnails and the asset pipeline, from the
+    // atlas pixels kept by Tileset::set_pixels(). Rows of chunks are split over threads and every tile
+    // is a row by row copy of a prebuilt, box filtered mip of its atlas tile.
+    class TileMapRenderer {
+    public:
+        // Draws the inclusive coord rect with mip level level of the tiles, 0 for the atlas size and
+        // every level after that half as big, down to a pixel. The map is y up, so the top row of the
+        // image is row to.y, as draw() shows it. Empty cells stay transparent.
+        static bool render(const TileMap *map, Vector2i from, Vector2i to, int level, TileImage &out, int threads = 0);
+
+        // Fits the inclusive coord rect into max_size x max_size. Tiles are drawn whole at the biggest mip
+        // level that fits, and once a tile would be smaller than a pixel every pixel averages a square of cells.
+        static bool thumbnail(const TileMap *map, Vector2i from, Vector2i to, int max_size, TileImage &out, int threads = 0);
+
+        static bool write_png(const fs::Path &path, const TileImage &image);
+
+        // Every atlas tile at one size, one after the other
+        struct Mips {
+            int width = 0;
+            int height = 0;
+            Vec<uint32_t> pixels;
+            Vector2iMap<long> offset_of;
+        };
+
+        static bool build_mips(const Tileset *tileset, int width, int height, Mips &mips);
+
+        // Copies the mips of the chunk's tiles in columns x0 to x1 of rows y0 to y1, the top left of cell
+        // (x0, y1) going to dest and lower rows further down the image, the way the map is drawn.
+        // Cells that are empty or not in the atlas are left as they are.
+        static void draw_chunk(const TileStorage::Chunk *chunk, const Mips &mips, int x0, int x1, int y0, int y1, uint32_t *dest, long stride);
+
+    private:
+        static bool average_cells(const TileMap *map, Vector2i from, int cells_w, int cells_h, int cells_per_pixel, TileImage &out, int threads);
+
+        // Premultiplied, so transparent texels don't darken what they are averaged with
+        static inline void add_texel(uint64_t *sum, uint32_t texel, uint64_t weight = 1) {
+            uint64_t a = texel >> 24;
+            sum[0] += (texel & 0xFF) * a * weight;
+            sum[1] += (texel >> 8 & 0xFF) * a * weight;
+            sum[2] += (texel >> 16 & 0xFF) * a * weight;
+            sum[3] += a * weight;
+        }
+
+        static inline uint32_t average(const uint64_t *sum, uint64_t count) {
+            if (!sum[3]) return 0;
+            auto r = (uint32_t) (sum[0] / sum[3]), g = (uint32_t) (sum[1] / sum[3]), b = (uint32_t) (sum[2] / sum[3]);
+            auto a = (uint32_t) ((sum[3] + count / 2) / count);
+            return r | g << 8 | b << 16 | a << 24;
+        }
+
+        static inline int thread_count(int threads) {
+            return threads > 0 ? threads : (int) math::MAX(std::thread::hardware_concurrency(), 1u);
+        }
+
+        // Calls fn(i) for every i < count, handing out indices over threads
+        template<typename Fn>
+        static void parallel_for(long count, int threads, Fn &&fn) {
+            std::atomic<long> next{0};
+            auto work = [&]() {
+                for (long i = next.fetch_add(1, std::memory_order_relaxed); i < count; i = next.fetch_add(1, std::memory_order_relaxed)) {
+                    fn(i);
+                }
+            };
+
+            Vec<std::thread *> workers;
+            for (int t = 1; t < math::MIN((long) threads, count); ++t) workers.push_back(new std::thread(work));
+            work();
+            for (auto worker: workers) {
+                worker->join();
+                delete worker;
+            }
+        }
+
+        static void deflate(const uint8_t *data, long size, Vec<uint8_t> &out);
+        static uint32_t crc32(const uint8_t *data, long size, uint32_t crc = 0);
+        static void write_chunk(FILE *file, const char *type, const uint8_t *data, long size, bool &ok);
+    };
+
+#ifdef JOVIAL_TILEMAP_IMPLEMENTATION
+
+    bool TileMapRenderer::build_mips(const Tileset *tileset, int width, int height, Mips &mips) {
+        if (!tileset || tileset->pixels.is_empty()) {
+            JV_CORE_ERROR("The tileset has no pixels to render with, see Tileset::set_pixels");
+            return false;
+        }
+        mips.width = width;
+        mips.height = height;
+        mips.pixels.clear();
+        mips.pixels.resize(tileset->tile_uvs.size() * width * height);
+        mips.offset_of.clear();
+        mips.offset_of.reserve(tileset->tile_uvs.size());
+
+        int tile_w = (int) tileset->tile_size.x, tile_h = (int) tileset->tile_size.y;
+        long offset = 0;
+        for (auto &tile: tileset->tile_uvs) {
+            Vector2 uv = tile.value.min_pos();
+            int x0 = (int) (uv.x * (float) tileset->pixels_width + 0.5f);
+            int y0 = (int) (uv.y * (float) tileset->pixels_height + 0.5f);
+            uint32_t *dest = mips.pixels.ptrw() + offset;
+            for (int y = 0; y < height; ++y) {
+                int sy0 = y * tile_h / height, sy1 = math::MAX((y + 1) * tile_h / height, sy0 + 1);
+                for (int x = 0; x < width; ++x) {
+                    int sx0 = x * tile_w / width, sx1 = math::MAX((x + 1) * tile_w / width, sx0 + 1);
+                    uint64_t sum[4] = {};
+                    for (int sy = sy0; sy < sy1; ++sy) {
+                        int py = math::CLAMP(y0 + sy, 0, tileset->pixels_height - 1);
+                        for (int sx = sx0; sx < sx1; ++sx) {
+                            int px = math::CLAMP(x0 + sx, 0, tileset->pixels_width - 1);
+                            add_texel(sum, tileset->pixels[(long) py * tileset->pixels_width + px]);
+                        }
+                    }
+                    dest[y * width + x] = average(sum, (uint64_t) (sx1 - sx0) * (sy1 - sy0));
+                }
+            }
+            mips.offset_of.insert(tile.key, offset);
+            offset += (long) width * height;
+        }
+        return true;
+    }
+
+    bool TileMapRenderer::render(const TileMap *map, Vector2i from, Vector2i to, int level, TileImage &out, int threads) {
+        JV_TILE_ZONE("TileMapRenderer::render");
+        Vector2i min(math::MIN(from.x, to.x), math::MIN(from.y, to.y));
+        Vector2i max(math::MAX(from.x, to.x), math::MAX(from.y, to.y));
+        const Tileset *tileset = map->tileset;
+        if (!tileset) return false;
+
+        Mips mips;
+        int tile_w = math::MAX((int) tileset->tile_size.x >> level, 1);
+        int tile_h = math::MAX((int) tileset->tile_size.y >> level, 1);
+        if (!build_mips(tileset, tile_w, tile_h, mips)) return false;
+
+        int cells_w = max.x - min.x + 1, cells_h = max.y - min.y + 1;
+        out.reset(cells_w * tile_w, cells_h * tile_h);
+
+        // A band is one row of chunks, no two threads write the same pixels
+        Vector2i chunk_min = TileStorage::chunk_of(min), chunk_max = TileStorage::chunk_of(max);
+        parallel_for(chunk_max.y - chunk_min.y + 1, thread_count(threads), [&](long band) {
+            JV_TILE_ZONE("TileMapRenderer band");
+            int cy = chunk_min.y + (int) band;
+            int y0 = math::MAX(min.y - cy * TileStorage::CHUNK_SIZE, 0);
+            int y1 = math::MIN(max.y - cy * TileStorage::CHUNK_SIZE, TileStorage::CHUNK_MASK);
+            long out_y = (long) (max.y - (cy * TileStorage::CHUNK_SIZE + y1)) * tile_h;
+
+            for (int cx = chunk_min.x; cx <= chunk_max.x; ++cx) {
+                const TileStorage::Chunk *chunk = map->tiles.find_chunk({cx, cy});
+                if (!chunk) continue;
+                int x0 = math::MAX(min.x - cx * TileStorage::CHUNK_SIZE, 0);
+                int x1 = math::MIN(max.x - cx * TileStorage::CHUNK_SIZE, TileStorage::CHUNK_MASK);
+                long out_x = (long) (cx * TileStorage::CHUNK_SIZE + x0 - min.x) * tile_w;
+                draw_chunk(chunk, mips, x0, x1, y0, y1, out.pixels.ptrw() + out_y * out.width + out_x, out.width);
+            }
+        });
+        return true;
+    }
+
+    void TileMapRenderer::draw_chunk(const TileStorage::Chunk *chunk, const Mips &mips, int x0, int x1, int y0, int y1, uint32_t *dest, long stride) {
+        uint32_t columns = (x1 == TileStorage::CHUNK_MASK ? UINT32_MAX : (1u << (x1 + 1)) - 1) & ~((1u << x0) - 1);
+        Vector2i last_tile(INT32_MIN, INT32_MIN);
+        const uint32_t *last_mip = nullptr;
+        for (int y = y0; y <= y1; ++y) {
+            uint32_t *dest_row = dest + (long) (y1 - y) * mips.height * stride;
+            for (uint32_t bits = chunk->rows[y] & columns; bits; bits &= bits - 1) {
+                int x = __builtin_ctz(bits);
+                Vector2i tile = chunk->get(x, y);
+                if (tile != last_tile) {
+                    last_tile = tile;
+                    long offset;
+                    last_mip = mips.offset_of.get_if_contains(tile, offset) ? mips.pixels.ptr() + offset : nullptr;
+                }
+                if (!last_mip) continue;// Not in the atlas, like draw() it has nothing to show
+
+                uint32_t *tile_dest = dest_row + (long) (x - x0) * mips.width;
+                for (int row = 0; row < mips.height; ++row) {
+                    memcpy(tile_dest + row * stride, last_mip + row * mips.width, sizeof(uint32_t) * mips.width);
+                }
+            }
+        }
+    }
+
+    bool TileMapRenderer::thumbnail(const TileMap *map, Vector2i from, Vector2i to, int max_size, TileImage &out, int threads) {
+        JV_TILE_ZONE("TileMapRenderer::thumbnail");
+        Vector2i min(math::MIN(from.x, to.x), math::MIN(from.y, to.y));
+        Vector2i max(math::MAX(from.x, to.x), math::MAX(from.y, to.y));
+        if (!map->tileset || max_size <= 0) return false;
+
+        int cells_w = max.x - min.x + 1, cells_h = max.y - min.y + 1;
+        int cells = math::MAX(cells_w, cells_h);
+        int budget = max_size / cells;// Pixels a tile can have
+        if (budget >= 1) {
+            int tile_w = (int) map->tileset->tile_size.x, tile_h = (int) map->tileset->tile_size.y;
+            int level = 0;
+            while ((tile_w >> level) > budget || (tile_h >> level) > budget) ++level;
+            return render(map, min, max, level, out, threads);
+        }
+        return average_cells(map, min, cells_w, cells_h, (cells + max_size - 1) / max_size, out, threads);
+    }
+
+    bool TileMapRenderer::average_cells(const TileMap *map, Vector2i from, int cells_w, int cells_h, int cells_per_pixel, TileImage &out, int threads) {
+        // Every tile as its average color
+        Mips mips;
+        if (!build_mips(map->tileset, 1, 1, mips)) return false;
+
+        int step = cells_per_pixel;
+        out.reset((cells_w + step - 1) / step, (cells_h + step - 1) / step);
+        Vector2i to = from + Vector2i(cells_w - 1, cells_h - 1);
+
+        parallel_for(out.height, thread_count(threads), [&](long out_y) {
+            JV_TILE_ZONE("TileMapRenderer band");
+            Vec<uint64_t> sums;
+            sums.resize((long) out.width * 4);
+            sums.fill(0);
+
+            // Pixel rows go down the map from its top row, to.y
+            int band_max = to.y - (int) out_y * step, band_min = math::MAX(band_max - step + 1, from.y);
+            Vector2i last_tile(INT32_MIN, INT32_MIN);
+            uint32_t last_color = 0;
+            bool last_found = false;
+            for (int cy = TileStorage::chunk_of({from.x, band_min}).y; cy <= TileStorage::chunk_of({from.x, band_max}).y; ++cy) {
+                int y0 = math::MAX(band_min - cy * TileStorage::CHUNK_SIZE, 0);
+                int y1 = math::MIN(band_max - cy * TileStorage::CHUNK_SIZE, TileStorage::CHUNK_MASK);
+                for (int cx = TileStorage::chunk_of(from).x; cx <= TileStorage::chunk_of(to).x; ++cx) {
+                    const TileStorage::Chunk *chunk = map->tiles.find_chunk({cx, cy});
+                    if (!chunk) continue;
+                    int x0 = math::MAX(from.x - cx * TileStorage::CHUNK_SIZE, 0);
+                    int x1 = math::MIN(to.x - cx * TileStorage::CHUNK_SIZE, TileStorage::CHUNK_MASK);
+                    uint32_t columns = (x1 == TileStorage::CHUNK_MASK ? UINT32_MAX : (1u << (x1 + 1)) - 1) & ~((1u << x0) - 1);
+                    int base_x = cx * TileStorage::CHUNK_SIZE - from.x;
+
+                    if (chunk->kind == TileStorage::Chunk::Uniform) {
+                        // One color, only how many cells land in each pixel matters
+                        long offset;
+                        if (!mips.offset_of.get_if_contains(chunk->uniform, offset)) continue;
+                        uint32_t color = mips.pixels[offset];
+                        int rows = y1 - y0 + 1;
+                        for (int x = x0; x <= x1;) {
+                            int px = (base_x + x) / step;
+                            int end = math::MIN(x1, (px + 1) * step - 1 - base_x);
+                            add_texel(sums.ptrw() + (long) px * 4, color, (uint64_t) rows * (end - x + 1));
+                            x = end + 1;
+                        }
+                        continue;
+                    }
+
+                    for (int y = y0; y <= y1; ++y) {
+                        for (uint32_t bits = chunk->rows[y] & columns; bits; bits &= bits - 1) {
+                            int x = __builtin_ctz(bits);
+                            Vector2i tile = chunk->tiles[y * TileStorage::CHUNK_SIZE + x];
+                            if (tile != last_tile) {
+                                last_tile = tile;
+                                long offset;
+                                last_found = mips.offset_of.get_if_contains(tile, offset);
+                                if (last_found) last_color = mips.pixels[offset];
+                            }
+                            if (last_found) add_texel(sums.ptrw() + (long) ((base_x + x) / step) * 4, last_color);
+                        }
+                    }
+                }
+            }
+
+            // Empty cells count as transparent, edge pixels only average the cells they have
+            int band_h = band_max - band_min + 1;
+            uint32_t *dest = out.pixels.ptrw() + out_y * out.width;
+            for (int px = 0; px < out.width; ++px) {
+                int band_w = math::MIN(step, cells_w - px * step);
+                dest[px] = average(sums.ptr() + (long) px * 4, (uint64_t) band_w * band_h);
+            }
+        });
+        return true;
+    }
+
+    uint32_t TileMapRenderer::crc32(const uint8_t *data, long size, uint32_t crc) {
+        static const auto table = []() {
+            Array<uint32_t, 256> t{};
+            for (uint32_t n = 0; n < 256; ++n) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; ++k) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                t[n] = c;
+            }
+            return t;
+        }();
+        crc = ~crc;
+        for (long i = 0; i < size; ++i) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    void TileMapRenderer::deflate(const uint8_t *data, long size, Vec<uint8_t> &out) {
+        // One final block with the fixed Huffman codes and greedy matches from a one entry hash table,
+        // like lz::compress. Tile images repeat a lot, that gets most of the way for a fraction of zlib's code.
+        static const int LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const int LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static const int DIST_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+        static const int DIST_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+        static constexpr int HASH_BITS = 15;
+        static constexpr long WINDOW = 32768;
+
+        uint64_t bit_buffer = 0;
+        int bit_count = 0;
+        auto put_bits = [&](uint32_t bits, int count) {
+            bit_buffer |= (uint64_t) bits << bit_count;
+            bit_count += count;
+            while (bit_count >= 8) {
+                out.push_back((uint8_t) bit_buffer);
+                bit_buffer >>= 8;
+                bit_count -= 8;
+            }
+        };
+        // Huffman codes go out most significant bit first
+        auto put_code = [&](uint32_t code, int length) {
+            uint32_t reversed = 0;
+            for (int i = 0; i < length; ++i) reversed |= (code >> i & 1) << (length - 1 - i);
+            put_bits(reversed, length);
+        };
+        auto put_symbol = [&](int symbol) {
+            if (symbol < 144) put_code(0x30 + symbol, 8);
+            else if (symbol < 256) put_code(0x190 + symbol - 144, 9);
+            else if (symbol < 280) put_code(symbol - 256, 7);
+            else put_code(0xC0 + symbol - 280, 8);
+        };
+
+        put_bits(1, 1);// Final block
+        put_bits(1, 2);// Fixed codes
+
+        Vec<long> table;
+        table.resize(1 << HASH_BITS);
+        table.fill(-1);
+        auto hash = [&](long at) {
+            uint32_t v;
+            memcpy(&v, data + at, 4);
+            return (v * 2654435761u) >> (32 - HASH_BITS);
+        };
+
+        long at = 0;
+        while (at < size) {
+            long best_length = 0, distance = 0;
+            if (at + 4 <= size) {
+                uint32_t h = hash(at);
+                long candidate = table[h];
+                table[h] = at;
+                if (candidate >= 0 && at - candidate <= WINDOW && memcmp(data + candidate, data + at, 4) == 0) {
+                    long limit = math::MIN(size - at, 258l);
+                    best_length = 4;
+                    while (best_length < limit && data[candidate + best_length] == data[at + best_length]) ++best_length;
+                    distance = at - candidate;
+                }
+            }
+
+            if (!best_length) {
+                put_symbol(data[at++]);
+                continue;
+            }
+
+            int code = 28;
+            while (LENGTH_BASE[code] > best_length) --code;
+            put_symbol(257 + code);
+            put_bits((uint32_t) (best_length - LENGTH_BASE[code]), LENGTH_EXTRA[code]);
+            int dist_code = 29;
+            while (DIST_BASE[dist_code] > distance) --dist_code;
+            put_code((uint32_t) dist_code, 5);
+            put_bits((uint32_t) (distance - DIST_BASE[dist_code]), DIST_EXTRA[dist_code]);
+
+            // Only the positions inside the match that start long repeats are worth hashing
+            long end = at + best_length;
+            for (at += 1; at < end; ++at) {
+                if (at + 4 <= size && (at & 3) == 0) table[hash(at)] = at;
+            }
+        }
+        put_symbol(256);
+        if (bit_count) put_bits(0, 8 - bit_count);
+    }
+
+    void TileMapRenderer::write_chunk(FILE *file, const char *type, const uint8_t *data, long size, bool &ok) {
+        uint8_t head[8] = {(uint8_t) (size >> 24), (uint8_t) (size >> 16), (uint8_t) (size >> 8), (uint8_t) size,
+                           (uint8_t) type[0], (uint8_t) type[1], (uint8_t) type[2], (uint8_t) type[3]};
+        uint32_t crc = crc32(data, size, crc32(head + 4, 4));
+        uint8_t tail[4] = {(uint8_t) (crc >> 24), (uint8_t) (crc >> 16), (uint8_t) (crc >> 8), (uint8_t) crc};
+        ok = ok && std::fwrite(head, 1, 8, file) == 8;
+        ok = ok && (size == 0 || std::fwrite(data, 1, size, file) == (size_t) size);
+        ok = ok && std::fwrite(tail, 1, 4, file) == 4;
+    }
+
+    bool TileMapRenderer::write_png(const fs::Path &path, const TileImage &image) {
+        JV_TILE_ZONE("TileMapRenderer::write_png");
+        if (image.width <= 0 || image.height <= 0) return false;
+
+        // Every scanline gets the Sub or Up filter, whichever leaves smaller bytes (libpng's heuristic)
+        long stride = (long) image.width * 4;
+        Vec<uint8_t> raw;
+        raw.resize((stride + 1) * image.height);
+        auto *pixels = (const uint8_t *) image.pixels.ptr();
+        for (int y = 0; y < image.height; ++y) {
+            const uint8_t *row = pixels + y * stride, *above = y ? row - stride : nullptr;
+            uint8_t *dest = raw.ptrw() + y * (stride + 1);
+            auto cost = [](uint8_t filtered) {
+                return (long) std::abs((int) (int8_t) filtered);
+            };
+            long sub_cost = 0, up_cost = 0;
+            for (long i = 0; i < stride; ++i) {
+                sub_cost += cost(row[i] - (i >= 4 ? row[i - 4] : 0));
+                if (above) up_cost += cost(row[i] - above[i]);
+            }
+            bool up = above && up_cost < sub_cost;
+            dest[0] = up ? 2 : 1;
+            for (long i = 0; i < stride; ++i) dest[i + 1] = (uint8_t) (row[i] - (up ? above[i] : i >= 4 ? row[i - 4] : 0));
+        }
+
+        Vec<uint8_t> zlib;
+        zlib.push_back(0x78);
+        zlib.push_back(0x01);
+        deflate(raw.ptr(), raw.size(), zlib);
+        uint32_t a = 1, b = 0;
+        for (long i = 0; i < raw.size(); ++i) {
+            a = (a + raw[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        uint32_t adler = b << 16 | a;
+        for (int shift = 24; shift >= 0; shift -= 8) zlib.push_back((uint8_t) (adler >> shift));
+
+        FILE *file = std::fopen(path.c_str(), "wb");
+        if (!file) {
+            JV_CORE_ERROR("Could not open ", path.c_str(), " for the map image");
+            return false;
+        }
+        static const uint8_t SIGNATURE[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        uint8_t header[13] = {(uint8_t) (image.width >> 24), (uint8_t) (image.width >> 16), (uint8_t) (image.width >> 8), (uint8_t) image.width,
+                              (uint8_t) (image.height >> 24), (uint8_t) (image.height >> 16), (uint8_t) (image.height >> 8), (uint8_t) image.height,
+                              8, 6, 0, 0, 0};// 8 bit RGBA, no interlacing
+        bool ok = std::fwrite(SIGNATURE, 1, 8, file) == 8;
+        write_chunk(file, "IHDR", header, 13, ok);
+        write_chunk(file, "IDAT", zlib.ptr(), zlib.size(), ok);
+        write_chunk(file, "IEND", nullptr, 0, ok);
+        ok = std::fclose(file) == 0 && ok;
+        if (!ok) JV_CORE_ERROR("Could not write the map image to ", path.c_str());
+        return ok;
+    }
+
+#endif
+
+}// namespace jovial
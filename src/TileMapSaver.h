@@ -0,0 +1,196 @@
+#pragma once
+
+#include "Jovial/Core/Logger.h"
+#include "Jovial/JovialEngine.h"
+#include "Jovial/SavingLoading/Jon.h"
+#include "JovialTileMap.h"
+#include "TileMapFile.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+namespace jovial {
+
+    // What a save writes, copied from the map on the calling thread
+    struct TileMapSnapshot {
+        Vector2 tile_size;
+        const char *table_name = nullptr;// Saved under this key, the policy's TABLE_NAME
+        Vec<Vector2i> table;             // Auto tile table in entry order
+        TileStorage tiles;
+        std::atomic<long> *progress = nullptr;
+    };
+
+    namespace jon {
+        template<>
+        struct JonObject<TileMapSnapshot *> {
+            static String save(Generator &generator, TileMapSnapshot *v);
+        };
+    }// namespace jon
+
+    // Saves an auto tiled (wang or blob) map on a worker thread, as jon or as a chunked TileMapFile. save() only takes
+    // a snapshot on the calling thread, which copies chunk pointers and not tiles, so the frame
+    // doesn't wait on serializing or on the disk. The file is written next to the target and renamed over it once
+    // complete, so a crash mid save never leaves a truncated map behind.
+    class TileMapSaver {
+    public:
+        enum class Status {
+            Idle,
+            Serializing,
+            Writing,
+            Saved,
+            Failed,
+        };
+
+        enum class Format {
+            Jon,
+            Chunked,// TileMapFile, compressed chunks encoded over every core
+        };
+
+        // Seconds between autosaves in update(), 0 turns autosaving off
+        float autosave_interval = 60.0f;
+        Format format = Format::Jon;
+
+        TileMapSaver() = default;
+        TileMapSaver(const TileMapSaver &other) = delete;
+        TileMapSaver &operator=(const TileMapSaver &other) = delete;
+
+        ~TileMapSaver() {
+            wait();
+        }
+
+        // Returns false if the previous save is still running
+        bool save(const AnyAutoTileMap &map, const fs::Path &path);
+
+        // Call every frame, cleans up finished saves and autosaves the map if it changed since the last save
+        void update(const AnyAutoTileMap &map, const fs::Path &path);
+
+        inline void wait() {
+            if (!worker) return;
+            worker->join();
+            delete worker;
+            worker = nullptr;
+        }
+
+        [[nodiscard]] inline Status get_status() const {
+            return status.load(std::memory_order_acquire);
+        }
+
+        [[nodiscard]] inline bool is_saving() const {
+            Status current = get_status();
+            return current == Status::Serializing || current == Status::Writing;
+        }
+
+        // Fraction of the tiles (or chunks) serialized so far
+        [[nodiscard]] inline float get_progress() const {
+            return total ? (float) written.load(std::memory_order_relaxed) / (float) total : 1.0f;
+        }
+
+    private:
+        std::thread *worker = nullptr;
+        std::atomic<Status> status{Status::Idle};
+        std::atomic<long> written{0};
+        long total = 0;
+        TileStorage last_saved;
+        std::chrono::steady_clock::time_point last_save_time = std::chrono::steady_clock::now();
+    };
+
+#ifdef JOVIAL_TILEMAP_IMPLEMENTATION
+
+    namespace jon {
+        String JonObject<TileMapSnapshot *>::save(Generator &generator, TileMapSnapshot *v) {
+            String res;
+            res += generator.push_object();
+
+            res += generator.save_str("size", v->tile_size);
+            res += generator.get_indent();
+            res += v->table_name;
+            res += " ";
+            res += generator.push_array();
+            res += "\n";
+            for (auto tile: v->table) {
+                res += generator.get_indent();
+                res += JonObject<Vector2i>::save(generator, tile);
+                res += "\n";
+            }
+            res += generator.pop_array();
+            res += "\n";
+
+            res += save_tiles(generator, v->tiles, v->progress);
+            res += generator.pop_object();
+            return res;
+        }
+    }// namespace jon
+
+    bool TileMapSaver::save(const AnyAutoTileMap &map, const fs::Path &path) {
+        JV_TILE_ZONE("TileMapSaver::save");
+        if (is_saving()) return false;
+        wait();
+
+        // Only what the file needs, the tiles are shared with the map until it writes to them
+        auto *snapshot = new TileMapSnapshot();
+        snapshot->tile_size = map->tile_size;
+        snapshot->table_name = map.table_name;
+        for (int i = 0; i < map.table_size; ++i) snapshot->table.push_back(map[map.mask_at(i)]);
+        snapshot->tiles = map->tiles.snapshot();
+        snapshot->progress = &written;
+        last_saved = snapshot->tiles;
+        last_save_time = std::chrono::steady_clock::now();
+
+        total = format == Format::Chunked ? snapshot->tiles.chunk_count() : snapshot->tiles.size();
+        written.store(0, std::memory_order_relaxed);
+        status.store(Status::Serializing, std::memory_order_release);
+
+        worker = new std::thread([this, snapshot, path, chunked = format == Format::Chunked]() {
+            JV_TILE_ZONE("TileMapSaver worker");
+            fs::Path temp = path + ".tmp";
+            bool saved;
+            if (chunked) {
+                // Encodes over every core first, so there is no separate writing step to report
+                TileMapFile::Header header;
+                header.tile_size = snapshot->tile_size;
+                header.table = snapshot->table;
+                saved = TileMapFile::write(temp, header, snapshot->tiles, 0, &written);
+                delete snapshot;
+            } else {
+                jon::Generator generator;
+                generator.save("tilemap", snapshot);
+                delete snapshot;
+
+                status.store(Status::Writing, std::memory_order_release);
+                saved = generator.generate(temp);
+            }
+            if (saved && std::rename(temp.c_str(), path.c_str()) != 0) {
+                // Windows won't rename over an existing file
+                std::remove(path.c_str());
+                saved = std::rename(temp.c_str(), path.c_str()) == 0;
+            }
+            status.store(saved ? Status::Saved : Status::Failed, std::memory_order_release);
+        });
+        return true;
+    }
+
+    void TileMapSaver::update(const AnyAutoTileMap &map, const fs::Path &path) {
+        if (worker && !is_saving()) {
+            wait();
+            if (get_status() == Status::Failed) JV_CORE_ERROR("Could not save the tile map to ", path.c_str());
+        }
+
+        if (autosave_interval <= 0.0f || is_saving()) return;
+        float since_save = std::chrono::duration<float>(std::chrono::steady_clock::now() - last_save_time).count();
+        if (since_save < autosave_interval) return;
+
+        bool changed = map->tiles.size() != last_saved.size();
+        if (!changed) {
+            map->tiles.for_each_changed_chunk(last_saved, [&](Vector2i, const TileStorage::Chunk *, const TileStorage::Chunk *) {
+                changed = true;
+            });
+        }
+        if (changed) save(map, path);
+        else last_save_time = std::chrono::steady_clock::now();
+    }
+
+#endif
+
+}// namespace jovial
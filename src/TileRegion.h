@@ -0,0 +1,259 @@
+#pragma once
+
+#include "JovialTileMap.h"
+
+namespace jovial {
+
+    // A rectangle of tiles lifted out of a map, for copy/cut/paste and prefabs. The tiles and the
+    // map's journaled layer (terrain ids) are kept as dense rows with an occupancy bit per cell,
+    // so copying and pasting are a memcpy per chunk row segment and only the cells within
+    // retile_range() of the pasted rect's border are auto tiled again.
+    class TileRegion {
+    public:
+        TileRegion() = default;
+
+        // The rects are inclusive, in any corner order
+        static TileRegion copy(TileMap *map, Vector2i from, Vector2i to);
+
+        // Copies and erases the rect, retiling what was around it
+        static TileRegion cut(TileMap *map, Vector2i from, Vector2i to);
+
+        // Replaces the rect with its top left corner at origin, including the empty cells
+        inline void paste(TileMap *map, Vector2i origin) const {
+            blit(map, origin, false);
+        }
+
+        // Prefab stamping, only the occupied cells are written and the map shows through the rest
+        inline void stamp(TileMap *map, Vector2i origin) const {
+            blit(map, origin, true);
+        }
+
+        // 90 degrees clockwise
+        [[nodiscard]] TileRegion rotated() const;
+        [[nodiscard]] TileRegion flipped(bool horizontal) const;
+
+        [[nodiscard]] inline int get_width() const {
+            return width;
+        }
+
+        [[nodiscard]] inline int get_height() const {
+            return height;
+        }
+
+        [[nodiscard]] inline bool is_empty() const {
+            return width == 0 || height == 0;
+        }
+
+        [[nodiscard]] inline bool has(int x, int y) const {
+            return bits[y * row_words + (x >> 6)] >> (x & 63) & 1;
+        }
+
+        [[nodiscard]] inline Vector2i get(int x, int y) const {
+            return tiles[(long) y * width + x];
+        }
+
+        [[nodiscard]] inline MemoryStats memory_stats() const {
+            MemoryStats stats;
+            stats.cells = (tiles.size() + layer.size()) * (long) sizeof(Vector2i) + (bits.size() + layer_bits.size()) * (long) sizeof(uint64_t);
+            return stats;
+        }
+
+    private:
+        void reset(int width, int height, bool with_layer);
+        void blit(TileMap *map, Vector2i origin, bool transparent) const;
+
+        // Retiles the placed coords within range of the border of the inclusive rect
+        static void retile_border(TileMap *map, Vector2i min, Vector2i max);
+        void retile_holes(TileMap *map, Vector2i origin) const;
+        static void retile_chunks(TileMap *map, Vector2i min, Vector2i max);
+
+        int width = 0;
+        int height = 0;
+        long row_words = 0;
+        Vec<Vector2i> tiles;
+        Vec<uint64_t> bits;
+        Vec<Vector2i> layer;// Same shape as tiles, empty unless the map had a journaled layer
+        Vec<uint64_t> layer_bits;
+        bool stale = false;// Rotated or flipped, the tiles don't match their neighbours anymore
+    };
+
+#ifdef JOVIAL_TILEMAP_IMPLEMENTATION
+
+    void TileRegion::reset(int width, int height, bool with_layer) {
+        this->width = width;
+        this->height = height;
+        row_words = (width + 63) / 64;
+        tiles.clear();
+        tiles.resize((long) width * height);
+        tiles.fill({});
+        bits.clear();
+        bits.resize(row_words * height);
+        bits.fill(0);
+        layer.clear();
+        layer_bits.clear();
+        if (!with_layer) return;
+        layer.resize((long) width * height);
+        layer.fill({});
+        layer_bits.resize(row_words * height);
+        layer_bits.fill(0);
+    }
+
+    TileRegion TileRegion::copy(TileMap *map, Vector2i from, Vector2i to) {
+        JV_TILE_ZONE("TileRegion::copy");
+        Vector2i min(math::MIN(from.x, to.x), math::MIN(from.y, to.y));
+        Vector2i max(math::MAX(from.x, to.x), math::MAX(from.y, to.y));
+        TileStorage *map_layer = map->journaled_layer();
+
+        TileRegion region;
+        region.reset(max.x - min.x + 1, max.y - min.y + 1, map_layer);
+        map->tiles.read_rect(min, max, region.tiles.ptrw(), region.bits.ptrw(), region.row_words);
+        if (map_layer) map_layer->read_rect(min, max, region.layer.ptrw(), region.layer_bits.ptrw(), region.row_words);
+        return region;
+    }
+
+    TileRegion TileRegion::cut(TileMap *map, Vector2i from, Vector2i to) {
+        JV_TILE_ZONE("TileRegion::cut");
+        Vector2i min(math::MIN(from.x, to.x), math::MIN(from.y, to.y));
+        Vector2i max(math::MAX(from.x, to.x), math::MAX(from.y, to.y));
+
+        TileRegion region = copy(map, min, max);
+        map->tiles.erase_rect(min, max);
+        if (auto map_layer = map->journaled_layer()) {
+            map_layer->erase_rect(min, max);
+            map_layer->compact();
+        }
+        retile_border(map, min, max);
+
+        int range = map->retile_range();
+        map->tiles.compact();
+        if (!map->listeners.is_empty()) map->notify_changed(min - Vector2i(range, range), max + Vector2i(range, range));
+        return region;
+    }
+
+    void TileRegion::blit(TileMap *map, Vector2i origin, bool transparent) const {
+        JV_TILE_ZONE("TileRegion::blit");
+        if (is_empty()) return;
+        Vector2i max = origin + Vector2i(width - 1, height - 1);
+        int range = map->retile_range();
+
+        map->tiles.write_rect(origin, max, tiles.ptr(), bits.ptr(), row_words, transparent);
+        if (auto map_layer = map->journaled_layer()) {
+            if (!layer.is_empty()) map_layer->write_rect(origin, max, layer.ptr(), layer_bits.ptr(), row_words, transparent);
+            else map_layer->erase_rect(origin, max);// Copied from a map without one, the tiles resolve as empty
+            map_layer->compact();
+        }
+
+        if (stale) {
+            // Rotated and flipped tiles face the wrong way
+            retile_chunks(map, origin - Vector2i(range, range), max + Vector2i(range, range));
+        } else {
+            retile_border(map, origin, max);
+            if (transparent) retile_holes(map, origin);
+        }
+
+        map->tiles.compact();
+        if (!map->listeners.is_empty()) map->notify_changed(origin - Vector2i(range, range), max + Vector2i(range, range));
+    }
+
+    void TileRegion::retile_border(TileMap *map, Vector2i min, Vector2i max) {
+        int range = map->retile_range();
+        Vector2i outer_min = min - Vector2i(range, range), outer_max = max + Vector2i(range, range);
+        Vector2i inner_min = min + Vector2i(range, range), inner_max = max - Vector2i(range, range);
+
+        // Coords first, retiling writes to the chunks being walked
+        Vec<Vector2i> coords;
+        auto collect = [&](Vector2i coord, Vector2i) {
+            coords.push_back(coord);
+        };
+        if (inner_min.x > inner_max.x || inner_min.y > inner_max.y) {
+            map->tiles.for_each_in_rect(outer_min, outer_max, collect);
+        } else {
+            map->tiles.for_each_in_rect(outer_min, {outer_max.x, inner_min.y - 1}, collect);
+            map->tiles.for_each_in_rect({outer_min.x, inner_max.y + 1}, outer_max, collect);
+            map->tiles.for_each_in_rect({outer_min.x, inner_min.y}, {inner_min.x - 1, inner_max.y}, collect);
+            map->tiles.for_each_in_rect({inner_max.x + 1, inner_min.y}, {outer_max.x, inner_max.y}, collect);
+        }
+        for (auto coord: coords) map->retile(coord);
+    }
+
+    void TileRegion::retile_holes(TileMap *map, Vector2i origin) const {
+        // The map shows through the empty cells of a stamp, so everything within range of one has
+        // new neighbours. retile_border already did the cells outside the rect.
+        int range = map->retile_range();
+        Vec<uint8_t> marked;
+        marked.resize((long) width * height);
+        marked.fill(0);
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                if (has(x, y)) continue;
+                for (int ny = math::MAX(y - range, 0); ny <= math::MIN(y + range, height - 1); ++ny) {
+                    for (int nx = math::MAX(x - range, 0); nx <= math::MIN(x + range, width - 1); ++nx) marked[(long) ny * width + nx] = 1;
+                }
+            }
+        }
+        // Prefabs that are mostly holes resolve whole chunks instead of a coord at a time
+        long count = 0;
+        for (auto flag: marked) count += flag;
+        if (count * 4 > marked.size()) {
+            retile_chunks(map, origin, origin + Vector2i(width - 1, height - 1));
+            return;
+        }
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                Vector2i coord = origin + Vector2i(x, y);
+                if (marked[(long) y * width + x] && map->has(coord)) map->retile(coord);
+            }
+        }
+    }
+
+    void TileRegion::retile_chunks(TileMap *map, Vector2i min, Vector2i max) {
+        Vector2i chunk_min = TileStorage::chunk_of(min), chunk_max = TileStorage::chunk_of(max);
+        for (int cy = chunk_min.y; cy <= chunk_max.y; ++cy) {
+            for (int cx = chunk_min.x; cx <= chunk_max.x; ++cx) {
+                if (map->tiles.has_chunk({cx, cy})) map->retile_chunk({cx, cy});
+            }
+        }
+    }
+
+    TileRegion TileRegion::rotated() const {
+        TileRegion region;
+        region.reset(height, width, !layer.is_empty());
+        region.stale = true;
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                long from = (long) y * width + x, to = (long) x * height + (height - 1 - y);
+                region.tiles[to] = tiles[from];
+                if (has(x, y)) region.bits[x * region.row_words + ((height - 1 - y) >> 6)] |= 1ull << ((height - 1 - y) & 63);
+                if (layer.is_empty()) continue;
+                region.layer[to] = layer[from];
+                if (layer_bits[y * row_words + (x >> 6)] >> (x & 63) & 1) {
+                    region.layer_bits[x * region.row_words + ((height - 1 - y) >> 6)] |= 1ull << ((height - 1 - y) & 63);
+                }
+            }
+        }
+        return region;
+    }
+
+    TileRegion TileRegion::flipped(bool horizontal) const {
+        TileRegion region;
+        region.reset(width, height, !layer.is_empty());
+        region.stale = true;
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                int tx = horizontal ? width - 1 - x : x, ty = horizontal ? y : height - 1 - y;
+                long from = (long) y * width + x, to = (long) ty * width + tx;
+                region.tiles[to] = tiles[from];
+                if (has(x, y)) region.bits[ty * row_words + (tx >> 6)] |= 1ull << (tx & 63);
+                if (layer.is_empty()) continue;
+                region.layer[to] = layer[from];
+                if (layer_bits[y * row_words + (x >> 6)] >> (x & 63) & 1) {
+                    region.layer_bits[ty * row_words + (tx >> 6)] |= 1ull << (tx & 63);
+                }
+            }
+        }
+        return region;
+    }
+
+#endif
+
+}// namespace jovial
@@ -0,0 +1,709 @@
+#pragma once
+
+#include "Jovial/Core/Assert.h"
+#include "Jovial/JovialEngine.h"
+#include "Jovial/Std/HashMap.h"
+#include "MemoryStats.h"
+#include "Vector2iMap.h"
+
+#include <atomic>
+#include <mutex>
+
+namespace jovial {
+
+    // Sparse two level tile storage: a Vector2iMap of 32x32 chunks. Empty regions have no chunk at all,
+    // a chunk where every coord holds the same tile collapses to a single value, and the rest are dense
+    // chunks with a bitplane per row for occupancy and a packed array of tiles.
+    //
+    // Chunks are reference counted and copy on write, and compact() hash-conses them through a global
+    // pool, so identical chunks (solid interiors, repeated prefabs) share one buffer across all maps
+    // and copying a whole storage only copies chunk pointers.
+    //
+    // Overwriting or erasing tiles while iterating is fine. Adding tiles that create new chunks is not.
+    // Chunks that become empty or uniform are only freed/collapsed by compact(), so iterators stay valid.
+    class TileStorage {
+    public:
+        static constexpr int CHUNK_SHIFT = 5;
+        static constexpr int CHUNK_SIZE = 1 << CHUNK_SHIFT;
+        static constexpr int CHUNK_MASK = CHUNK_SIZE - 1;
+        static constexpr int CHUNK_AREA = CHUNK_SIZE * CHUNK_SIZE;
+
+        struct Entry {
+            Vector2i key;
+            Vector2i value;
+        };
+
+        // Shared chunks (refs > 1) are immutable, writers go through TileStorage::writable_chunk
+        struct Chunk {
+            enum Kind {
+                Uniform,
+                Dense,
+            };
+
+            Kind kind = Dense;
+            int count = 0;
+            Vector2i uniform;
+            uint32_t rows[CHUNK_SIZE]{};
+            Vector2i *tiles = nullptr;// Only for dense chunks, unoccupied coords are kept at {0, 0}
+            std::atomic<int> refs{1};
+            std::atomic<bool> interned{false};
+            bool dirty = false;
+            uint64_t content_hash = 0;
+
+            Chunk() : tiles(new Vector2i[CHUNK_AREA]) {}
+            Chunk(const Chunk &other) = delete;
+            Chunk &operator=(const Chunk &other) = delete;
+
+            ~Chunk() {
+                delete[] tiles;
+            }
+
+            [[nodiscard]] inline bool has(int x, int y) const {
+                return rows[y] >> x & 1;
+            }
+
+            [[nodiscard]] inline Vector2i get(int x, int y) const {
+                return kind == Uniform ? uniform : tiles[y * CHUNK_SIZE + x];
+            }
+
+            inline void make_dense() {
+                if (kind == Dense) return;
+                kind = Dense;
+                tiles = new Vector2i[CHUNK_AREA];
+                for (int i = 0; i < CHUNK_AREA; ++i) tiles[i] = uniform;
+            }
+
+            inline void make_uniform(Vector2i tile) {
+                delete[] tiles;
+                tiles = nullptr;
+                kind = Uniform;
+                uniform = tile;
+                count = CHUNK_AREA;
+                for (auto &row: rows) row = UINT32_MAX;
+            }
+
+            [[nodiscard]] inline Chunk *clone() const {
+                auto *copy = new Chunk();
+                copy->count = count;
+                if (kind == Uniform) {
+                    copy->make_uniform(uniform);
+                    return copy;
+                }
+                memcpy(copy->rows, rows, sizeof(rows));
+                memcpy(copy->tiles, tiles, sizeof(Vector2i) * CHUNK_AREA);
+                return copy;
+            }
+
+            [[nodiscard]] uint64_t hash() const {
+                uint64_t h = kind == Uniform ? 0x9E3779B97F4A7C15ull : 0xC2B2AE3D27D4EB4Full;
+                auto mix = [&](uint64_t word) {
+                    h ^= word + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+                };
+                if (kind == Uniform) {
+                    mix((uint64_t) (uint32_t) uniform.x | (uint64_t) (uint32_t) uniform.y << 32);
+                    return Vector2iMap<int>::hash({(int) h, (int) (h >> 32)});
+                }
+                for (auto row: rows) mix(row);
+                for (int i = 0; i < CHUNK_AREA; ++i) {
+                    mix((uint64_t) (uint32_t) tiles[i].x | (uint64_t) (uint32_t) tiles[i].y << 32);
+                }
+                return Vector2iMap<int>::hash({(int) h, (int) (h >> 32)});
+            }
+
+            [[nodiscard]] bool same_content(const Chunk &other) const {
+                if (kind != other.kind || count != other.count) return false;
+                if (kind == Uniform) return uniform == other.uniform;
+                return memcmp(rows, other.rows, sizeof(rows)) == 0 &&
+                       memcmp(tiles, other.tiles, sizeof(Vector2i) * CHUNK_AREA) == 0;
+            }
+        };
+
+        static inline void retain(Chunk *chunk) {
+            chunk->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        static inline void release(Chunk *chunk) {
+            if (chunk->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete chunk;
+        }
+
+        // Global hash-consing table, holds one reference to every interned chunk
+        class ChunkPool {
+        public:
+            ~ChunkPool() {
+                for (auto &entry: by_hash) release(entry.value);
+            }
+
+            // Takes over the caller's reference to chunk and gives back a reference to the shared copy
+            Chunk *intern(Chunk *chunk) {
+                if (chunk->interned) return chunk;
+                chunk->content_hash = chunk->hash();
+
+                std::lock_guard<std::mutex> lock(mutex);
+                Chunk *existing = nullptr;
+                if (by_hash.get_if_contains((uint32_t) chunk->content_hash, existing)) {
+                    if (existing->content_hash == chunk->content_hash && existing->same_content(*chunk)) {
+                        retain(existing);
+                        release(chunk);
+                        return existing;
+                    }
+                    return chunk;// Different chunk in the slot, just leave this one unshared
+                }
+
+                chunk->interned = true;
+                retain(chunk);
+                by_hash.insert((uint32_t) chunk->content_hash, chunk);
+                if (by_hash.size() >= sweep_at) sweep();
+                return chunk;
+            }
+
+            [[nodiscard]] inline long size() const {
+                return by_hash.size();
+            }
+
+            // Drops the chunks that only the pool still references
+            void collect() {
+                std::lock_guard<std::mutex> lock(mutex);
+                sweep();
+            }
+
+        private:
+            void sweep() {
+                Vec<uint32_t> unused;
+                for (auto &entry: by_hash) {
+                    if (entry.value->refs.load(std::memory_order_acquire) == 1) unused.push_back(entry.key);
+                }
+                for (auto key: unused) {
+                    release(by_hash.get(key));
+                    by_hash.erase(key);
+                }
+                sweep_at = math::MAX(by_hash.size() * 2, (long) 1024);
+            }
+
+            std::mutex mutex;
+            HashMap<uint32_t, Chunk *> by_hash;
+            long sweep_at = 1024;
+        };
+
+        static inline ChunkPool &pool() {
+            static ChunkPool chunk_pool;
+            return chunk_pool;
+        }
+
+        class Iterator {
+        public:
+            Iterator(Vector2iMap<Chunk *>::Iterator it, Vector2iMap<Chunk *>::Iterator end)
+                : it(it), end(end) {
+                if (it != end) bits = it->value->rows[0];
+                advance();
+            }
+
+            inline const Entry &operator*() const {
+                return current;
+            }
+
+            inline const Entry *operator->() const {
+                return &current;
+            }
+
+            inline Iterator &operator++() {
+                advance();
+                return *this;
+            }
+
+            inline bool operator!=(const Iterator &other) const {
+                return it != other.it;
+            }
+
+        private:
+            inline void advance() {
+                while (it != end) {
+                    if (bits) {
+                        int x = __builtin_ctz(bits);
+                        bits &= bits - 1;
+                        Vector2i chunk_coord = it->key;
+                        current.key = Vector2i(chunk_coord.x * CHUNK_SIZE + x, chunk_coord.y * CHUNK_SIZE + row);
+                        current.value = it->value->get(x, row);
+                        return;
+                    }
+                    if (++row == CHUNK_SIZE) {
+                        row = 0;
+                        ++it;
+                        if (it == end) return;
+                    }
+                    bits = it->value->rows[row];
+                }
+            }
+
+            Vector2iMap<Chunk *>::Iterator it;
+            Vector2iMap<Chunk *>::Iterator end;
+            int row = 0;
+            uint32_t bits = 0;
+            Entry current;
+        };
+
+        TileStorage() = default;
+
+        // Snapshots share every chunk, so this is O(chunks) and the copies diverge on write
+        TileStorage(const TileStorage &other) {
+            *this = other;
+        }
+
+        TileStorage &operator=(const TileStorage &other) {
+            if (this == &other) return *this;
+            clear();
+            chunks.reserve(other.chunks.size());
+            for (auto &chunk: other.chunks) {
+                retain(chunk.value);
+                chunks.insert(chunk.key, chunk.value);
+            }
+            for (auto chunk_coord: other.dirty_chunks) dirty_chunks.push_back(chunk_coord);
+            count = other.count;
+            return *this;
+        }
+
+        ~TileStorage() {
+            clear();
+        }
+
+        // Compacts and copies, so the snapshot starts out fully deduplicated
+        [[nodiscard]] inline TileStorage snapshot() {
+            compact();
+            return *this;
+        }
+
+        static inline Vector2i chunk_of(Vector2i coord) {
+            return {coord.x >> CHUNK_SHIFT, coord.y >> CHUNK_SHIFT};
+        }
+
+        [[nodiscard]] inline long size() const {
+            return count;
+        }
+
+        [[nodiscard]] inline bool is_empty() const {
+            return count == 0;
+        }
+
+        [[nodiscard]] inline long chunk_count() const {
+            return chunks.size();
+        }
+
+        [[nodiscard]] inline bool has_chunk(Vector2i chunk_coord) const {
+            return chunks.has(chunk_coord);
+        }
+
+        // Null if there is no chunk at chunk_coord
+        [[nodiscard]] inline const Chunk *find_chunk(Vector2i chunk_coord) const {
+            Chunk *const *chunk = chunks.getptr(chunk_coord);
+            return chunk ? *chunk : nullptr;
+        }
+
+        [[nodiscard]] inline bool has(Vector2i coord) const {
+            Chunk *const *chunk = chunks.getptr(chunk_of(coord));
+            return chunk && (*chunk)->has(coord.x & CHUNK_MASK, coord.y & CHUNK_MASK);
+        }
+
+        [[nodiscard]] inline Vector2i get(Vector2i coord) const {
+            Vector2i tile;
+            bool found = get_if_contains(coord, tile);
+            JV_CORE_ASSERT(found, "Tile storage does not contain the coord!");
+            return tile;
+        }
+
+        inline bool get_if_contains(Vector2i coord, Vector2i &out) const {
+            Chunk *const *chunk = chunks.getptr(chunk_of(coord));
+            int x = coord.x & CHUNK_MASK, y = coord.y & CHUNK_MASK;
+            if (!chunk || !(*chunk)->has(x, y)) return false;
+            out = (*chunk)->get(x, y);
+            return true;
+        }
+
+        inline void insert(Vector2i coord, Vector2i tile) {
+            Vector2i chunk_coord = chunk_of(coord);
+            int x = coord.x & CHUNK_MASK, y = coord.y & CHUNK_MASK;
+
+            // Rewriting the same tile is common in retile passes, don't unshare the chunk for it
+            Chunk **found = chunks.getptr(chunk_coord);
+            if (found && (*found)->has(x, y) && (*found)->get(x, y) == tile) return;
+
+            Chunk *chunk = writable_chunk(chunk_coord, found);
+            chunk->make_dense();
+            if (!chunk->has(x, y)) {
+                chunk->rows[y] |= 1u << x;
+                ++chunk->count;
+                ++count;
+            }
+            chunk->tiles[y * CHUNK_SIZE + x] = tile;
+        }
+
+        inline bool erase(Vector2i coord) {
+            Vector2i chunk_coord = chunk_of(coord);
+            int x = coord.x & CHUNK_MASK, y = coord.y & CHUNK_MASK;
+
+            Chunk **found = chunks.getptr(chunk_coord);
+            if (!found || !(*found)->has(x, y)) return false;
+
+            Chunk *chunk = writable_chunk(chunk_coord, found);
+            chunk->make_dense();
+            chunk->rows[y] &= ~(1u << x);
+            chunk->tiles[y * CHUNK_SIZE + x] = {};
+            --chunk->count;
+            --count;
+            return true;
+        }
+
+        inline void reserve(long amount) {
+            chunks.reserve(amount / CHUNK_AREA + 1);
+        }
+
+        inline void clear() {
+            for (auto &chunk: chunks) release(chunk.value);
+            chunks.clear();
+            dirty_chunks.clear();
+            count = 0;
+        }
+
+        // Takes over a chunk built somewhere else, like on a loader thread. If there already is a
+        // chunk at the coord the tiles are copied over into it instead.
+        void adopt_chunk(Vector2i chunk_coord, Chunk *chunk) {
+            Chunk **found = chunks.getptr(chunk_coord);
+            if (found) {
+                Vector2i origin(chunk_coord.x * CHUNK_SIZE, chunk_coord.y * CHUNK_SIZE);
+                auto copy = [&](Vector2i coord, Vector2i tile) {
+                    insert(coord, tile);
+                };
+                visit_chunk(chunk_coord, *chunk, origin, origin + Vector2i(CHUNK_MASK, CHUNK_MASK), copy);
+                release(chunk);
+                return;
+            }
+            if (!chunk->count) {
+                release(chunk);
+                return;
+            }
+            chunk->dirty = true;
+            chunks.insert(chunk_coord, chunk);
+            dirty_chunks.push_back(chunk_coord);
+            count += chunk->count;
+        }
+
+        // Frees chunks that became empty, collapses full chunks holding a single tile and
+        // deduplicates every chunk written since the last compact
+        void compact() {
+            for (auto chunk_coord: dirty_chunks) {
+                Chunk **found = chunks.getptr(chunk_coord);
+                if (!found) continue;
+
+                Chunk *chunk = *found;
+                chunk->dirty = false;
+                if (!chunk->count) {
+                    release(chunk);
+                    chunks.erase(chunk_coord);
+                    continue;
+                }
+
+                if (chunk->kind == Chunk::Dense && chunk->count == CHUNK_AREA) {
+                    Vector2i first = chunk->tiles[0];
+                    bool uniform = true;
+                    for (int i = 1; i < CHUNK_AREA && uniform; ++i) uniform = chunk->tiles[i] == first;
+                    if (uniform && chunk->refs.load(std::memory_order_acquire) > 1) {
+                        release(chunk);
+                        chunk = new Chunk();
+                    }
+                    if (uniform) chunk->make_uniform(first);
+                }
+                *found = pool().intern(chunk);
+            }
+            dirty_chunks.clear();
+        }
+
+        // Fills the inclusive rect, whole chunks become uniform without touching each coord
+        void fill_rect(Vector2i min, Vector2i max, Vector2i tile) {
+            Vector2i chunk_min = chunk_of(min), chunk_max = chunk_of(max);
+            for (int cy = chunk_min.y; cy <= chunk_max.y; ++cy) {
+                for (int cx = chunk_min.x; cx <= chunk_max.x; ++cx) {
+                    Vector2i origin(cx * CHUNK_SIZE, cy * CHUNK_SIZE);
+                    Vector2i from(math::MAX(min.x, origin.x), math::MAX(min.y, origin.y));
+                    Vector2i to(math::MIN(max.x, origin.x + CHUNK_MASK), math::MIN(max.y, origin.y + CHUNK_MASK));
+
+                    if (from == origin && to == origin + Vector2i(CHUNK_MASK, CHUNK_MASK)) {
+                        Chunk **found = chunks.getptr({cx, cy});
+                        if (found) {
+                            count -= (*found)->count;
+                            release(*found);
+                        }
+                        auto *chunk = new Chunk();
+                        chunk->make_uniform(tile);
+                        chunk->dirty = true;
+                        chunks.insert({cx, cy}, chunk);
+                        dirty_chunks.push_back({cx, cy});
+                        count += CHUNK_AREA;
+                        continue;
+                    }
+                    for (int y = from.y; y <= to.y; ++y) {
+                        for (int x = from.x; x <= to.x; ++x) insert({x, y}, tile);
+                    }
+                }
+            }
+        }
+
+        // Copies the inclusive rect into row major buffers, a chunk row segment at a time: out gets
+        // one tile per cell and occupancy gets row_words words per row with bit x set for occupied
+        // cells. Empty cells are skipped, so both buffers should start out zeroed.
+        void read_rect(Vector2i min, Vector2i max, Vector2i *out, uint64_t *occupancy, long row_words) const {
+            long width = max.x - min.x + 1;
+            for_each_chunk_coord_in_rect(min, max, [&](Vector2i chunk_coord) {
+                const Chunk *chunk = chunks.get(chunk_coord);
+                Vector2i origin(chunk_coord.x * CHUNK_SIZE, chunk_coord.y * CHUNK_SIZE);
+                int x0 = math::MAX(min.x - origin.x, 0), x1 = math::MIN(max.x - origin.x, CHUNK_MASK);
+                int y0 = math::MAX(min.y - origin.y, 0), y1 = math::MIN(max.y - origin.y, CHUNK_MASK);
+                int length = x1 - x0 + 1;
+                long rx = origin.x + x0 - min.x;
+
+                for (int y = y0; y <= y1; ++y) {
+                    uint32_t row = chunk->rows[y] >> x0 & row_mask(length);
+                    if (!row) continue;
+                    long ry = origin.y + y - min.y;
+                    Vector2i *dst = out + ry * width + rx;
+                    if (chunk->kind == Chunk::Uniform) {
+                        for (int x = 0; x < length; ++x) dst[x] = chunk->uniform;
+                    } else {
+                        memcpy(dst, chunk->tiles + y * CHUNK_SIZE + x0, sizeof(Vector2i) * length);
+                    }
+                    set_bits(occupancy + ry * row_words, rx, row);
+                }
+            });
+        }
+
+        // The reverse of read_rect, each chunk row segment is one memcpy into the chunk. Cells that are
+        // empty in the buffer erase the map, unless transparent, then only occupied cells are written.
+        // Empty cells of in must be {0, 0} like in a chunk.
+        void write_rect(Vector2i min, Vector2i max, const Vector2i *in, const uint64_t *occupancy, long row_words, bool transparent) {
+            long width = max.x - min.x + 1;
+            Vector2i chunk_min = chunk_of(min), chunk_max = chunk_of(max);
+            for (int cy = chunk_min.y; cy <= chunk_max.y; ++cy) {
+                for (int cx = chunk_min.x; cx <= chunk_max.x; ++cx) {
+                    Vector2i origin(cx * CHUNK_SIZE, cy * CHUNK_SIZE);
+                    int x0 = math::MAX(min.x - origin.x, 0), x1 = math::MIN(max.x - origin.x, CHUNK_MASK);
+                    int y0 = math::MAX(min.y - origin.y, 0), y1 = math::MIN(max.y - origin.y, CHUNK_MASK);
+                    int length = x1 - x0 + 1;
+                    long rx = origin.x + x0 - min.x;
+
+                    Chunk **found = chunks.getptr({cx, cy});
+                    if (!found || transparent) {
+                        // Don't create or unshare a chunk that nothing gets written to
+                        bool any = false;
+                        for (int y = y0; y <= y1 && !any; ++y) {
+                            any = get_bits(occupancy + (origin.y + y - min.y) * row_words, rx, length) != 0;
+                        }
+                        if (!any) continue;
+                    }
+
+                    Chunk *chunk = writable_chunk({cx, cy}, found);
+                    chunk->make_dense();
+                    uint32_t columns = row_mask(length) << x0;
+                    for (int y = y0; y <= y1; ++y) {
+                        long ry = origin.y + y - min.y;
+                        uint32_t row = get_bits(occupancy + ry * row_words, rx, length) << x0;
+                        uint32_t old = chunk->rows[y];
+                        const Vector2i *src = in + ry * width + rx;
+                        Vector2i *dst = chunk->tiles + y * CHUNK_SIZE + x0;
+
+                        if (!transparent || row == columns) {
+                            memcpy(dst, src, sizeof(Vector2i) * length);
+                            chunk->rows[y] = transparent ? old | row : (old & ~columns) | row;
+                        } else {
+                            for (uint32_t bits = row; bits; bits &= bits - 1) {
+                                int x = __builtin_ctz(bits);
+                                dst[x - x0] = src[x - x0];
+                            }
+                            chunk->rows[y] = old | row;
+                        }
+                        int added = __builtin_popcount(chunk->rows[y]) - __builtin_popcount(old);
+                        chunk->count += added;
+                        count += added;
+                    }
+                }
+            }
+        }
+
+        // Erases the inclusive rect, whole chunks are dropped without touching each coord
+        void erase_rect(Vector2i min, Vector2i max) {
+            for_each_chunk_coord_in_rect(min, max, [&](Vector2i chunk_coord) {
+                Chunk **found = chunks.getptr(chunk_coord);
+                Vector2i origin(chunk_coord.x * CHUNK_SIZE, chunk_coord.y * CHUNK_SIZE);
+                int x0 = math::MAX(min.x - origin.x, 0), x1 = math::MIN(max.x - origin.x, CHUNK_MASK);
+                int y0 = math::MAX(min.y - origin.y, 0), y1 = math::MIN(max.y - origin.y, CHUNK_MASK);
+
+                if (x0 == 0 && y0 == 0 && x1 == CHUNK_MASK && y1 == CHUNK_MASK) {
+                    count -= (*found)->count;
+                    release(*found);
+                    chunks.erase(chunk_coord);
+                    return;
+                }
+
+                uint32_t columns = row_mask(x1 - x0 + 1) << x0;
+                bool any = false;
+                for (int y = y0; y <= y1 && !any; ++y) any = ((*found)->rows[y] & columns) != 0;
+                if (!any) return;
+
+                Chunk *chunk = writable_chunk(chunk_coord, found);
+                chunk->make_dense();
+                for (int y = y0; y <= y1; ++y) {
+                    uint32_t erased = chunk->rows[y] & columns;
+                    if (!erased) continue;
+                    for (int x = x0; x <= x1; ++x) chunk->tiles[y * CHUNK_SIZE + x] = {};
+                    chunk->rows[y] &= ~columns;
+                    chunk->count -= __builtin_popcount(erased);
+                    count -= __builtin_popcount(erased);
+                }
+            });
+        }
+
+        // Calls fn(coord, tile) for every tile in the inclusive rect. Only chunks that exist are
+        // visited: small rects probe the chunk index, huge ones walk the chunk list instead, so
+        // empty space costs min(chunks in the rect, chunks in the map) and never a coord at a time.
+        template<typename Fn>
+        void for_each_in_rect(Vector2i min, Vector2i max, Fn &&fn) const {
+            Vector2i chunk_min = chunk_of(min), chunk_max = chunk_of(max);
+            long area = (long) (chunk_max.x - chunk_min.x + 1) * (long) (chunk_max.y - chunk_min.y + 1);
+
+            if (area <= chunks.size()) {
+                for (int cy = chunk_min.y; cy <= chunk_max.y; ++cy) {
+                    for (int cx = chunk_min.x; cx <= chunk_max.x; ++cx) {
+                        Chunk *const *chunk = chunks.getptr({cx, cy});
+                        if (chunk) visit_chunk({cx, cy}, **chunk, min, max, fn);
+                    }
+                }
+            } else {
+                for (auto &chunk: chunks) {
+                    Vector2i c = chunk.key;
+                    if (c.x < chunk_min.x || c.y < chunk_min.y || c.x > chunk_max.x || c.y > chunk_max.y) continue;
+                    visit_chunk(c, *chunk.value, min, max, fn);
+                }
+            }
+        }
+
+        // Calls fn(chunk_coord, chunk) for every chunk, in no particular order
+        template<typename Fn>
+        void for_each_chunk(Fn &&fn) const {
+            for (auto &chunk: chunks) fn(chunk.key, (const Chunk *) chunk.value);
+        }
+
+        // Calls fn(chunk_coord, before_chunk, chunk) for every chunk that isn't shared with before,
+        // either chunk is null when it only exists on one side. Costs O(chunks) plus whatever fn does,
+        // which makes diffing against a snapshot cheap.
+        template<typename Fn>
+        void for_each_changed_chunk(const TileStorage &before, Fn &&fn) const {
+            for (auto &chunk: chunks) {
+                Chunk *const *old = before.chunks.getptr(chunk.key);
+                if (!old) fn(chunk.key, (const Chunk *) nullptr, (const Chunk *) chunk.value);
+                else if (*old != chunk.value) fn(chunk.key, (const Chunk *) *old, (const Chunk *) chunk.value);
+            }
+            for (auto &chunk: before.chunks) {
+                if (!chunks.has(chunk.key)) fn(chunk.key, (const Chunk *) chunk.value, (const Chunk *) nullptr);
+            }
+        }
+
+        [[nodiscard]] inline Iterator begin() const {
+            return Iterator(chunks.begin(), chunks.end());
+        }
+
+        [[nodiscard]] inline Iterator end() const {
+            return Iterator(chunks.end(), chunks.end());
+        }
+
+        // Cells and chunk overhead, with chunks shared with other storages (snapshots, interned
+        // copies) split between the storages holding them. The pool's own reference is not a share.
+        [[nodiscard]] inline MemoryStats memory_stats() const {
+            MemoryStats stats;
+            for (auto &entry: chunks) {
+                const Chunk *chunk = entry.value;
+                MemoryStats own;
+                own.cells = (long) sizeof(chunk->rows) + (chunk->kind == Chunk::Dense ? (long) sizeof(Vector2i) * CHUNK_AREA : 0);
+                own.chunk_overhead = (long) sizeof(Chunk) - (long) sizeof(chunk->rows);
+                long refs = chunk->refs.load(std::memory_order_relaxed) - (chunk->interned.load(std::memory_order_relaxed) ? 1 : 0);
+                stats += own.shared_by(refs);
+            }
+            stats.chunk_overhead += chunks.memory_usage() + dirty_chunks.size() * (long) sizeof(Vector2i);
+            return stats;
+        }
+
+    private:
+        // Unshares the chunk if another storage or the pool also holds it, creating it if slot is null
+        inline Chunk *writable_chunk(Vector2i chunk_coord, Chunk **slot) {
+            if (!slot) {
+                slot = &chunks.insert(chunk_coord, new Chunk());
+            } else if ((*slot)->refs.load(std::memory_order_acquire) > 1) {
+                Chunk *copy = (*slot)->clone();
+                release(*slot);
+                *slot = copy;
+            }
+            if (!(*slot)->dirty) {
+                (*slot)->dirty = true;
+                dirty_chunks.push_back(chunk_coord);
+            }
+            return *slot;
+        }
+
+        // Calls fn(chunk_coord) for the chunks in the inclusive rect that exist, picking between probing
+        // and walking the chunk list like for_each_in_rect. fn may erase the chunk it is given.
+        template<typename Fn>
+        void for_each_chunk_coord_in_rect(Vector2i min, Vector2i max, Fn &&fn) const {
+            Vector2i chunk_min = chunk_of(min), chunk_max = chunk_of(max);
+            long area = (long) (chunk_max.x - chunk_min.x + 1) * (long) (chunk_max.y - chunk_min.y + 1);
+
+            Vec<Vector2i> found;
+            if (area <= chunks.size()) {
+                for (int cy = chunk_min.y; cy <= chunk_max.y; ++cy) {
+                    for (int cx = chunk_min.x; cx <= chunk_max.x; ++cx) {
+                        if (chunks.has({cx, cy})) found.push_back({cx, cy});
+                    }
+                }
+            } else {
+                for (auto &chunk: chunks) {
+                    Vector2i c = chunk.key;
+                    if (c.x < chunk_min.x || c.y < chunk_min.y || c.x > chunk_max.x || c.y > chunk_max.y) continue;
+                    found.push_back(c);
+                }
+            }
+            for (auto chunk_coord: found) fn(chunk_coord);
+        }
+
+        static inline uint32_t row_mask(int length) {
+            return length >= CHUNK_SIZE ? UINT32_MAX : (1u << length) - 1;
+        }
+
+        // Bit rows of any width as 64 bit words, a chunk row segment is at most 32 bits so it spans two words at most
+        static inline void set_bits(uint64_t *words, long at, uint32_t bits) {
+            int shift = (int) (at & 63);
+            words[at >> 6] |= (uint64_t) bits << shift;
+            if (shift > 32 && (uint64_t) bits >> (64 - shift)) words[(at >> 6) + 1] |= (uint64_t) bits >> (64 - shift);
+        }
+
+        static inline uint32_t get_bits(const uint64_t *words, long at, int length) {
+            int shift = (int) (at & 63);
+            uint64_t bits = words[at >> 6] >> shift;
+            if (shift + length > 64) bits |= words[(at >> 6) + 1] << (64 - shift);
+            return (uint32_t) bits & row_mask(length);
+        }
+
+        template<typename Fn>
+        static inline void visit_chunk(Vector2i chunk_coord, const Chunk &chunk, Vector2i min, Vector2i max, Fn &fn) {
+            Vector2i origin(chunk_coord.x * CHUNK_SIZE, chunk_coord.y * CHUNK_SIZE);
+            int x0 = math::MAX(min.x - origin.x, 0), x1 = math::MIN(max.x - origin.x, CHUNK_MASK);
+            int y0 = math::MAX(min.y - origin.y, 0), y1 = math::MIN(max.y - origin.y, CHUNK_MASK);
+            uint32_t columns = (x1 == CHUNK_MASK ? UINT32_MAX : (1u << (x1 + 1)) - 1) & ~((1u << x0) - 1);
+
+            for (int y = y0; y <= y1; ++y) {
+                for (uint32_t bits = chunk.rows[y] & columns; bits; bits &= bits - 1) {
+                    int x = __builtin_ctz(bits);
+                    fn(origin + Vector2i(x, y), chunk.get(x, y));
+                }
+            }
+        }
+
+        Vector2iMap<Chunk *> chunks;
+        Vec<Vector2i> dirty_chunks;
+        long count = 0;
+    };
+
+}// namespace jovial
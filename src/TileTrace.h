@@ -0,0 +1,187 @@
+#pragma once
+
+// Scoped timing zones for the hot paths (drawing, auto tiling, the editor, saving and loading),
+// dumped as Chrome trace event JSON that opens in Perfetto or chrome://tracing.
+// Everything here compiles to nothing unless JOVIAL_TILEMAP_TRACE is defined.
+//
+//     JV_TILE_ZONE("TileMap::draw");      // Times the rest of the enclosing scope
+//     JV_TILE_TRACE_DUMP("trace.json");   // Writes what every thread recorded so far
+
+#ifdef JOVIAL_TILEMAP_TRACE
+
+#include "Jovial/Core/Logger.h"
+#include "Jovial/JovialEngine.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+
+#define JV_TILE_TRACE_CONCAT_(a, b) a##b
+#define JV_TILE_TRACE_CONCAT(a, b) JV_TILE_TRACE_CONCAT_(a, b)
+#define JV_TILE_ZONE(name) ::jovial::TileTrace::Zone JV_TILE_TRACE_CONCAT(tile_trace_zone_, __LINE__)(name)
+#define JV_TILE_TRACE_DUMP(path) ::jovial::TileTrace::dump(path)
+
+namespace jovial {
+
+    // Each thread records into its own ring of the last CAPACITY zones, so recording is a clock read
+    // and a couple of stores with no locks or shared cache lines. Rings are never freed, the zones of
+    // worker threads that already exited still show up in the dump, on the track of the ring.
+    class TileTrace {
+    public:
+        static constexpr long CAPACITY = 1 << 16;// Zones kept per thread
+        static constexpr int MAX_THREADS = 64;   // Threads running at once past this many are not recorded
+
+        // Names have to outlive the trace, string literals
+        struct Event {
+            const char *name;
+            int64_t start_ns;
+            int64_t duration_ns;
+        };
+
+        class Zone {
+        public:
+            explicit Zone(const char *name)
+                : name(name), start(now_ns()) {}
+
+            Zone(const Zone &other) = delete;
+            Zone &operator=(const Zone &other) = delete;
+
+            ~Zone() {
+                record(name, start, now_ns() - start);
+            }
+
+        private:
+            const char *name;
+            int64_t start;
+        };
+
+        static inline void record(const char *name, int64_t start_ns, int64_t duration_ns) {
+            Ring *ring = get_ring();
+            if (!ring) return;
+            // Only this thread writes its ring, the release publishes the event to dump()
+            uint64_t head = ring->head.load(std::memory_order_relaxed);
+            ring->events[head & (CAPACITY - 1)] = {name, start_ns, duration_ns};
+            ring->head.store(head + 1, std::memory_order_release);
+        }
+
+        // Writes every thread's recorded zones. Threads keep recording while this runs, the events
+        // they might have overwritten during the copy are left out rather than torn.
+        static bool dump(const char *path);
+
+        static inline int64_t now_ns() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch()).count();
+        }
+
+    private:
+        struct Ring {
+            Event events[CAPACITY];
+            std::atomic<uint64_t> head{0};
+            std::atomic<bool> in_use{true};
+            int thread_index = 0;
+        };
+
+        static inline std::chrono::steady_clock::time_point epoch() {
+            static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            return start;
+        }
+
+        static inline std::atomic<Ring *> *rings() {
+            static std::atomic<Ring *> all[MAX_THREADS] = {};
+            return all;
+        }
+
+        static inline std::atomic<int> &ring_count() {
+            static std::atomic<int> count{0};
+            return count;
+        }
+
+        // Hands the ring back when its thread exits, so the short lived worker threads of the saver,
+        // loader and generator take turns on a few rings instead of using up MAX_THREADS
+        struct RingOwner {
+            Ring *ring = claim_ring();
+
+            ~RingOwner() {
+                if (ring) ring->in_use.store(false, std::memory_order_release);
+            }
+        };
+
+        static inline Ring *get_ring() {
+            thread_local RingOwner owner;
+            return owner.ring;
+        }
+
+        static inline Ring *claim_ring() {
+            epoch();
+            int count = math::MIN(ring_count().load(std::memory_order_acquire), MAX_THREADS);
+            for (int i = 0; i < count; ++i) {
+                Ring *ring = rings()[i].load(std::memory_order_acquire);
+                bool expected = false;
+                if (ring && ring->in_use.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) return ring;
+            }
+
+            int index = ring_count().fetch_add(1, std::memory_order_acq_rel);
+            if (index >= MAX_THREADS) return nullptr;
+            auto *ring = new Ring();
+            ring->thread_index = index;
+            rings()[index].store(ring, std::memory_order_release);
+            return ring;
+        }
+
+        static inline void write_name(FILE *file, const char *name) {
+            for (const char *c = name; *c; ++c) {
+                if (*c == '"' || *c == '\\') std::fputc('\\', file);
+                std::fputc(*c, file);
+            }
+        }
+    };
+
+    inline bool TileTrace::dump(const char *path) {
+        FILE *file = std::fopen(path, "wb");
+        if (!file) {
+            JV_CORE_ERROR("Could not open ", path, " for the trace");
+            return false;
+        }
+
+        auto *copy = new Event[CAPACITY];
+        long written = 0;
+        std::fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+        int count = ring_count().load(std::memory_order_relaxed);
+        for (int i = 0; i < count && i < MAX_THREADS; ++i) {
+            Ring *ring = rings()[i].load(std::memory_order_acquire);
+            if (!ring) continue;// Still being registered
+
+            uint64_t head = ring->head.load(std::memory_order_acquire);
+            uint64_t first = head > (uint64_t) CAPACITY ? head - CAPACITY : 0;
+            for (uint64_t e = first; e < head; ++e) copy[e - first] = ring->events[e & (CAPACITY - 1)];
+            // Whatever the owner wrote since then went over the oldest copied events
+            uint64_t moved = ring->head.load(std::memory_order_acquire);
+            uint64_t valid = moved > (uint64_t) CAPACITY ? moved - CAPACITY : 0;
+
+            for (uint64_t e = math::MAX(first, valid); e < head; ++e) {
+                const Event &event = copy[e - first];
+                std::fputs(written ? ",\n" : "\n", file);
+                std::fputs("{\"name\":\"", file);
+                write_name(file, event.name);
+                // Chrome wants microseconds, the fraction keeps nanosecond zones visible
+                std::fprintf(file, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                             ring->thread_index, (double) event.start_ns / 1000.0, (double) event.duration_ns / 1000.0);
+                ++written;
+            }
+        }
+        std::fputs("\n]}\n", file);
+        delete[] copy;
+
+        bool ok = std::fclose(file) == 0;
+        if (ok) print("Wrote ", written, " trace zones to ", path);
+        else JV_CORE_ERROR("Could not write the trace to ", path);
+        return ok;
+    }
+
+}// namespace jovial
+
+#else
+
+#define JV_TILE_ZONE(name)
+#define JV_TILE_TRACE_DUMP(path) ((void) 0)
+
+#endif
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "Jovial/Core/Assert.h"
+#include "Jovial/JovialEngine.h"
+#include "Jovial/Std/Array.h"
+#include "MemoryStats.h"
+#include "Vector2iMap.h"
+
+#include <atomic>
+#include <chrono>
+
+namespace jovial {
+
+    // Everything about a tile atlas that the maps drawing from it have in common: the texture, the
+    // uv of every tile, default auto tile tables and tile animations. Built once, then immutable and
+    // reference counted like the storage chunks, so any number of maps share one and creating a map
+    // copies none of it.
+    class Tileset {
+    public:
+        static constexpr int WANG_TILE_COUNT = 16;
+        static constexpr int BLOB_TILE_COUNT = 47;
+
+        // Drawn in place of a tile, one frame after the other
+        struct Animation {
+            Vec<Vector2i> frames;
+            float frame_seconds = 0.1f;
+        };
+
+        Texture texture;
+        Vector2 tile_size;
+        Vector2iMap<Rect2> tile_uvs;
+        Array<Vector2i, WANG_TILE_COUNT> wang_tiles{};// What WangTileMap and BlobTileMap start out with
+        Array<Vector2i, BLOB_TILE_COUNT> blob_tiles{};
+        Vec<uint32_t> pixels;// RGBA8 copy of the atlas for rendering on the CPU, empty unless set_pixels() was called
+        int pixels_width = 0;
+        int pixels_height = 0;
+
+        Tileset(const Tileset &other) = delete;
+        Tileset &operator=(const Tileset &other) = delete;
+
+        // Cuts the texture into tile_size tiles. The caller holds the one reference, maps take their
+        // own, so the builder can fill in tables and animations and then release it.
+        static inline Tileset *create(const Texture &texture, Vector2 tile_size) {
+            auto *tileset = new Tileset();
+            tileset->texture = texture;
+            tileset->tile_size = tile_size;
+
+            float tiles_x = (float) texture.width / tile_size.x;
+            float tiles_y = (float) texture.height / tile_size.y;
+            float w = 1.0f / tiles_x;
+            float h = 1.0f / tiles_y;
+            tileset->tile_uvs.reserve((long) tiles_x * (long) tiles_y);
+            for (int x = 0; x < (int) tiles_x; ++x) {
+                for (int y = 0; y < (int) tiles_y; ++y) {
+                    Rect2 uv = {w * (float) x, h * (float) y,
+                                w * ((float) x + 1), h * ((float) y + 1)};
+                    tileset->add_tile({x, y}, uv);
+                }
+            }
+            return tileset;
+        }
+
+        static inline void retain(const Tileset *tileset) {
+            if (tileset) tileset->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        static inline void release(const Tileset *tileset) {
+            if (tileset && tileset->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete tileset;
+        }
+
+        inline void add_tile(Vector2i tile, Rect2 uv) {
+            tile_uvs.insert(tile, uv);
+        }
+
+        // Keeps a copy of the atlas image, 1 to 4 channels of 8 bits, for TileMapRenderer
+        inline void set_pixels(const uint8_t *data, int width, int height, int channels) {
+            JV_CORE_ASSERT(channels >= 1 && channels <= 4, "Atlas pixels need 1 to 4 channels!");
+            pixels_width = width;
+            pixels_height = height;
+            pixels.clear();
+            pixels.resize((long) width * height);
+            for (long i = 0; i < (long) width * height; ++i) {
+                const uint8_t *p = data + i * channels;
+                uint32_t r = p[0], g = channels >= 3 ? p[1] : r, b = channels >= 3 ? p[2] : r;
+                uint32_t a = channels == 4 ? p[3] : channels == 2 ? p[1] : 255;
+                pixels[i] = r | g << 8 | b << 16 | a << 24;
+            }
+        }
+
+        inline void add_animation(Vector2i tile, const Animation &animation) {
+            JV_CORE_ASSERT(!animation.frames.is_empty() && animation.frame_seconds > 0.0f, "Animations need frames!");
+            animation_of.insert(tile, (int) animations.size());
+            animations.push_back(animation);
+        }
+
+        [[nodiscard]] inline bool has_uv(Vector2i tile) const {
+            return tile_uvs.has(tile);
+        }
+
+        // The tile to draw for tile at this point of the animation clock, which every map of the
+        // tileset shares so their animations stay in step
+        [[nodiscard]] inline Vector2i frame_of(Vector2i tile, float seconds) const {
+            int index;
+            if (animations.is_empty() || !animation_of.get_if_contains(tile, index)) return tile;
+            const Animation &animation = animations[index];
+            long frame = (long) (seconds / animation.frame_seconds);
+            return animation.frames[frame % animation.frames.size()];
+        }
+
+        [[nodiscard]] inline bool has_animations() const {
+            return !animations.is_empty();
+        }
+
+        [[nodiscard]] inline int get_refs() const {
+            return refs.load(std::memory_order_relaxed);
+        }
+
+        // The whole tileset, maps count their share of it
+        [[nodiscard]] inline MemoryStats memory_stats() const {
+            MemoryStats stats;
+            stats.uv_tables = (long) sizeof(Tileset) - (long) (sizeof(wang_tiles) + sizeof(blob_tiles)) +
+                              tile_uvs.memory_usage() + animation_of.memory_usage() + pixels.size() * (long) sizeof(uint32_t);
+            for (auto &animation: animations) stats.uv_tables += (long) sizeof(Animation) + animation.frames.size() * (long) sizeof(Vector2i);
+            stats.rule_tables = (long) (sizeof(wang_tiles) + sizeof(blob_tiles));
+            return stats;
+        }
+
+        [[nodiscard]] inline float get_clock() const {
+            return std::chrono::duration<float>(std::chrono::steady_clock::now() - created).count();
+        }
+
+    private:
+        Tileset() = default;
+        ~Tileset() = default;
+
+        Vec<Animation> animations;
+        Vector2iMap<int> animation_of;
+        std::chrono::steady_clock::time_point created = std::chrono::steady_clock::now();
+        mutable std::atomic<int> refs{1};
+    };
+
+}// namespace jovial
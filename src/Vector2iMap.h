@@ -0,0 +1,347 @@
+#pragma once
+
+#include "Jovial/Core/Assert.h"
+#include "Jovial/JovialEngine.h"
+
+#include <cstring>
+
+namespace jovial {
+
+    // Flat open addressing map from Vector2i, laid out like a SwissTable: one control byte per slot
+    // holding 7 bits of the hash, probed 8 slots at a time, with keys and values stored inline.
+    // Erase leaves a tombstone and never moves entries, so erasing while iterating is fine.
+    // Inserting while iterating is not, since it can rehash.
+    template<typename V>
+    class Vector2iMap {
+    public:
+        struct Entry {
+            Vector2i key;
+            V value;
+        };
+
+        class Iterator {
+        public:
+            Iterator(const Vector2iMap *map, long index) : map(map), index(index) {
+                skip_empty();
+            }
+
+            inline Entry &operator*() const {
+                return map->entries[index];
+            }
+
+            inline Entry *operator->() const {
+                return &map->entries[index];
+            }
+
+            inline Iterator &operator++() {
+                ++index;
+                skip_empty();
+                return *this;
+            }
+
+            inline bool operator!=(const Iterator &other) const {
+                return index != other.index;
+            }
+
+            inline bool operator==(const Iterator &other) const {
+                return index == other.index;
+            }
+
+        private:
+            // Scans a group of control bytes at a time instead of branching on every slot
+            inline void skip_empty() {
+                while (index < map->capacity) {
+                    uint64_t full = ~map->load_group(index) & HIGH_BITS;
+                    if (full) {
+                        index = math::MIN(index + lowest_byte(full), map->capacity);
+                        return;
+                    }
+                    index += GROUP_SIZE;
+                }
+                index = map->capacity;
+            }
+
+            const Vector2iMap *map;
+            long index;
+        };
+
+        Vector2iMap() = default;
+
+        Vector2iMap(const Vector2iMap &other) {
+            *this = other;
+        }
+
+        Vector2iMap(Vector2iMap &&other) noexcept {
+            *this = (Vector2iMap &&) other;
+        }
+
+        Vector2iMap &operator=(const Vector2iMap &other) {
+            if (this == &other) return *this;
+            clear();
+            reserve(other.count);
+            for (auto &entry: other) insert(entry.key, entry.value);
+            return *this;
+        }
+
+        Vector2iMap &operator=(Vector2iMap &&other) noexcept {
+            if (this == &other) return *this;
+            release();
+            ctrl = other.ctrl;
+            entries = other.entries;
+            capacity = other.capacity;
+            count = other.count;
+            tombstones = other.tombstones;
+            other.ctrl = nullptr;
+            other.entries = nullptr;
+            other.capacity = other.count = other.tombstones = 0;
+            return *this;
+        }
+
+        ~Vector2iMap() {
+            release();
+        }
+
+        // Mixes both coords with the murmur/xxhash finalizer, so neighbouring coords land far apart
+        static inline uint64_t hash(Vector2i key) {
+            uint64_t h = (uint64_t) (uint32_t) key.x | ((uint64_t) (uint32_t) key.y << 32);
+            h ^= h >> 33;
+            h *= 0xFF51AFD7ED558CCDull;
+            h ^= h >> 33;
+            h *= 0xC4CEB9FE1A85EC53ull;
+            h ^= h >> 33;
+            return h;
+        }
+
+        [[nodiscard]] inline long size() const {
+            return count;
+        }
+
+        [[nodiscard]] inline bool is_empty() const {
+            return count == 0;
+        }
+
+        // Bytes allocated for the slots, not counting what the values point to
+        [[nodiscard]] inline long memory_usage() const {
+            return capacity ? capacity + GROUP_SIZE + capacity * (long) sizeof(Entry) : 0;
+        }
+
+        [[nodiscard]] inline bool has(Vector2i key) const {
+            return find_index(key) >= 0;
+        }
+
+        [[nodiscard]] inline V *getptr(Vector2i key) {
+            long index = find_index(key);
+            return index >= 0 ? &entries[index].value : nullptr;
+        }
+
+        [[nodiscard]] inline const V *getptr(Vector2i key) const {
+            long index = find_index(key);
+            return index >= 0 ? &entries[index].value : nullptr;
+        }
+
+        inline V &get(Vector2i key) {
+            long index = find_index(key);
+            JV_CORE_ASSERT(index >= 0, "Key is not in the map!");
+            return entries[index].value;
+        }
+
+        inline const V &get(Vector2i key) const {
+            long index = find_index(key);
+            JV_CORE_ASSERT(index >= 0, "Key is not in the map!");
+            return entries[index].value;
+        }
+
+        inline bool get_if_contains(Vector2i key, V &out) const {
+            long index = find_index(key);
+            if (index < 0) return false;
+            out = entries[index].value;
+            return true;
+        }
+
+        inline V &insert(Vector2i key, const V &value) {
+            uint64_t h = hash(key);
+            long index = find_index(key, h);
+            if (index < 0) index = insert_new(key, h);
+            entries[index].value = value;
+            return entries[index].value;
+        }
+
+        inline V &operator[](Vector2i key) {
+            uint64_t h = hash(key);
+            long index = find_index(key, h);
+            if (index < 0) index = insert_new(key, h);
+            return entries[index].value;
+        }
+
+        inline bool erase(Vector2i key) {
+            long index = find_index(key);
+            if (index < 0) return false;
+            entries[index].value = V();
+            set_ctrl(index, DELETED);
+            --count;
+            ++tombstones;
+            return true;
+        }
+
+        // Makes room for amount entries without rehashing on the way
+        inline void reserve(long amount) {
+            long needed = GROUP_SIZE;
+            while (needed * 7 / 8 < amount) needed *= 2;
+            if (needed > capacity) rehash(needed);
+        }
+
+        inline void clear() {
+            if (!capacity) return;
+            for (long i = 0; i < capacity; ++i) {
+                if (is_full(ctrl[i])) entries[i].value = V();
+            }
+            memset(ctrl, EMPTY, capacity + GROUP_SIZE);
+            count = 0;
+            tombstones = 0;
+        }
+
+        [[nodiscard]] inline Iterator begin() const {
+            return Iterator(this, 0);
+        }
+
+        [[nodiscard]] inline Iterator end() const {
+            return Iterator(this, capacity);
+        }
+
+    private:
+        static constexpr uint8_t EMPTY = 0x80;
+        static constexpr uint8_t DELETED = 0xFE;
+        static constexpr long GROUP_SIZE = 8;
+
+        static constexpr uint64_t LOW_BITS = 0x0101010101010101ull;
+        static constexpr uint64_t HIGH_BITS = 0x8080808080808080ull;
+
+        static inline bool is_full(uint8_t c) {
+            return c < 0x80;
+        }
+
+        static inline uint8_t h2(uint64_t h) {
+            return (uint8_t) (h & 0x7F);
+        }
+
+        inline uint64_t load_group(long pos) const {
+            uint64_t group;
+            memcpy(&group, ctrl + pos, sizeof(group));
+            return group;
+        }
+
+        // Bytes of the group equal to the control byte have their high bit set. There can be rare
+        // false positives, find_index checks the control byte again before comparing keys.
+        static inline uint64_t match(uint64_t group, uint8_t c) {
+            uint64_t x = group ^ (LOW_BITS * c);
+            return (x - LOW_BITS) & ~x & HIGH_BITS;
+        }
+
+        static inline uint64_t match_empty(uint64_t group) {
+            return group & (~group << 6) & HIGH_BITS;
+        }
+
+        static inline uint64_t match_empty_or_deleted(uint64_t group) {
+            return group & (~group << 7) & HIGH_BITS;
+        }
+
+        static inline long lowest_byte(uint64_t mask) {
+            return __builtin_ctzll(mask) >> 3;
+        }
+
+        // The last GROUP_SIZE control bytes mirror the first ones, so groups can be loaded past the end
+        inline void set_ctrl(long index, uint8_t c) {
+            ctrl[index] = c;
+            if (index < GROUP_SIZE) ctrl[capacity + index] = c;
+        }
+
+        inline long find_index(Vector2i key) const {
+            return find_index(key, hash(key));
+        }
+
+        inline long find_index(Vector2i key, uint64_t h) const {
+            if (!capacity) return -1;
+            long mask = capacity - 1;
+            long pos = (long) (h >> 7) & mask;
+            uint8_t tag = h2(h);
+
+            for (long step = 0; step <= capacity; step += GROUP_SIZE) {
+                uint64_t group = load_group(pos);
+                for (uint64_t m = match(group, tag); m; m &= m - 1) {
+                    long index = (pos + lowest_byte(m)) & mask;
+                    if (ctrl[index] == tag && entries[index].key == key) return index;
+                }
+                if (match_empty(group)) return -1;
+                pos = (pos + GROUP_SIZE) & mask;
+            }
+            return -1;
+        }
+
+        inline long find_free(uint64_t h) const {
+            long mask = capacity - 1;
+            long pos = (long) (h >> 7) & mask;
+            while (true) {
+                uint64_t m = match_empty_or_deleted(load_group(pos));
+                if (m) return (pos + lowest_byte(m)) & mask;
+                pos = (pos + GROUP_SIZE) & mask;
+            }
+        }
+
+        inline long insert_new(Vector2i key, uint64_t h) {
+            if ((count + tombstones + 1) * 8 > capacity * 7) {
+                // Mostly tombstones, so cleaning them up is enough
+                long next = capacity && count * 2 < capacity ? capacity : math::MAX(capacity * 2, GROUP_SIZE * 2);
+                rehash(next);
+            }
+
+            long index = find_free(h);
+            if (ctrl[index] == DELETED) --tombstones;
+            set_ctrl(index, h2(h));
+            entries[index].key = key;
+            entries[index].value = V();
+            ++count;
+            return index;
+        }
+
+        void rehash(long new_capacity) {
+            uint8_t *old_ctrl = ctrl;
+            Entry *old_entries = entries;
+            long old_capacity = capacity;
+
+            capacity = new_capacity;
+            ctrl = new uint8_t[capacity + GROUP_SIZE];
+            entries = new Entry[capacity];
+            memset(ctrl, EMPTY, capacity + GROUP_SIZE);
+            count = 0;
+            tombstones = 0;
+
+            for (long i = 0; i < old_capacity; ++i) {
+                if (!is_full(old_ctrl[i])) continue;
+                uint64_t h = hash(old_entries[i].key);
+                long index = find_free(h);
+                set_ctrl(index, h2(h));
+                entries[index].key = old_entries[i].key;
+                entries[index].value = (V &&) old_entries[i].value;
+                ++count;
+            }
+
+            delete[] old_ctrl;
+            delete[] old_entries;
+        }
+
+        inline void release() {
+            delete[] ctrl;
+            delete[] entries;
+            ctrl = nullptr;
+            entries = nullptr;
+            capacity = count = tombstones = 0;
+        }
+
+        uint8_t *ctrl = nullptr;
+        Entry *entries = nullptr;
+        long capacity = 0;
+        long count = 0;
+        long tombstones = 0;
+    };
+
+}// namespace jovial
@@ -7,8 +7,14 @@
 #include "Jovial/Std/Os.h"
 
 #define JOVIAL_TILEMAP_IMPLEMENTATION
+#include "FileWatcher.h"
+#include "InputTape.h"
 #include "JovialTileMap.h"
 #include "TileMapEditor.h"
+#include "TileMapLod.h"
+#include "TileMapPathfinder.h"
+#include "TileMapRenderer.h"
+#include "Benchmarks.h"
 
 #include "../assets.h"
 
@@ -21,6 +27,14 @@ using namespace jovial;
 fs::Path TEXTURE_PATH;
 Vector2 TILE_SIZE{16, 16};
 TileMapEditor::TileMapMode MODE;
+fs::Path RECORD_PATH;// Input recording to write with -record, or to play back with -replay
+bool RECORDING = false;
+bool REPLAYING = false;
+bool HEADLESS = false;
+fs::Path EXPORT_MAP_PATH;// Saved map to draw to EXPORT_IMAGE_PATH with -export, no window needed
+fs::Path EXPORT_IMAGE_PATH;
+bool EXPORTING = false;
+int THUMBNAIL_SIZE = 0;   // Longest side of the exported image, 0 for full size
 
 class CameraControl : public Node {
 public:
@@ -31,6 +45,63 @@ public:
     Camera2D camera;
     Texture tileset_texture;
     Font font;
+    InputTape input;
+    bool headless = false;// Skips drawing, for replaying input without a window
+
+    // Everything birth() does past loading the assets, a headless replay has no texture to load
+    void start_map(const Tileset *tileset) {
+        tilemap.set_tileset(tileset);
+        tilemap.tile_size = {16, 16};
+        tilemap.using_vsize = false;
+
+        tilemap.place_auto({0, 0});
+        tilemap.place({10, 10}, {1, 0});
+        print("Path: ", rules_path.str);
+        String rule_file = fs::read_entire_file(rules_path);
+
+        tilemap.parse(rule_file.view());
+        rules_watcher.watch(rules_path);
+    }
+
+    // One frame of input and simulation, without drawing
+    void step() {
+        // Saving the rules swaps them in right away and retiles only the cells they can change, a few chunks per frame
+        if (rules_watcher.poll()) {
+            String rule_file = fs::read_entire_file(rules_path);
+            Vec<Vector2i> stale_outputs;
+            if (tilemap.reload(rule_file.view(), stale_outputs)) {
+                retile_job.start(&tilemap, tilemap.world_to_coord(camera.transform.position), stale_outputs);
+            }
+        }
+        if (!tilemap.journal.is_recording()) retile_job.update();
+
+        if (input.is_pressed(Actions::LeftMouseButton)) {
+            stroke.paint(&tilemap, tilemap.world_to_coord(input.get_mouse_position()), false);
+        } else {
+            stroke.finish();
+        }
+
+        if (input.is_pressed(Actions::MiddleMouseButton)) {
+            auto dir = input.get_mouse_delta() / camera.zoom * 0.2f;
+            camera.transform.position -= math::POW(dir, 2) * dir.sign();
+        }
+
+        if (input.get_scroll() != 0.0f) {
+            camera.zoom = math::CLAMP(camera.zoom + input.get_scroll() / 10, 0.1f, 5.0f);
+        }
+
+        // Ctrl+T writes the zones traced so far, only in builds with JOVIAL_TILEMAP_TRACE
+        if (input.is_just_pressed(Actions::T) && input.is_pressed(Actions::LeftControl)) {
+            JV_TILE_TRACE_DUMP((fs::Path::res() + "trace.json").c_str());
+        }
+    }
+
+    // The map with its journal and tileset share, plus the impostors
+    [[nodiscard]] MemoryStats memory_stats() const {
+        MemoryStats stats = tilemap.memory_stats();
+        stats += lod.memory_stats();
+        return stats;
+    }
 
 private:
     void birth() override {
@@ -46,18 +117,14 @@ private:
         rendering::set_aspect_mode(rendering::AspectModes::Expand);
         // editor.init(tileset_texture, &font, TILE_SIZE);
 
-        tilemap.texture = tileset_texture;
-        tilemap.tile_size = {16, 16};
-        tilemap.using_vsize = false;
-
-        tilemap.load_tiles();
-        tilemap.place_auto({0, 0});
-        tilemap.place({10, 10}, {1, 0});
-        fs::Path path = fs::Path("./src/tilemap.rules");
-        print("Path: ", path.str);
-        String rule_file = fs::read_entire_file(path);
+        // The map keeps its own reference to the tileset
+        Tileset *tileset = Tileset::create(tileset_texture, {16, 16});
+        tileset->set_pixels(image.pixels, image.width, image.height, image.channels);// For the zoomed out impostors
+        start_map(tileset);
+        Tileset::release(tileset);
 
-        tilemap.parse(rule_file.view());
+        if (REPLAYING) input.replay(RECORD_PATH);
+        else if (RECORDING) input.record(RECORD_PATH);
     }
 
     void update() override {
@@ -80,29 +147,48 @@ private:
         // if (Input::is_just_pressed(Actions::C)) {
         //     editor.tile_map->clear();
         // }
-        if (Input::is_pressed(Actions::LeftMouseButton)) {
-            tilemap.place_auto(tilemap.world_to_coord(Input::get_mouse_position()));
+        // A finished replay reports its frame times and hands back to the live input
+        if (!input.begin_frame()) {
+            input.print_frame_times("Replay");
+            input.begin_frame();
         }
-
-        if (Input::is_pressed(Actions::MiddleMouseButton)) {
-            auto dir = Input::get_mouse_delta() / camera.zoom * 0.2f;
-            camera.transform.position -= math::POW(dir, 2) * dir.sign();
+        step();
+        if (!headless) {
+            tilemap.visable = true;
+            lod.draw();
+            draw_memory_stats(as_ui({0, 10}));
         }
+        input.end_frame();
+    }
 
-        if (Input::get_scroll() != 0.0f) {
-            camera.zoom = math::CLAMP(camera.zoom + Input::get_scroll() / 10, 0.1f, 5.0f);
+    // Same line as the editor's, refreshed twice a second
+    void draw_memory_stats(Vector2 pos) {
+        auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<float>(now - memory_stats_time).count() > 0.5f) {
+            memory_stats_time = now;
+            MemoryStats stats = memory_stats();
+            auto kb = [](long bytes) { return (int) ((bytes + 1023) / 1024); };
+            snprintf(memory_status, sizeof(memory_status), "Memory %d KB: cells %d, chunks %d, uvs %d, rules %d, undo %d, meshes %d",
+                     kb(stats.total()), kb(stats.cells), kb(stats.chunk_overhead), kb(stats.uv_tables),
+                     kb(stats.rule_tables), kb(stats.undo_history), kb(stats.cached_meshes));
         }
-
-        tilemap.visable = true;
-        tilemap.draw();
+        font.draw(pos, memory_status, {.color = Colors::White, .font_size = 16.0f / Camera2D::get_current_zoom()});
     }
 
     void death() override {
+        input.stop();
         destroy_font(&font);
         rendering::unload_texture(tileset_texture);
     }
 
     RuleTileMap tilemap;
+    TileMapLod lod{&tilemap};// Draws a chunk per quad when zoomed far out
+    TileStroke stroke;
+    fs::Path rules_path = fs::Path("./src/tilemap.rules");
+    FileWatcher rules_watcher;
+    TileRetileJob retile_job;
+    char memory_status[128] = "";
+    std::chrono::steady_clock::time_point memory_stats_time;
     // TileMapEditor editor;
 };
 
@@ -117,8 +203,86 @@ public:
     }
 };
 
+// Plays the recording back through the same step() as the window, without one, as fast as it goes
+static int replay_headless() {
+    CameraControl control;
+    control.headless = true;
+    if (!control.input.replay(RECORD_PATH)) return 1;
+
+    control.start_map(nullptr);
+    while (control.input.begin_frame()) {
+        control.step();
+        control.input.end_frame();
+    }
+    control.input.print_frame_times("Headless replay");
+    return 0;
+}
+
+// Loads every saved map given and prints what each one takes in memory as JSON, for budgeting levels
+static int print_memory_stats(int count, char **paths) {
+    printf("[");
+    for (int i = 0; i < count; ++i) {
+        WangTileMap map;
+        TileMapLoader loader;
+        bool loaded = loader.load(&map, fs::Path(paths[i]), {0, 0});
+        while (loaded && loader.update(INT32_MAX)) std::this_thread::yield();
+        loaded = loaded && loader.get_status() == TileMapLoader::Status::Done;
+
+        printf("%s\n  {\"path\": \"%s\", \"loaded\": %s, \"tiles\": %ld, \"chunks\": %ld, \"memory\": %s}",
+               i ? "," : "", paths[i], loaded ? "true" : "false", map.tiles.size(), map.tiles.chunk_count(), map.memory_stats().to_json().c_str());
+    }
+    printf("\n]\n");
+    return 0;
+}
+
+// Draws a saved map with the tileset image into a PNG, on the CPU so it runs without a window
+static int export_map() {
+    Image image(TEXTURE_PATH);
+    if (!image.pixels) {
+        JV_CORE_ERROR("Could not load the tileset image ", TEXTURE_PATH.c_str());
+        return 1;
+    }
+    Texture atlas;// Only the size is read, there is no GL context to upload to
+    atlas.width = image.width;
+    atlas.height = image.height;
+    Tileset *tileset = Tileset::create(atlas, TILE_SIZE);
+    tileset->set_pixels(image.pixels, image.width, image.height, image.channels);
+
+    WangTileMap map;
+    map.set_tileset(tileset);
+    Tileset::release(tileset);
+    TileMapLoader loader;
+    bool loaded = loader.load(&map, EXPORT_MAP_PATH, {0, 0});
+    while (loaded && loader.update(INT32_MAX)) std::this_thread::yield();
+    if (!loaded || loader.get_status() != TileMapLoader::Status::Done || map.tiles.is_empty()) {
+        JV_CORE_ERROR("Nothing to export from ", EXPORT_MAP_PATH.c_str());
+        return 1;
+    }
+
+    Vector2i min(INT32_MAX, INT32_MAX), max(INT32_MIN, INT32_MIN);
+    for (auto &tile: map.tiles) {
+        min = min.min(tile.key);
+        max = max.max(tile.key);
+    }
+    TileImage out;
+    bool drawn = THUMBNAIL_SIZE > 0 ? TileMapRenderer::thumbnail(&map, min, max, THUMBNAIL_SIZE, out)
+                                    : TileMapRenderer::render(&map, min, max, 0, out);
+    if (!drawn || !TileMapRenderer::write_png(EXPORT_IMAGE_PATH, out)) return 1;
+    print("Exported ", out.width, "x", out.height, " image of ", EXPORT_MAP_PATH.c_str(), " to ", EXPORT_IMAGE_PATH.c_str());
+    return 0;
+}
+
 int main(int argc, char **argv) {
-    JV_ASSERT(argc >= 2, "Expected usage: jovial_tiles <your_tilemap.png> [-size x y] [-wang] [-blob]");
+    if (argc >= 2 && String(argv[1]) == "-bench") {
+        benchmarks::run_all();
+        JV_TILE_TRACE_DUMP("bench_trace.json");
+        return 0;
+    }
+    if (argc >= 2 && String(argv[1]) == "-memory") {
+        return print_memory_stats(argc - 2, argv + 2);
+    }
+
+    JV_ASSERT(argc >= 2, "Expected usage: jovial_tiles <your_tilemap.png> [-size x y] [-wang] [-blob] [-record file | -replay file [-headless]] [-export map out.png [-thumbnail size]] | jovial_tiles -bench | jovial_tiles -memory <maps...>");
 
     TEXTURE_PATH = os::cwd();
     TEXTURE_PATH += String(argv[1]);
@@ -136,6 +300,34 @@ int main(int argc, char **argv) {
         if (arg == "-blob") {
             MODE = TileMapEditor::TileMapMode::Blob;
         }
+        if (arg == "-record" || arg == "-replay") {
+            JV_ASSERT(argc >= i + 2);
+            RECORD_PATH = fs::Path(String(argv[i + 1]));
+            RECORDING = arg == "-record";
+            REPLAYING = arg == "-replay";
+        }
+        if (arg == "-headless") {
+            HEADLESS = true;
+        }
+        if (arg == "-export") {
+            JV_ASSERT(argc >= i + 3);
+            EXPORT_MAP_PATH = fs::Path(String(argv[i + 1]));
+            EXPORT_IMAGE_PATH = fs::Path(String(argv[i + 2]));
+            EXPORTING = true;
+        }
+        if (arg == "-thumbnail") {
+            JV_ASSERT(argc >= i + 2);
+            THUMBNAIL_SIZE = (int) String(argv[i + 1]).to_float();
+        }
+    }
+
+    if (EXPORTING) {
+        return export_map();
+    }
+
+    if (HEADLESS) {
+        JV_ASSERT(REPLAYING, "-headless only works with -replay");
+        return replay_headless();
     }
 
     Game game;